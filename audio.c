@@ -20,6 +20,10 @@
 #include <string.h>
 #include <math.h>
 #include <sched.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/eventfd.h>
 
 #include <alsa/asoundlib.h>
 
@@ -46,6 +50,8 @@ typedef struct _audio_module_
     const char *Name;			///< audio output module name
 
     int (*const Thread) (void);		///< module thread handler
+    int16_t *(*const DirectBegin) (int);	///< begin direct write into hw buffer
+    void (*const DirectCommit) (int);	///< commit direct write
     void (*const FlushBuffers) (void);	///< flush sample buffers
      int64_t(*const GetDelay) (void);	///< get current audio delay
     void (*const SetVolume) (int);	///< set output volume
@@ -65,6 +71,7 @@ static const AudioModule NoopModule;	///< forward definition of noop module
 char AudioAlsaDriverBroken;		///< disable broken driver message
 char AudioAlsaNoCloseOpen;		///< disable alsa close/open fix
 char AudioAlsaCloseOpenDelay;		///< enable alsa close/open delay fix
+char AudioAlsaMmap;			///< enable alsa mmap zero-copy playback
 
 static const char *AudioModuleName;	///< which audio module to use
 
@@ -79,6 +86,8 @@ static volatile char AudioRunning;	///< thread running / stopped
 static volatile char AudioPaused;	///< audio paused
 static volatile char AudioVideoIsReady; ///< video ready start early
 static int AudioSkip;			///< skip audio to sync to video
+static unsigned AudioDirectWrites;	///< packets written direct into hw buffer
+static unsigned AudioRingWrites;	///< packets written into the ring buffer
 
 static const int AudioBytesProSample = 2;   ///< number of bytes per sample
 
@@ -89,7 +98,9 @@ static pthread_mutex_t AudioMutex;	///< audio condition mutex
 pthread_mutex_t PTS_mutex;		///< PTS mutex
 pthread_mutex_t ReadAdvance_mutex;	///< PTS mutex
 static pthread_cond_t AudioStartCond;	///< condition variable
+static pthread_cond_t AudioFlushCond;	///< flush done condition variable
 static char AudioThreadStop;		///< stop audio thread
+static int AudioEventFd = -1;		///< wakeup play thread, new samples/flush
 
 static char AudioSoftVolume;		///< flag use soft volume
 static char AudioNormalize;		///< flag use volume normalize
@@ -141,8 +152,78 @@ static const unsigned AudioRatesTable[AudioRatesMax] = {
 //  filter
 //----------------------------------------------------------------------------
 
+//
+//  The dsp kernels are plain branch free loops, which the compiler
+//  vectorizes.  On x86 a version for each vector width is built and the
+//  best one for the cpu is selected at runtime.
+//
+#if defined(__GNUC__) && !defined(__clang__) && defined(__x86_64__)
+#define AUDIO_DSP_KERNEL __attribute__ ((target_clones("avx2", "sse4.1", "default"), optimize("tree-vectorize")))
+#elif defined(__GNUC__) && !defined(__clang__)
+#define AUDIO_DSP_KERNEL __attribute__ ((optimize("tree-vectorize")))
+#else
+#define AUDIO_DSP_KERNEL
+#endif
+
+/**
+**	Scale samples with clipping.
+**
+**	@param samples	sample buffer
+**	@param n	number of samples in sample buffer
+**	@param factor	scale factor * 1000
+*/
+AUDIO_DSP_KERNEL static void AudioScaleSamples(int16_t * samples, int n, int factor)
+{
+    for (int i = 0; i < n; ++i) {
+	int t;
+
+	t = (samples[i] * factor) / 1000;
+	t = t < INT16_MIN ? INT16_MIN : t;
+	t = t > INT16_MAX ? INT16_MAX : t;
+	samples[i] = t;
+    }
+}
+
+/**
+**	Find loudest sample.
+**
+**	@param samples	sample buffer
+**	@param n	number of samples in sample buffer
+**
+**	@returns absolute value of the loudest sample.
+*/
+AUDIO_DSP_KERNEL static int AudioMaxSample(const int16_t * samples, int n)
+{
+    int max_sample = 0;
+
+    for (int i = 0; i < n; ++i) {
+	int t = abs(samples[i]);
+
+	max_sample = t > max_sample ? t : max_sample;
+    }
+    return max_sample;
+}
+
 static const int AudioNormSamples = 4096;   ///< number of samples
 
+/**
+**	Sum of the scaled squares of samples.
+**
+**	@param samples	sample buffer
+**	@param n	number of samples in sample buffer
+*/
+AUDIO_DSP_KERNEL static uint32_t AudioNormSquares(const int16_t * samples, int n)
+{
+    uint32_t sum = 0;
+
+    for (int i = 0; i < n; ++i) {
+	int t = samples[i];
+
+	sum += (t * t) / AudioNormSamples;
+    }
+    return sum;
+}
+
 #define AudioNormMaxIndex 128		///< number of average values
     /// average of n last sample blocks
 static uint32_t AudioNormAverage[AudioNormMaxIndex];
@@ -173,13 +254,7 @@ static void AudioNormalizer(int16_t * samples, int count)
 	if (AudioNormCounter + n > AudioNormSamples) {
 	    n = AudioNormSamples - AudioNormCounter;
 	}
-	avg = AudioNormAverage[AudioNormIndex];
-	for (i = 0; i < n; ++i) {
-	    int t;
-
-	    t = data[i];
-	    avg += (t * t) / AudioNormSamples;
-	}
+	avg = AudioNormAverage[AudioNormIndex] + AudioNormSquares(data, n);
 	AudioNormAverage[AudioNormIndex] = avg;
 	AudioNormCounter += n;
 	if (AudioNormCounter >= AudioNormSamples) {
@@ -218,17 +293,7 @@ static void AudioNormalizer(int16_t * samples, int count)
     } while (l > 0);
 
     // apply normalize factor
-    for (i = 0; i < count / AudioBytesProSample; ++i) {
-	int t;
-
-	t = (samples[i] * AudioNormalizeFactor) / 1000;
-	if (t < INT16_MIN) {
-	    t = INT16_MIN;
-	} else if (t > INT16_MAX) {
-	    t = INT16_MAX;
-	}
-	samples[i] = t;
-    }
+    AudioScaleSamples(samples, count / AudioBytesProSample, AudioNormalizeFactor);
 }
 
 /**
@@ -255,15 +320,7 @@ static void AudioResetNormalizer(void)
 static void AudioCompressor(int16_t * samples, int count)
 {
     // find loudest sample
-    int max_sample = 0;
-
-    for (int i = 0; i < count / AudioBytesProSample; ++i) {
-	int t = abs(samples[i]);
-
-	if (t > max_sample) {
-	    max_sample = t;
-	}
-    }
+    int max_sample = AudioMaxSample(samples, count / AudioBytesProSample);
 
     // calculate compression factor
     if (max_sample > 0) {
@@ -282,17 +339,7 @@ static void AudioCompressor(int16_t * samples, int count)
 	    AudioCompressionFactor / 1000.0);
 
 	// apply compression factor
-	for (int i = 0; i < count / AudioBytesProSample; ++i) {
-	    int t;
-
-	    t = (samples[i] * AudioCompressionFactor) / 1000;
-	    if (t < INT16_MIN) {
-		t = INT16_MIN;
-	    } else if (t > INT16_MAX) {
-		t = INT16_MAX;
-	    }
-	    samples[i] = t;
-	}
+	AudioScaleSamples(samples, count / AudioBytesProSample, AudioCompressionFactor);
     }
 }
 
@@ -317,25 +364,13 @@ static void AudioResetCompressor(void)
 */
 static void AudioSoftAmplifier(int16_t * samples, int count)
 {
-    int i;
-
     // silence
     if (AudioMute || !AudioAmplifier) {
 	memset(samples, 0, count);
 	return;
     }
 
-    for (i = 0; i < count / AudioBytesProSample; ++i) {
-	int t;
-
-	t = (samples[i] * AudioAmplifier) / 1000;
-	if (t < INT16_MIN) {
-	    t = INT16_MIN;
-	} else if (t > INT16_MAX) {
-	    t = INT16_MAX;
-	}
-	samples[i] = t;
-    }
+    AudioScaleSamples(samples, count / AudioBytesProSample, AudioAmplifier);
 }
 
 /**
@@ -365,7 +400,7 @@ static void AudioMono2Stereo(const int16_t * in, int frames, int16_t * out)
 **	@param frames	number of frames in sample buffer
 **	@param out	output sample buffer
 */
-static void AudioStereo2Mono(const int16_t * in, int frames, int16_t * out)
+AUDIO_DSP_KERNEL static void AudioStereo2Mono(const int16_t * in, int frames, int16_t * out)
 {
     int i;
 
@@ -374,6 +409,22 @@ static void AudioStereo2Mono(const int16_t * in, int frames, int16_t * out)
     }
 }
 
+    /// surround to stereo downmix factors * 1000, [in_chan][left/right][channel]
+static const int AudioDownmixMatrix[9][2][8] = {
+    // stereo or surround? =>stereo: L R C
+    [3] = {{600, 0, 400}, {0, 600, 400}},
+    // quad or surround? =>quad: L R Ls Rs
+    [4] = {{600, 0, 400, 0}, {0, 600, 0, 400}},
+    // 5.0: L R Ls Rs C
+    [5] = {{500, 0, 200, 0, 300}, {0, 500, 0, 200, 300}},
+    // 5.1: L R Ls Rs C LFE
+    [6] = {{400, 0, 200, 0, 300, 100}, {0, 400, 0, 200, 300, 100}},
+    // 7.0: L R Ls Rs C RL RR
+    [7] = {{400, 0, 200, 0, 300, 100, 0}, {0, 400, 0, 200, 300, 0, 100}},
+    // 7.1: L R Ls Rs C LFE RL RR
+    [8] = {{400, 0, 150, 0, 250, 100, 100, 0}, {0, 400, 0, 150, 250, 100, 0, 100}},
+};
+
 /**
 **	Downmix surround to stereo.
 **
@@ -386,67 +437,26 @@ static void AudioStereo2Mono(const int16_t * in, int frames, int16_t * out)
 **	@param frames	number of frames in sample buffer
 **	@param out	output sample buffer
 */
-static void AudioSurround2Stereo(const int16_t * in, int in_chan, int frames, int16_t * out)
+AUDIO_DSP_KERNEL static void AudioSurround2Stereo(const int16_t * in, int in_chan, int frames, int16_t * out)
 {
+    const int *left;
+    const int *right;
+
+    if (in_chan < 3 || in_chan > 8) {
+	abort();
+    }
+    left = AudioDownmixMatrix[in_chan][0];
+    right = AudioDownmixMatrix[in_chan][1];
+
     while (frames--) {
 	int l;
 	int r;
 
-	switch (in_chan) {
-	    case 3:		       // stereo or surround? =>stereo
-		l = in[0] * 600;	// L
-		r = in[1] * 600;	// R
-		l += in[2] * 400;	// C
-		r += in[2] * 400;
-		break;
-	    case 4:		       // quad or surround? =>quad
-		l = in[0] * 600;	// L
-		r = in[1] * 600;	// R
-		l += in[2] * 400;	// Ls
-		r += in[3] * 400;	// Rs
-		break;
-	    case 5:		       // 5.0
-		l = in[0] * 500;	// L
-		r = in[1] * 500;	// R
-		l += in[2] * 200;	// Ls
-		r += in[3] * 200;	// Rs
-		l += in[4] * 300;	// C
-		r += in[4] * 300;
-		break;
-	    case 6:		       // 5.1
-		l = in[0] * 400;	// L
-		r = in[1] * 400;	// R
-		l += in[2] * 200;	// Ls
-		r += in[3] * 200;	// Rs
-		l += in[4] * 300;	// C
-		r += in[4] * 300;
-		l += in[5] * 100;	// LFE
-		r += in[5] * 100;
-		break;
-	    case 7:		       // 7.0
-		l = in[0] * 400;	// L
-		r = in[1] * 400;	// R
-		l += in[2] * 200;	// Ls
-		r += in[3] * 200;	// Rs
-		l += in[4] * 300;	// C
-		r += in[4] * 300;
-		l += in[5] * 100;	// RL
-		r += in[6] * 100;	// RR
-		break;
-	    case 8:		       // 7.1
-		l = in[0] * 400;	// L
-		r = in[1] * 400;	// R
-		l += in[2] * 150;	// Ls
-		r += in[3] * 150;	// Rs
-		l += in[4] * 250;	// C
-		r += in[4] * 250;
-		l += in[5] * 100;	// LFE
-		r += in[5] * 100;
-		l += in[6] * 100;	// RL
-		r += in[7] * 100;	// RR
-		break;
-	    default:
-		abort();
+	l = 0;
+	r = 0;
+	for (int i = 0; i < in_chan; ++i) {
+	    l += in[i] * left[i];
+	    r += in[i] * right[i];
 	}
 	in += in_chan;
 
@@ -537,6 +547,55 @@ static void AudioResample(const int16_t * in, int in_chan, int frames, int16_t *
     }
 }
 
+//----------------------------------------------------------------------------
+//  thread events
+//----------------------------------------------------------------------------
+
+/**
+**	Wakeup audio play thread, new samples or flush queued.
+*/
+static void AudioEventSignal(void)
+{
+    uint64_t one;
+
+    one = 1;
+    if (AudioEventFd >= 0 && write(AudioEventFd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+	Error("audio: can't signal play thread: %s", strerror(errno));
+    }
+}
+
+/**
+**	Clear pending audio play thread wakeups.
+*/
+static void AudioEventClear(void)
+{
+    uint64_t count;
+
+    if (AudioEventFd >= 0 && read(AudioEventFd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+	Error("audio: can't clear play thread event: %s", strerror(errno));
+    }
+}
+
+/**
+**	Wait for new samples or commands.
+**
+**	@param timeout	timeout in ms
+*/
+static void AudioEventWait(int timeout)
+{
+    struct pollfd fds[1];
+
+    if (AudioEventFd < 0) {
+	usleep(timeout * 1000);
+	return;
+    }
+    fds[0].fd = AudioEventFd;
+    fds[0].events = POLLIN;
+    if (poll(fds, 1, timeout) > 0) {
+	AudioEventClear();
+    }
+}
+
 //----------------------------------------------------------------------------
 //  ring buffer
 //----------------------------------------------------------------------------
@@ -566,6 +625,38 @@ static int AudioRingRead;		///< audio ring read pointer
 static atomic_t AudioRingFilled;	///< how many of the ring is used
 static unsigned AudioStartThreshold;	///< start play, if filled
 
+#define AUDIO_SCRATCH_ALIGN 64		///< alignment of the scratch buffer
+
+static int16_t *AudioRingScratch;	///< resample scratch buffer
+static size_t AudioRingScratchSize;	///< size of resample scratch buffer
+
+/**
+**	Get resample scratch buffer.
+**
+**	The buffer is aligned for the dsp kernels and only grows, it is
+**	used by the single writer of the audio ring.
+**
+**	@param size	number of bytes needed
+**
+**	@returns pointer to the scratch buffer, NULL if out of memory.
+*/
+static int16_t *AudioRingScratchBuffer(size_t size)
+{
+    if (size > AudioRingScratchSize) {
+	void *buffer;
+
+	size = (size + AUDIO_SCRATCH_ALIGN - 1) & ~(size_t) (AUDIO_SCRATCH_ALIGN - 1);
+	if (posix_memalign(&buffer, AUDIO_SCRATCH_ALIGN, size)) {
+	    Error("audio: can't allocate %zd bytes scratch buffer", size);
+	    return NULL;
+	}
+	free(AudioRingScratch);
+	AudioRingScratch = buffer;
+	AudioRingScratchSize = size;
+    }
+    return AudioRingScratch;
+}
+
 /**
 **	Add sample-rate, number of channels change to ring.
 **
@@ -659,6 +750,9 @@ static void AudioRingExit(void)
 	AudioRing[i].HwSampleRate = 0;	// checked for valid setup
 	AudioRing[i].InSampleRate = 0;
     }
+    free(AudioRingScratch);
+    AudioRingScratch = NULL;
+    AudioRingScratchSize = 0;
     AudioRingRead = 0;
     AudioRingWrite = 0;
 }
@@ -674,6 +768,35 @@ static void AudioRingExit(void)
 static snd_pcm_t *AlsaPCMHandle;	///< alsa pcm handle
 static char AlsaCanPause;		///< hw supports pause
 static int AlsaUseMmap;			///< use mmap
+static snd_pcm_uframes_t AlsaDirectOffset;  ///< offset of direct mmap write
+
+static int AlsaSetupRate;		///< configured sample rate, 0 none
+static int AlsaSetupChannels;		///< configured channels
+static int AlsaSetupPassthrough;	///< configured pass-through
+static int AlsaSetupBufferTime;		///< requested kernel buffer time in ms
+static int AlsaQuirks;			///< quirks of the opened device
+
+#define ALSA_QUIRK_REOPEN	1	///< close+open on every setup
+#define ALSA_QUIRK_REOPEN_DELAY	2	///< delay between close and open
+
+///
+///	Alsa device quirk table entry.
+///
+typedef struct _alsa_quirk_
+{
+    const char *Device;			///< sub-string of device name
+    int Quirks;				///< ALSA_QUIRK_* flags
+} AlsaQuirk;
+
+///
+///	HDMI sinks which need the close+open workaround even if the format
+///	is unchanged, first match wins.  Format changes always reopen the
+///	pcm, unless disabled with alsa-no-close-open.
+///
+static const AlsaQuirk AlsaQuirkTable[] = {
+    {"vc4hdmi", ALSA_QUIRK_REOPEN | ALSA_QUIRK_REOPEN_DELAY},	// rpi no sound bug
+    {"vc4-hdmi", ALSA_QUIRK_REOPEN | ALSA_QUIRK_REOPEN_DELAY},
+};
 
 static snd_mixer_t *AlsaMixer;		///< alsa mixer handle
 static snd_mixer_elem_t *AlsaMixerElem; ///< alsa pcm mixer element
@@ -697,7 +820,8 @@ static int AlsaPlayRingbuffer(void)
     int first;
 
     first = 1;
-    for (;;) {				// loop for ring buffer wrap
+    // mirrored ring buffers give all used bytes at once, else loop for wrap
+    for (;;) {
 	int avail;
 	int n;
 	int err;
@@ -805,6 +929,72 @@ static int AlsaPlayRingbuffer(void)
     return 0;
 }
 
+/**
+**	Begin direct write into the alsa mmap buffer.
+**
+**	Only possible, if the device is running with mmap access and the
+**	requested frames are free and contiguous in the kernel buffer.
+**	On success the alsa lock is held until AlsaDirectCommit().
+**
+**	@param frames	number of frames to write
+**
+**	@returns pointer to the interleaved samples of the frames, NULL if
+**	the samples must go through the ring buffer.
+*/
+static int16_t *AlsaDirectBegin(int frames)
+{
+    const snd_pcm_channel_area_t *areas;
+    snd_pcm_uframes_t offset;
+    snd_pcm_uframes_t n;
+    snd_pcm_sframes_t avail;
+    int err;
+
+    if (!AlsaPCMHandle || !AlsaUseMmap) {
+	return NULL;
+    }
+    pthread_mutex_lock(&ReadAdvance_mutex);
+    if (snd_pcm_state(AlsaPCMHandle) != SND_PCM_STATE_RUNNING
+	|| (avail = snd_pcm_avail_update(AlsaPCMHandle)) < frames) {
+	pthread_mutex_unlock(&ReadAdvance_mutex);
+	return NULL;			// kernel buffer full
+    }
+
+    n = frames;
+    if ((err = snd_pcm_mmap_begin(AlsaPCMHandle, &areas, &offset, &n)) < 0) {
+	Debug5("audio/alsa: snd_pcm_mmap_begin(): %s", snd_strerror(err));
+	pthread_mutex_unlock(&ReadAdvance_mutex);
+	return NULL;
+    }
+    // interleaved 16 bit samples, not wrapped at the end of the buffer
+    if (n < (snd_pcm_uframes_t) frames || areas[0].first
+	|| areas[0].step != (unsigned)snd_pcm_frames_to_bytes(AlsaPCMHandle, 1) * 8) {
+	snd_pcm_mmap_commit(AlsaPCMHandle, offset, 0);
+	pthread_mutex_unlock(&ReadAdvance_mutex);
+	return NULL;
+    }
+    AlsaDirectOffset = offset;
+
+    return (int16_t *) ((uint8_t *) areas[0].addr + offset * (areas[0].step / 8));
+}
+
+/**
+**	Commit direct write into the alsa mmap buffer.
+**
+**	@param frames	number of frames written, 0 to cancel
+*/
+static void AlsaDirectCommit(int frames)
+{
+    snd_pcm_sframes_t err;
+
+    if ((err = snd_pcm_mmap_commit(AlsaPCMHandle, AlsaDirectOffset, frames)) != frames) {
+	Error("audio/alsa: snd_pcm_mmap_commit(): %s", err < 0 ? snd_strerror(err) : "short commit");
+	if (err < 0) {
+	    snd_pcm_recover(AlsaPCMHandle, err, 0);
+	}
+    }
+    pthread_mutex_unlock(&ReadAdvance_mutex);
+}
+
 /**
 **	Flush alsa buffers.
 */
@@ -833,10 +1023,14 @@ static void AlsaFlushBuffers(void)
 //  thread playback
 //----------------------------------------------------------------------------
 
+#define ALSA_POLL_MAX 8			///< max. alsa pcm poll descriptors
+
 /**
 **	Alsa thread
 **
-**	Play some samples and return.
+**	Play some samples and return.  Waits on the pcm poll descriptors
+**	and the audio event, so samples are written as soon as period
+**	space is free, new samples arrived or a command is queued.
 **
 **	@retval	-1	error
 **	@retval 0	underrun
@@ -844,6 +1038,7 @@ static void AlsaFlushBuffers(void)
 */
 static int AlsaThread(void)
 {
+    struct pollfd fds[ALSA_POLL_MAX + 1];
     int err;
 
     if (!AlsaPCMHandle) {
@@ -851,17 +1046,47 @@ static int AlsaThread(void)
 	return -1;
     }
     for (;;) {
+	unsigned short revents;
+	int n;
+
 	if (AudioPaused) {
 	    return 1;
 	}
-	// wait for space in kernel buffers
-	if ((err = snd_pcm_wait(AlsaPCMHandle, 24)) < 0) {
+	// wait for space in kernel buffers, new samples or commands
+	if ((n = snd_pcm_poll_descriptors(AlsaPCMHandle, fds, ALSA_POLL_MAX)) < 0) {
+	    Error("audio/alsa: snd_pcm_poll_descriptors(): %s", snd_strerror(n));
+	    usleep(24 * 1000);
+	    return -1;
+	}
+	fds[n].fd = AudioEventFd;
+	fds[n].events = POLLIN;
+	fds[n].revents = 0;
+	if ((err = poll(fds, n + 1, 24)) < 0) {
+	    if (errno == EINTR) {
+		continue;
+	    }
+	    Error("audio/alsa: poll(): %s", strerror(errno));
+	    usleep(24 * 1000);
+	    return -1;
+	}
+	if (fds[n].revents & POLLIN) {
+	    AudioEventClear();
+	}
+	if (!err || !n) {		// timeout, try to play
+	    break;
+	}
+	if ((err = snd_pcm_poll_descriptors_revents(AlsaPCMHandle, fds, n, &revents)) < 0) {
+	    Error("audio/alsa: snd_pcm_poll_descriptors_revents(): %s", snd_strerror(err));
+	    break;
+	}
+	if (revents & POLLERR) {	// xrun or suspend
+	    err = snd_pcm_state(AlsaPCMHandle) == SND_PCM_STATE_SUSPENDED ? -ESTRPIPE : -EPIPE;
 	    Error("audio/alsa: wait underrun error? '%s'", snd_strerror(err));
 	    err = snd_pcm_recover(AlsaPCMHandle, err, 0);
 	    if (err >= 0) {
 		continue;
 	    }
-	    Error("audio/alsa: snd_pcm_wait(): %s", snd_strerror(err));
+	    Error("audio/alsa: snd_pcm_recover(): %s", snd_strerror(err));
 	    usleep(24 * 1000);
 	    return -1;
 	}
@@ -884,7 +1109,7 @@ static int AlsaThread(void)
 	    return 0;
 	}
 
-	usleep(24 * 1000);		// let fill/empty the buffers
+	AudioEventWait(24);		// let fill the buffers
     }
     return 1;
 }
@@ -900,6 +1125,7 @@ static snd_pcm_t *AlsaOpenPCM(int passthrough)
 {
     const char *device;
     snd_pcm_t *handle;
+    size_t i;
     int err;
 
     // &&|| hell
@@ -908,6 +1134,13 @@ static snd_pcm_t *AlsaOpenPCM(int passthrough)
 	&& !(device = AudioPCMDevice) && !(device = getenv("ALSA_DEVICE"))) {
 	device = "default";
     }
+    AlsaQuirks = 0;
+    for (i = 0; i < sizeof(AlsaQuirkTable) / sizeof(*AlsaQuirkTable); ++i) {
+	if (strcasestr(device, AlsaQuirkTable[i].Device)) {
+	    AlsaQuirks = AlsaQuirkTable[i].Quirks;
+	    break;
+	}
+    }
     if (!AudioDoingInit) {		// reduce blabla during init
 	Info("audio/alsa: using %sdevice '%s'", passthrough ? "pass-through " : "", device);
     }
@@ -1058,6 +1291,9 @@ static int64_t AlsaGetDelay(void)
 /**
 **	Setup alsa audio for requested format.
 **
+**	The pcm is kept open, if the format is unchanged and the device
+**	has no reopen quirk.
+**
 **	@param freq		sample frequency
 **	@param channels		number of channels
 **	@param passthrough	use pass-through (AC-3, ...) device
@@ -1073,11 +1309,42 @@ static int AlsaSetup(int *freq, int *channels, int passthrough)
     snd_pcm_uframes_t buffer_size;
     snd_pcm_uframes_t period_size;
     int delay;
+    int buffer_time;
+    int latency;
 
     if (!AlsaPCMHandle) {		// alsa not running yet
 	// FIXME: if open fails for fe. pass-through, we never recover
 	return -1;
     }
+    // buffer time/delay in ms
+    delay = AudioBufferTime;
+    if (VideoAudioDelay > 0) {
+	delay += VideoAudioDelay / 90;
+    }
+    // with mmap the start delay is buffered in the kernel buffer, the ring
+    // buffer runs empty and AudioEnqueue() can write direct
+    buffer_time = AudioAlsaMmap ? delay + 96 : 96;
+
+    if (AlsaSetupRate == *freq && AlsaSetupChannels == *channels && AlsaSetupPassthrough == passthrough
+	&& AlsaSetupBufferTime == buffer_time && !(AlsaQuirks & ALSA_QUIRK_REOPEN)) {
+	switch (snd_pcm_state(AlsaPCMHandle)) {
+	    case SND_PCM_STATE_PREPARED:
+	    case SND_PCM_STATE_RUNNING:
+		Debug5("audio/alsa: format unchanged, keep pcm open");
+		goto update;
+	    case SND_PCM_STATE_SETUP:
+	    case SND_PCM_STATE_XRUN:
+		if (!snd_pcm_prepare(AlsaPCMHandle)) {
+		    Debug5("audio/alsa: format unchanged, keep pcm open");
+		    goto update;
+		}
+		break;
+	    default:
+		break;
+	}
+    }
+    AlsaSetupRate = 0;			// invalid until set params succeeds
+
     if (!AudioAlsaNoCloseOpen) {	// close+open to fix HDMI no sound bug
 	snd_pcm_t *handle;
 
@@ -1085,7 +1352,7 @@ static int AlsaSetup(int *freq, int *channels, int passthrough)
 	// no lock needed, thread exit in main loop only
 	AlsaPCMHandle = NULL;		// other threads should check handle
 	snd_pcm_close(handle);
-	if (AudioAlsaCloseOpenDelay) {
+	if (AudioAlsaCloseOpenDelay || (AlsaQuirks & ALSA_QUIRK_REOPEN_DELAY)) {
 	    usleep(50 * 1000);		// 50ms delay for alsa recovery
 	}
 	// FIXME: can use multiple retries
@@ -1095,19 +1362,21 @@ static int AlsaSetup(int *freq, int *channels, int passthrough)
 	AlsaPCMHandle = handle;
     }
 
+    AlsaUseMmap = AudioAlsaMmap;
+    latency = buffer_time;
     for (;;) {
 	int err;
 
 	if ((err =
 		snd_pcm_set_params(AlsaPCMHandle, SND_PCM_FORMAT_S16,
 		    AlsaUseMmap ? SND_PCM_ACCESS_MMAP_INTERLEAVED : SND_PCM_ACCESS_RW_INTERLEAVED, *channels, *freq, 1,
-		    96 * 1000))) {
+		    latency * 1000))) {
 	    // try reduced buffer size (needed for sunxi)
 	    // FIXME: alternativ make this configurable
 	    if ((err =
 		    snd_pcm_set_params(AlsaPCMHandle, SND_PCM_FORMAT_S16,
 			AlsaUseMmap ? SND_PCM_ACCESS_MMAP_INTERLEAVED : SND_PCM_ACCESS_RW_INTERLEAVED, *channels,
-			*freq, 1, 72 * 1000))) {
+			*freq, 1, (latency - 24) * 1000))) {
 
 		/*
 		   if ( err == -EBADFD ) {
@@ -1117,6 +1386,12 @@ static int AlsaSetup(int *freq, int *channels, int passthrough)
 		   }
 		 */
 
+		if (AlsaUseMmap) {	// retry without mmap access
+		    Debug5("audio/alsa: mmap access unsupported: %s", snd_strerror(err));
+		    AlsaUseMmap = 0;
+		    latency = 96;
+		    continue;
+		}
 		if (!AudioDoingInit) {
 		    Error("audio/alsa: set params error: %s", snd_strerror(err));
 		}
@@ -1126,9 +1401,12 @@ static int AlsaSetup(int *freq, int *channels, int passthrough)
 	}
 	break;
     }
+    AlsaSetupRate = *freq;
+    AlsaSetupChannels = *channels;
+    AlsaSetupPassthrough = passthrough;
+    AlsaSetupBufferTime = buffer_time;
 
-    // update buffer
-
+  update:
     snd_pcm_get_params(AlsaPCMHandle, &buffer_size, &period_size);
     Debug5("audio/alsa: buffer size %lu %zdms, period size %lu %zdms", buffer_size,
 	snd_pcm_frames_to_bytes(AlsaPCMHandle, buffer_size) * 1000 / (*freq * *channels * AudioBytesProSample),
@@ -1137,11 +1415,6 @@ static int AlsaSetup(int *freq, int *channels, int passthrough)
     Debug5("audio/alsa: state %s", snd_pcm_state_name(snd_pcm_state(AlsaPCMHandle)));
 
     AudioStartThreshold = snd_pcm_frames_to_bytes(AlsaPCMHandle, period_size);
-    // buffer time/delay in ms
-    delay = AudioBufferTime;
-    if (VideoAudioDelay > 0) {
-	delay += VideoAudioDelay / 90;
-    }
     if (AudioStartThreshold < (*freq * *channels * AudioBytesProSample * delay) / 1000U) {
 	AudioStartThreshold = (*freq * *channels * AudioBytesProSample * delay) / 1000U;
     }
@@ -1149,6 +1422,24 @@ static int AlsaSetup(int *freq, int *channels, int passthrough)
     if (AudioStartThreshold > AudioRingBufferSize / 3) {
 	AudioStartThreshold = AudioRingBufferSize / 3;
     }
+    // the play thread writes the start delay at once, start the pcm then
+    // and not when the bigger kernel buffer is full
+    if (AlsaUseMmap) {
+	snd_pcm_sw_params_t *sw_params;
+	snd_pcm_uframes_t start;
+	int err;
+
+	snd_pcm_sw_params_alloca(&sw_params);
+	start = snd_pcm_bytes_to_frames(AlsaPCMHandle, AudioStartThreshold);
+	if (start > buffer_size) {
+	    start = buffer_size;
+	}
+	if ((err = snd_pcm_sw_params_current(AlsaPCMHandle, sw_params)) < 0
+	    || (err = snd_pcm_sw_params_set_start_threshold(AlsaPCMHandle, sw_params, start)) < 0
+	    || (err = snd_pcm_sw_params(AlsaPCMHandle, sw_params)) < 0) {
+	    Error("audio/alsa: can't set start threshold: %s", snd_strerror(err));
+	}
+    }
     if (!AudioDoingInit) {
 	Info("audio/alsa: start delay %ums", (AudioStartThreshold * 1000)
 	    / (*freq * *channels * AudioBytesProSample));
@@ -1235,6 +1526,7 @@ static void AlsaExit(void)
 	snd_pcm_close(AlsaPCMHandle);
 	AlsaPCMHandle = NULL;
     }
+    AlsaSetupRate = 0;
     if (AlsaMixer) {
 	snd_mixer_close(AlsaMixer);
 	AlsaMixer = NULL;
@@ -1248,6 +1540,8 @@ static void AlsaExit(void)
 static const AudioModule AlsaModule = {
     .Name = "alsa",
     .Thread = AlsaThread,
+    .DirectBegin = AlsaDirectBegin,
+    .DirectCommit = AlsaDirectCommit,
     .FlushBuffers = AlsaFlushBuffers,
     .GetDelay = AlsaGetDelay,
     .SetVolume = AlsaSetVolume,
@@ -1386,6 +1680,7 @@ static void *AudioPlayHandlerThread(void *dummy)
 	Debug5("audio: wait on start condition");
 	pthread_mutex_lock(&AudioMutex);
 	AudioRunning = 0;
+	pthread_cond_broadcast(&AudioFlushCond);    // flush must wake us again
 	do {
 	    pthread_cond_wait(&AudioStartCond, &AudioMutex);
 	    // cond_wait can return, without signal!
@@ -1427,6 +1722,9 @@ static void *AudioPlayHandlerThread(void *dummy)
 		Debug5("audio: flush %d ring buffer(s)", flush);
 		AudioUsedModule->FlushBuffers();
 		atomic_sub(flush, &AudioRingFilled);
+		pthread_mutex_lock(&AudioMutex);
+		pthread_cond_broadcast(&AudioFlushCond);
+		pthread_mutex_unlock(&AudioMutex);
 		if (AudioNextRing()) {
 		    Debug5("audio: break after flush");
 		    break;
@@ -1459,6 +1757,9 @@ static void *AudioPlayHandlerThread(void *dummy)
 
 		atomic_dec(&AudioRingFilled);
 		AudioRingRead = (AudioRingRead + 1) % AUDIO_RING_MAX;
+		pthread_mutex_lock(&AudioMutex);
+		pthread_cond_broadcast(&AudioFlushCond);
+		pthread_mutex_unlock(&AudioMutex);
 
 		passthrough = AudioRing[AudioRingRead].Passthrough;
 		sample_rate = AudioRing[AudioRingRead].HwSampleRate;
@@ -1490,11 +1791,20 @@ static void *AudioPlayHandlerThread(void *dummy)
 */
 static void AudioInitThread(void)
 {
+    pthread_condattr_t condattr;
+
     AudioThreadStop = 0;
+    if ((AudioEventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+	Error("audio: can't create play thread event: %s", strerror(errno));
+    }
     pthread_mutex_init(&AudioMutex, NULL);
     pthread_mutex_init(&PTS_mutex, NULL);
     pthread_mutex_init(&ReadAdvance_mutex, NULL);
     pthread_cond_init(&AudioStartCond, NULL);
+    pthread_condattr_init(&condattr);
+    pthread_condattr_setclock(&condattr, CLOCK_MONOTONIC);
+    pthread_cond_init(&AudioFlushCond, &condattr);
+    pthread_condattr_destroy(&condattr);
     pthread_create(&AudioThread, NULL, AudioPlayHandlerThread, NULL);
     pthread_setname_np(AudioThread, "vaapi audio");
 }
@@ -1516,10 +1826,15 @@ static void AudioExitThread(void)
 	    Error("audio: can't cancel play thread");
 	}
 	pthread_cond_destroy(&AudioStartCond);
+	pthread_cond_destroy(&AudioFlushCond);
 	pthread_mutex_destroy(&AudioMutex);
 	pthread_mutex_destroy(&PTS_mutex);
 	pthread_mutex_destroy(&ReadAdvance_mutex);
 	AudioThread = 0;
+	if (AudioEventFd >= 0) {
+	    close(AudioEventFd);
+	    AudioEventFd = -1;
+	}
     }
 }
 
@@ -1534,6 +1849,76 @@ static const AudioModule *AudioModules[] = {
     &NoopModule,
 };
 
+/**
+**	Convert samples to hardware format.
+**
+**	@param samples	input sample buffer
+**	@param frames	number of frames in sample buffer
+**	@param out	output sample buffer in hardware format
+**
+**	@returns number of bytes in output sample buffer.
+*/
+static int AudioConvert(const void *samples, int frames, int16_t * out)
+{
+    int count;
+
+    // Convert / resample input to hardware format
+    AudioResample(samples, AudioRing[AudioRingWrite].InChannels, frames, out, AudioRing[AudioRingWrite].HwChannels);
+    count = frames * AudioRing[AudioRingWrite].HwChannels * AudioBytesProSample;
+
+    if (AudioCompression) {		// in place operation
+	AudioCompressor(out, count);
+    }
+    if (AudioNormalize) {		// in place operation
+	AudioNormalizer(out, count);
+    }
+    return count;
+}
+
+/**
+**	Place samples directly in the hardware buffer.
+**
+**	Only used, if the play thread is running and has nothing queued,
+**	else the samples would overtake the ring buffer.
+**
+**	@param samples	sample buffer
+**	@param count	number of bytes in sample buffer
+**	@param convert	flag samples need conversion to hardware format
+**
+**	@returns number of bytes placed in the hardware buffer, 0 if the
+**	samples must go through the ring buffer.
+*/
+static int AudioEnqueueDirect(const void *samples, int count, int convert)
+{
+    int in_frames;
+    int frames;
+    int16_t *out;
+
+    in_frames = count / (AudioRing[AudioRingWrite].InChannels * AudioBytesProSample);
+    frames = convert ? in_frames : count / (int)(AudioRing[AudioRingWrite].HwChannels * AudioBytesProSample);
+    if (!frames || !(out = AudioUsedModule->DirectBegin(frames))) {
+	return 0;
+    }
+    if (RingBufferUsedBytes(AudioRing[AudioRingWrite].RingBuffer)) {
+	AudioUsedModule->DirectCommit(0);
+	return 0;
+    }
+
+    if (convert) {
+	count = AudioConvert(samples, in_frames, out);
+    } else {
+	count = frames * AudioRing[AudioRingWrite].HwChannels * AudioBytesProSample;
+	memcpy(out, samples, count);
+    }
+    // muting pass-through AC-3, can produce disturbance
+    if (AudioMute || (AudioSoftVolume && !AudioRing[AudioRingWrite].Passthrough)) {
+	AudioSoftAmplifier(out, count);
+    }
+    AudioUsedModule->DirectCommit(frames);
+
+    return count;
+}
+
 /**
 **	Place samples in audio output queue.
 **
@@ -1543,6 +1928,8 @@ static const AudioModule *AudioModules[] = {
 void AudioEnqueue(const void *samples, int count)
 {
     size_t n;
+    int empty;
+    int convert;
     int16_t *buffer;
 
     if (!AudioRing[AudioRingWrite].HwSampleRate) {
@@ -1555,29 +1942,44 @@ void AudioEnqueue(const void *samples, int count)
 	Debug5("audio: a/v packet size %d bytes", count);
     }
     // audio sample modification allowed and needed?
+    convert = !AudioRing[AudioRingWrite].Passthrough && (AudioCompression || AudioNormalize
+	|| AudioRing[AudioRingWrite].InChannels != AudioRing[AudioRingWrite].HwChannels);
+
+    // zero-copy: running and nothing queued, write into the hw buffer
+    if (AudioUsedModule->DirectBegin && AudioRunning && !AudioPaused && !AudioSkip
+	&& !atomic_read(&AudioRingFilled)) {
+	int direct;
+
+	pthread_mutex_lock(&PTS_mutex);
+	if ((direct = AudioEnqueueDirect(samples, count, convert))) {
+	    AudioDirectWrites++;
+	    if (AudioRing[AudioRingWrite].PTS != (int64_t) INT64_C(0x8000000000000000)) {
+		AudioRing[AudioRingWrite].PTS += ((int64_t) direct * 90 * 1000)
+		    / (AudioRing[AudioRingWrite].HwSampleRate * AudioRing[AudioRingWrite].HwChannels *
+		    AudioBytesProSample);
+	    }
+	    pthread_mutex_unlock(&PTS_mutex);
+	    return;
+	}
+	pthread_mutex_unlock(&PTS_mutex);
+    }
+
     buffer = (void *)samples;
-    if (!AudioRing[AudioRingWrite].Passthrough && (AudioCompression || AudioNormalize
-	    || AudioRing[AudioRingWrite].InChannels != AudioRing[AudioRingWrite].HwChannels)) {
+    if (convert) {
 	int frames;
 
 	// resample into ring-buffer is too complex in the case of a roundabout
 	// just use a temporary buffer
 	frames = count / (AudioRing[AudioRingWrite].InChannels * AudioBytesProSample);
-	buffer = alloca(frames * AudioRing[AudioRingWrite].HwChannels * AudioBytesProSample);
-	// Convert / resample input to hardware format
-	AudioResample(samples, AudioRing[AudioRingWrite].InChannels, frames, buffer,
-	    AudioRing[AudioRingWrite].HwChannels);
-	count = frames * AudioRing[AudioRingWrite].HwChannels * AudioBytesProSample;
-
-	if (AudioCompression) {		// in place operation
-	    AudioCompressor(buffer, count);
-	}
-	if (AudioNormalize) {		// in place operation
-	    AudioNormalizer(buffer, count);
+	if (!(buffer = AudioRingScratchBuffer(frames * AudioRing[AudioRingWrite].HwChannels * AudioBytesProSample))) {
+	    return;
 	}
+	count = AudioConvert(samples, frames, buffer);
     }
 
     pthread_mutex_lock(&PTS_mutex);
+    AudioRingWrites++;
+    empty = !RingBufferUsedBytes(AudioRing[AudioRingWrite].RingBuffer);
     n = RingBufferWrite(AudioRing[AudioRingWrite].RingBuffer, buffer, count);
     if (n != (size_t) count) {
 	Error("audio: can't place %d samples in ring buffer", count);
@@ -1620,6 +2022,8 @@ void AudioEnqueue(const void *samples, int count)
 	    AudioRunning = 1;
 	    pthread_cond_signal(&AudioStartCond);
 	}
+    } else if (empty) {			// play thread waits for samples
+	AudioEventSignal();
     }
     // Update audio clock (stupid gcc developers thinks INT64_C is unsigned)
     if (AudioRing[AudioRingWrite].PTS != (int64_t) INT64_C(0x8000000000000000)) {
@@ -1742,19 +2146,36 @@ void AudioFlushBuffers(void)
 
     atomic_inc(&AudioRingFilled);
 
-    // FIXME: wait for flush complete needed?
-    for (i = 0; i < 24 * 2; ++i) {
-	if (!AudioRunning) {		// wakeup thread to flush buffers
-	    AudioRunning = 1;
-	    pthread_cond_signal(&AudioStartCond);
+    if (AudioThread) {
+	struct timespec start;
+	struct timespec abstime;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	abstime = start;
+	abstime.tv_nsec += 24 * 2 * 1000 * 1000;
+	if (abstime.tv_nsec >= 1000 * 1000 * 1000) {
+	    abstime.tv_sec++;
+	    abstime.tv_nsec -= 1000 * 1000 * 1000;
 	}
+
+	pthread_mutex_lock(&AudioMutex);
+	AudioEventSignal();
 	// FIXME: waiting on zero isn't correct, but currently works
-	if (!atomic_read(&AudioRingFilled)) {
-	    break;
+	while (atomic_read(&AudioRingFilled)) {
+	    if (!AudioRunning) {	// wakeup thread to flush buffers
+		AudioRunning = 1;
+		pthread_cond_signal(&AudioStartCond);
+	    }
+	    if (pthread_cond_timedwait(&AudioFlushCond, &AudioMutex, &abstime) == ETIMEDOUT) {
+		break;
+	    }
 	}
-	usleep(1 * 1000);		// avoid hot polling
+	pthread_mutex_unlock(&AudioMutex);
+
+	clock_gettime(CLOCK_MONOTONIC, &abstime);
+	Debug5("audio: audio flush %ldms", (long)((abstime.tv_sec - start.tv_sec) * 1000
+		+ (abstime.tv_nsec - start.tv_nsec) / (1000 * 1000)));
     }
-    Debug5("audio: audio flush %dms", i);
 }
 
 /**
@@ -1888,6 +2309,37 @@ int AudioSetup(int *freq, int *channels, int passthrough)
     return AudioRingAdd(*freq, *channels, passthrough);
 }
 
+/**
+**	Check if audio output is already setup for the requested format.
+**
+**	The format of the last audio ring buffer survives flushes, it is
+**	cleared when the audio module exits.
+**
+**	@param freq		sample frequency
+**	@param channels		number of channels
+**	@param passthrough	use pass-through (AC-3, ...) device
+**
+**	@returns true, if AudioSetup() with this format isn't needed.
+*/
+int AudioIsSetup(int freq, int channels, int passthrough)
+{
+    return AudioRing[AudioRingWrite].InSampleRate == (unsigned)freq
+	&& AudioRing[AudioRingWrite].InChannels == (unsigned)channels
+	&& AudioRing[AudioRingWrite].Passthrough == passthrough;
+}
+
+/**
+**	Get audio enqueue statistics.
+**
+**	@param[out] direct	packets written direct into the hw buffer
+**	@param[out] ring	packets written into the ring buffer
+*/
+void AudioGetEnqueueStats(unsigned *direct, unsigned *ring)
+{
+    *direct = AudioDirectWrites;
+    *ring = AudioRingWrites;
+}
+
 /**
 **	Play audio.
 */
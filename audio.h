@@ -16,6 +16,8 @@ extern void AudioSetClock(int64_t);	///< set audio clock base
 extern int64_t AudioGetClock();		///< get current audio clock
 extern void AudioSetVolume(int);	///< set volume
 extern int AudioSetup(int *, int *, int);   ///< setup audio output
+extern int AudioIsSetup(int, int, int);	///< audio output has format
+extern void AudioGetEnqueueStats(unsigned *, unsigned *);	///< direct/ring writes
 
 extern void AudioPlay(void);		///< play audio
 extern void AudioPause(void);		///< pause audio
@@ -41,3 +43,4 @@ extern void AudioExit(void);		///< cleanup and exit audio module
 extern char AudioAlsaDriverBroken;	///< disable broken driver message
 extern char AudioAlsaNoCloseOpen;	///< disable alsa close/open fix
 extern char AudioAlsaCloseOpenDelay;	///< enable alsa close/open delay fix
+extern char AudioAlsaMmap;		///< enable alsa mmap zero-copy playback
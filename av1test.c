@@ -0,0 +1,285 @@
+/// Copyright (C) 2018 by pesintta, rofafor.
+///
+/// SPDX-License-Identifier: AGPL-3.0-only
+
+///
+/// AV1 start code to low overhead format conversion test.
+///
+/// Checks Av1Unescape() with fixed OBU sequences: 3 and 4 byte start
+/// codes, emulation prevention bytes, OBUs with size field, extension
+/// headers and trailing zeros.  Random OBUs are escaped, joined with
+/// start codes, converted back and must parse with their obu_size.
+///
+/// Usage: av1test [rounds]
+///
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "misc.h"
+
+int TraceMode;				///< trace mode for debugging
+
+#define AV1_OBUS_MAX 16			///< most random OBUs per temporal unit
+#define AV1_PAYLOAD_MAX 1000		///< largest random OBU payload
+#define AV1_BUFFER_SIZE (AV1_OBUS_MAX * (AV1_PAYLOAD_MAX * 3 / 2 + 16))
+
+static int Av1Errors;			///< number of detected errors
+
+/**
+**	Logging function, not used by the conversion.
+*/
+void LogMessage( __attribute__ ((unused))
+    int trace, __attribute__ ((unused))
+    int level, __attribute__ ((unused))
+    const char *format, ...)
+{
+}
+
+/**
+**	Pseudo random number generator (xorshift32).
+**
+**	@param state	generator state, not 0
+*/
+static uint32_t Random(uint32_t * state)
+{
+    uint32_t x;
+
+    x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+
+    return x;
+}
+
+/**
+**	Convert a fixed input and compare with the expected output.
+**
+**	@param name	test name
+**	@param src	OBUs with start codes
+**	@param size	number of bytes in @a src
+**	@param expect	expected low overhead OBUs
+**	@param length	number of bytes in @a expect
+*/
+static void Av1TestFixed(const char *name, const uint8_t * src, int size, const uint8_t * expect, int length)
+{
+    uint8_t dst[256];
+    int n;
+    int i;
+
+    n = Av1Unescape(dst, src, size);
+    if (n == length && !memcmp(dst, expect, length)) {
+	return;
+    }
+    printf("%s: got", name);
+    for (i = 0; i < n; ++i) {
+	printf(" %02x", dst[i]);
+    }
+    printf("\n");
+    ++Av1Errors;
+}
+
+/**
+**	Fixed OBU sequences.
+*/
+static void Av1TestSequences(void)
+{
+    // temporal delimiter
+    static const uint8_t start[] = { 0x00, 0x00, 0x01, 0x10 };
+    static const uint8_t start_out[] = { 0x12, 0x80, 0x80, 0x80, 0x00 };
+
+    // 4 byte start code, the 4th zero of the next start code is dropped
+    static const uint8_t start4[] = { 0x00, 0x00, 0x00, 0x01, 0x10, 0x00, 0x00, 0x00, 0x01, 0x30, 0xAA, 0xBB };
+    static const uint8_t start4_out[] = { 0x12, 0x80, 0x80, 0x80, 0x00,
+	0x32, 0x82, 0x80, 0x80, 0x00, 0xAA, 0xBB
+    };
+
+    // emulation prevention byte
+    static const uint8_t escape[] = { 0x00, 0x00, 0x01, 0x30, 0x00, 0x00, 0x03, 0x01, 0x00, 0x00, 0x03, 0x00, 0xFF };
+    static const uint8_t escape_out[] = { 0x32, 0x87, 0x80, 0x80, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0xFF };
+
+    // OBUs with size field are copied unchanged
+    static const uint8_t sized[] = { 0x00, 0x00, 0x01, 0x32, 0x02, 0xAA, 0xBB, 0x00, 0x00, 0x01, 0x12, 0x00 };
+    static const uint8_t sized_out[] = { 0x32, 0x02, 0xAA, 0xBB, 0x12, 0x00 };
+
+    // extension header with zero byte directly before the next start code
+    static const uint8_t extension[] = { 0x00, 0x00, 0x01, 0x14, 0x00, 0x00, 0x00, 0x01, 0x30, 0xAA };
+    static const uint8_t extension_out[] = { 0x16, 0x00, 0x80, 0x80, 0x80, 0x00,
+	0x32, 0x81, 0x80, 0x80, 0x00, 0xAA
+    };
+
+    // trailing zeros belong to the next start code
+    static const uint8_t trailing[] = { 0x00, 0x00, 0x01, 0x30, 0xAA, 0x00, 0x00, 0x00, 0x00, 0x01, 0x10 };
+    static const uint8_t trailing_out[] = { 0x32, 0x81, 0x80, 0x80, 0x00, 0xAA,
+	0x12, 0x80, 0x80, 0x80, 0x00
+    };
+
+    // garbage before the first start code and empty OBUs are dropped
+    static const uint8_t empty[] = { 0xFF, 0x00, 0x00, 0x01, 0x00, 0x00, 0x01, 0x10, 0x00, 0x00, 0x01 };
+    static const uint8_t empty_out[] = { 0x12, 0x80, 0x80, 0x80, 0x00 };
+
+    Av1TestFixed("start code", start, sizeof(start), start_out, sizeof(start_out));
+    Av1TestFixed("4 byte start code", start4, sizeof(start4), start4_out, sizeof(start4_out));
+    Av1TestFixed("emulation prevention", escape, sizeof(escape), escape_out, sizeof(escape_out));
+    Av1TestFixed("size field", sized, sizeof(sized), sized_out, sizeof(sized_out));
+    Av1TestFixed("extension header", extension, sizeof(extension), extension_out, sizeof(extension_out));
+    Av1TestFixed("trailing zeros", trailing, sizeof(trailing), trailing_out, sizeof(trailing_out));
+    Av1TestFixed("empty OBU", empty, sizeof(empty), empty_out, sizeof(empty_out));
+}
+
+///
+/// Random OBU.
+///
+typedef struct _av1_obu_
+{
+    uint8_t Header[2];			///< OBU header and extension
+    int HeaderSize;			///< bytes in header
+    uint8_t Payload[AV1_PAYLOAD_MAX];	///< OBU payload
+    int PayloadSize;			///< bytes in payload
+} Av1Obu;
+
+/**
+**	Append bytes with emulation prevention.
+**
+**	@param out	output position
+**	@param zeros	number of zero bytes written before
+**	@param data	bytes to escape
+**	@param size	number of bytes in @a data
+**
+**	@returns new output position.
+*/
+static uint8_t *Av1Escape(uint8_t * out, int *zeros, const uint8_t * data, int size)
+{
+    int i;
+
+    for (i = 0; i < size; ++i) {
+	if (*zeros >= 2 && data[i] <= 0x03) {
+	    *out++ = 0x03;
+	    *zeros = 0;
+	}
+	*out++ = data[i];
+	*zeros = data[i] ? 0 : *zeros + 1;
+    }
+
+    return out;
+}
+
+/**
+**	Convert random temporal units and parse the result.
+**
+**	@param seed	random generator state
+**	@param rounds	number of temporal units
+*/
+static void Av1TestRandom(uint32_t * seed, int rounds)
+{
+    static Av1Obu obus[AV1_OBUS_MAX];
+    static uint8_t src[AV1_BUFFER_SIZE];
+    static uint8_t dst[AV1_BUFFER_SIZE + AV1_BUFFER_SIZE / 4];
+    int r;
+
+    for (r = 0; r < rounds; ++r) {
+	const uint8_t *p;
+	uint8_t *out;
+	int count;
+	int size;
+	int n;
+	int i;
+	int j;
+
+	count = 1 + Random(seed) % AV1_OBUS_MAX;
+	out = src;
+	for (i = 0; i < count; ++i) {
+	    Av1Obu *obu;
+	    int zeros;
+
+	    obu = obus + i;
+	    obu->Header[0] = (1 + Random(seed) % 8) << 3;
+	    obu->HeaderSize = 1;
+	    if (Random(seed) & 1) {
+		obu->Header[0] |= 0x04;
+		obu->Header[1] = Random(seed) & 1 ? 0x00 : Random(seed) & 0xF8;
+		obu->HeaderSize = 2;
+	    }
+	    // short and long payloads with many zeros, trailing bits end them
+	    obu->PayloadSize = Random(seed) & 1 ? Random(seed) % 8 : Random(seed) % AV1_PAYLOAD_MAX;
+	    for (j = 0; j < obu->PayloadSize; ++j) {
+		obu->Payload[j] = Random(seed) % 3 ? 0x00 : Random(seed) % 5;
+	    }
+	    if (obu->PayloadSize) {
+		obu->Payload[obu->PayloadSize - 1] = 0x80;
+	    }
+
+	    if (Random(seed) & 1) {
+		*out++ = 0x00;
+	    }
+	    *out++ = 0x00;
+	    *out++ = 0x00;
+	    *out++ = 0x01;
+	    zeros = 0;
+	    out = Av1Escape(out, &zeros, obu->Header, obu->HeaderSize);
+	    out = Av1Escape(out, &zeros, obu->Payload, obu->PayloadSize);
+	}
+	size = out - src;
+
+	n = Av1Unescape(dst, src, size);
+	if (n > size + size / 4) {
+	    printf("random %d: %d bytes from %d bytes\n", r, n, size);
+	    ++Av1Errors;
+	    continue;
+	}
+	// parse the low overhead OBUs
+	p = dst;
+	for (i = 0; i < count; ++i) {
+	    const Av1Obu *obu;
+	    unsigned obu_size;
+
+	    obu = obus + i;
+	    if (dst + n - p < obu->HeaderSize + 4 || p[0] != (obu->Header[0] | 0x02)
+		|| (obu->HeaderSize == 2 && p[1] != obu->Header[1])) {
+		break;
+	    }
+	    p += obu->HeaderSize;
+	    obu_size = 0;
+	    for (j = 0; j < 4; ++j) {
+		obu_size |= (p[j] & 0x7F) << (7 * j);
+	    }
+	    p += 4;
+	    if (obu_size != (unsigned)obu->PayloadSize || dst + n - p < obu->PayloadSize
+		|| memcmp(p, obu->Payload, obu->PayloadSize)) {
+		break;
+	    }
+	    p += obu->PayloadSize;
+	}
+	if (i != count || p != dst + n) {
+	    printf("random %d: OBU %d of %d differs\n", r, i, count);
+	    ++Av1Errors;
+	}
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    uint32_t seed;
+    int rounds;
+
+    if (argc > 2) {
+	fprintf(stderr, "Usage: %s [rounds]\n", argv[0]);
+	return 1;
+    }
+    rounds = argc > 1 ? atoi(argv[1]) : 10000;
+    if (rounds < 1) {
+	rounds = 1;
+    }
+
+    seed = 0x2545f491;
+    Av1TestSequences();
+    Av1TestRandom(&seed, rounds);
+
+    printf("%d errors\n", Av1Errors);
+
+    return Av1Errors != 0;
+}
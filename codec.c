@@ -28,6 +28,7 @@
 #endif
 #include <libavutil/mem.h>
 #include <libavutil/opt.h>
+#include <libavutil/pixdesc.h>
 #include <libavcodec/vaapi.h>
 #include <libavutil/hwcontext.h>
 #include <libavutil/hwcontext_vaapi.h>
@@ -63,6 +64,74 @@ static pthread_mutex_t CodecLockMutex;
 //  Video
 //----------------------------------------------------------------------------
 
+#define CODEC_VIDEO_THREADS_MAX 16	///< maximal software decoder threads
+
+static int CodecVideoThreads;		///< software decoder threads, 0 online cpus
+
+/**
+**	Get number of threads for software video decoding.
+*/
+static int CodecVideoSoftwareThreads(void)
+{
+    int threads;
+
+    if ((threads = CodecVideoThreads) <= 0) {
+	threads = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (threads < 1) {
+	threads = 1;
+    }
+    if (threads > CODEC_VIDEO_THREADS_MAX) {
+	threads = CODEC_VIDEO_THREADS_MAX;
+    }
+    return threads;
+}
+
+/**
+**	Remember the decoder type of a stream for the next open.
+**
+**	@param decoder	video decoder data
+**	@param codec_id	video codec id
+**	@param profile	stream profile
+**	@param software	flag stream is software decoded
+*/
+static void CodecVideoSetFallback(VideoDecoder * decoder, int codec_id, int profile, int software)
+{
+    int i;
+
+    for (i = 0; i < CODEC_VIDEO_FALLBACKS; ++i) {
+	if (decoder->Fallback[i].CodecID == AV_CODEC_ID_NONE) {
+	    decoder->Fallback[i].CodecID = codec_id;
+	}
+	if (decoder->Fallback[i].CodecID == codec_id) {
+	    decoder->Fallback[i].Profile = profile;
+	    decoder->Fallback[i].Software = software;
+	    return;
+	}
+    }
+}
+
+/**
+**	Get the software fallback of the last stream of a codec.
+**
+**	@param decoder	video decoder data
+**	@param codec_id	video codec id
+**
+**	@returns profile the hw decoder couldn't decode, FF_PROFILE_UNKNOWN
+**	if the last stream was hw decoded or the codec wasn't seen yet.
+*/
+static int CodecVideoGetFallback(const VideoDecoder * decoder, int codec_id)
+{
+    int i;
+
+    for (i = 0; i < CODEC_VIDEO_FALLBACKS; ++i) {
+	if (decoder->Fallback[i].CodecID == codec_id) {
+	    return decoder->Fallback[i].Software ? decoder->Fallback[i].Profile : FF_PROFILE_UNKNOWN;
+	}
+    }
+    return FF_PROFILE_UNKNOWN;
+}
+
 //----------------------------------------------------------------------------
 //  Call-backs
 //----------------------------------------------------------------------------
@@ -79,8 +148,36 @@ static pthread_mutex_t CodecLockMutex;
 static enum AVPixelFormat Codec_get_format(AVCodecContext * video_ctx, const enum AVPixelFormat *fmt)
 {
     VideoDecoder *decoder = video_ctx->opaque;
-
-    return Video_get_format(decoder->HwDecoder, video_ctx, fmt);
+    enum AVPixelFormat pix_fmt;
+    int software;
+
+    pix_fmt = Video_get_format(decoder->HwDecoder, video_ctx, fmt);
+
+    // context threads don't match decoder type, reopen with other threads
+    software = pix_fmt != AV_PIX_FMT_VAAPI;
+    if (CodecVideoSoftwareThreads() > 1) {
+	if (!software && decoder->Software) {
+	    // hw decoder wasn't used for this profile before, don't toggle
+	    if (video_ctx->profile != decoder->SoftwareProfile) {
+		Debug4("codec: hw decoder selected, restart needed");
+		decoder->Restart = 1;
+	    }
+	    // no hwaccel with threads, decode in software
+	    for (; *fmt != AV_PIX_FMT_NONE; ++fmt) {
+		if (!(av_pix_fmt_desc_get(*fmt)->flags & AV_PIX_FMT_FLAG_HWACCEL)) {
+		    return *fmt;
+		}
+	    }
+	} else if (software && !decoder->Software) {
+	    Debug4("codec: software decoder selected, restart needed");
+	    decoder->SoftwareProfile = video_ctx->profile;
+	    decoder->Restart = 1;
+	}
+	// the next stream of this codec opens the same decoder type
+	CodecVideoSetFallback(decoder, video_ctx->codec_id, video_ctx->profile,
+	    decoder->Restart ? !decoder->Software : decoder->Software);
+    }
+    return pix_fmt;
 }
 
 /**
@@ -171,7 +268,36 @@ void CodecVideoOpen(VideoDecoder * decoder, int codec_id)
 	Error("codec: missing close");
     }
 
-    if (!(video_codec = avcodec_find_decoder(codec_id))) {
+    // hw decoder: 1 thread, software decoder: frame or slice threads
+    // the decoder type is known in get_format, a mismatch restarts.  A
+    // codec whose last stream fell back to software opens in software.
+    if (decoder->FallbackDevice != HwDeviceContext) {	// other gpu
+	memset(decoder->Fallback, 0, sizeof(decoder->Fallback));
+	decoder->FallbackDevice = HwDeviceContext;
+    }
+    if (!decoder->Restart) {
+	decoder->SoftwareProfile = CodecVideoGetFallback(decoder, codec_id);
+#ifdef USE_AV1
+	// libdav1d never offers the hw format, it can't switch back
+	if (codec_id == AV_CODEC_ID_AV1) {
+	    decoder->SoftwareProfile = FF_PROFILE_UNKNOWN;
+	}
+#endif
+	decoder->Software = !HwDeviceContext || decoder->SoftwareProfile != FF_PROFILE_UNKNOWN;
+	if (decoder->SoftwareProfile != FF_PROFILE_UNKNOWN) {
+	    Debug4("codec: profile %d not decoded by hw before, using software decoder", decoder->SoftwareProfile);
+	}
+    }
+    decoder->Restart = 0;
+
+    video_codec = NULL;
+#ifdef USE_AV1
+    // libdav1d is preferred by ffmpeg, only the native decoder has hwaccel
+    if (codec_id == AV_CODEC_ID_AV1 && HwDeviceContext && !decoder->Software) {
+	video_codec = avcodec_find_decoder_by_name("av1");
+    }
+#endif
+    if (!video_codec && !(video_codec = avcodec_find_decoder(codec_id))) {
 	Fatal("codec: codec ID %#06x not found", codec_id);
 	// FIXME: none fatal
     }
@@ -181,18 +307,26 @@ void CodecVideoOpen(VideoDecoder * decoder, int codec_id)
 	Fatal("codec: can't allocate video codec context");
     }
 
-    if (!HwDeviceContext) {
-	Fatal("codec: no hw device context to be used");
+    // no hw device context: software decoding for the null output module
+    if (HwDeviceContext) {
+	decoder->VideoCtx->hw_device_ctx = av_buffer_ref(HwDeviceContext);
+    } else {
+	Debug4("codec: no hw device context, using software decoder");
     }
-    decoder->VideoCtx->hw_device_ctx = av_buffer_ref(HwDeviceContext);
 
-    // FIXME: for software decoder use all cpus, otherwise 1
     decoder->VideoCtx->thread_count = 1;
     pthread_mutex_lock(&CodecLockMutex);
     // open codec
-    if (video_codec->capabilities & (AV_CODEC_CAP_AUTO_THREADS)) {
-	Debug4("codec: auto threads enabled");
-	decoder->VideoCtx->thread_count = 0;
+    if (decoder->Software) {
+	decoder->VideoCtx->thread_count = CodecVideoSoftwareThreads();
+	decoder->VideoCtx->thread_type = 0;
+	if (video_codec->capabilities & AV_CODEC_CAP_FRAME_THREADS) {
+	    decoder->VideoCtx->thread_type |= FF_THREAD_FRAME;
+	}
+	if (video_codec->capabilities & AV_CODEC_CAP_SLICE_THREADS) {
+	    decoder->VideoCtx->thread_type |= FF_THREAD_SLICE;
+	}
+	Debug4("codec: software decoder with %d threads", decoder->VideoCtx->thread_count);
     }
 
     decoder->VideoCtx->opaque = decoder;    // our structure
@@ -206,16 +340,6 @@ void CodecVideoOpen(VideoDecoder * decoder, int codec_id)
     if (video_codec->capabilities & AV_CODEC_CAP_DR1) {
 	Debug4("codec: can use own buffer management");
     }
-    if (video_codec->capabilities & AV_CODEC_CAP_FRAME_THREADS) {
-	Debug4("codec: supports frame threads");
-	decoder->VideoCtx->thread_count = 0;
-	decoder->VideoCtx->thread_type |= FF_THREAD_FRAME;
-    }
-    if (video_codec->capabilities & AV_CODEC_CAP_SLICE_THREADS) {
-	Debug4("codec: supports slice threads");
-	decoder->VideoCtx->thread_count = 0;
-	decoder->VideoCtx->thread_type |= FF_THREAD_SLICE;
-    }
     decoder->VideoCtx->thread_safe_callbacks = 0;
     decoder->VideoCtx->get_format = Codec_get_format;
     decoder->VideoCtx->get_buffer2 = Codec_get_buffer2;
@@ -252,39 +376,99 @@ void CodecVideoClose(VideoDecoder * video_decoder)
 	avcodec_free_context(&video_decoder->VideoCtx);
 	pthread_mutex_unlock(&CodecLockMutex);
     }
+    video_decoder->FramesPending = 0;
+}
+
+/**
+**	Receive decoded video frames.
+**
+**	Frames are only received while the video output has room for them,
+**	the others stay in the decoder and FramesPending is set.  They must
+**	be received before the next packet is sent.
+**
+**	@param decoder	video decoder data
+**
+**	@returns number of frames received.
+*/
+int CodecVideoReceive(VideoDecoder * decoder)
+{
+    AVCodecContext *video_ctx = decoder->VideoCtx;
+    AVFrame *frame = decoder->Frame;
+    int frames;
+    int ret;
+
+    decoder->FramesPending = 0;
+    if (!video_ctx) {
+	return 0;
+    }
+    for (frames = 0; VideoGetFreeFrames(decoder->HwDecoder) > 0; ++frames) {
+	if ((ret = avcodec_receive_frame(video_ctx, frame)) < 0) {
+	    if (ret != AVERROR(EAGAIN) && ret != AVERROR_EOF) {
+		Debug4("codec: receiving video frame failed");
+	    }
+	    return frames;
+	}
+	VideoRenderFrame(decoder->HwDecoder, video_ctx, frame);
+	av_frame_unref(frame);
+    }
+    // output is full, the decoder may hold more frames
+    decoder->FramesPending = 1;
+    return frames;
 }
 
 /**
 **	Decode a video packet.
 **
+**	The ready frames are received after the packet is sent, with frame
+**	threading or b-pyramids there can be more than one.  Must not be
+**	called while FramesPending is set, see CodecVideoReceive().
+**
 **	@param decoder	video decoder data
 **	@param avpkt	video packet
+**
+**	@returns number of frames received for this packet.
 */
-void CodecVideoDecode(VideoDecoder * decoder, const AVPacket * avpkt)
+int CodecVideoDecode(VideoDecoder * decoder, const AVPacket * avpkt)
 {
     AVCodecContext *video_ctx = decoder->VideoCtx;
+    int frames;
 
+    frames = 0;
     if (video_ctx->codec_type == AVMEDIA_TYPE_VIDEO) {
-	int ret;
 	AVPacket pkt[1];
-	AVFrame *frame = decoder->Frame;
 
 	*pkt = *avpkt;			// use copy
-	ret = avcodec_send_packet(video_ctx, pkt);
-	if (ret < 0) {
+	// packet is reference counted, decoder takes a reference, no copy
+	// all frames were received, the decoder can't refuse with EAGAIN
+	if (avcodec_send_packet(video_ctx, pkt) < 0) {
 	    Debug4("codec: sending video packet failed");
-	    return;
 	}
-	ret = avcodec_receive_frame(video_ctx, frame);
-	if (ret < 0 && ret != AVERROR(EAGAIN) && ret != AVERROR_EOF) {
-	    Debug4("codec: receiving video frame failed");
-	    return;
-	}
-	if (ret >= 0) {
-	    VideoRenderFrame(decoder->HwDecoder, video_ctx, frame);
+	frames = CodecVideoReceive(decoder);
+	// reopen with the threads of the selected decoder type
+	// FIXME: decoding restarts with the next key frame
+	if (decoder->Restart) {
+	    int codec_id;
+
+	    codec_id = video_ctx->codec_id;
+	    decoder->Software ^= 1;
+	    CodecVideoClose(decoder);
+	    CodecVideoOpen(decoder, codec_id);
 	}
-	av_frame_unref(frame);
     }
+    return frames;
+}
+
+/**
+**	Set software video decoder threads.
+**
+**	Used for the next opened software decoder, the hw decoder uses a
+**	single thread.
+**
+**	@param threads	number of threads, 0 use all online cpus
+*/
+void CodecSetVideoThreads(int threads)
+{
+    CodecVideoThreads = threads < 0 ? 0 : threads;
 }
 
 /**
@@ -297,6 +481,7 @@ void CodecVideoFlushBuffers(VideoDecoder * decoder)
     if (decoder->VideoCtx) {
 	avcodec_flush_buffers(decoder->VideoCtx);
     }
+    decoder->FramesPending = 0;
 }
 
 //----------------------------------------------------------------------------
@@ -321,6 +506,8 @@ struct _audio_decoder_
     AVFrame *Frame;			///< decoded audio frame buffer
 
     SwrContext *Resample;		///< ffmpeg software resample context
+    uint8_t *Buffer;			///< resample output buffer
+    unsigned BufferSize;		///< size of resample output buffer
 
     uint16_t Spdif[24576 / 2];		///< SPDIF output buffer
     int SpdifIndex;			///< index into SPDIF output buffer
@@ -354,6 +541,8 @@ static char CodecAudioDrift;		///< flag: enable audio-drift correction
     ///
 static char CodecPassthrough;
 static char CodecDownmix;		///< enable AC-3 decoder downmix
+static int CodecAudioOutputRate;	///< fixed output sample rate, 0 off
+static int CodecAudioOutputChannels;	///< fixed output channels
 
 /**
 **	Allocate a new audio decoder context.
@@ -382,6 +571,7 @@ AudioDecoder *CodecAudioNewDecoder(void)
 void CodecAudioDelDecoder(AudioDecoder * decoder)
 {
     av_frame_free(&decoder->Frame);	// callee does checks
+    av_freep(&decoder->Buffer);
     free(decoder);
 }
 
@@ -492,6 +682,25 @@ void CodecSetAudioDownmix(int onoff)
     CodecDownmix = onoff;
 }
 
+/**
+**	Set fixed audio output format.
+**
+**	All PCM audio is resampled to this format, the audio device is
+**	only reconfigured for pass-through.
+**
+**	@param rate	output sample rate, 0 use the stream format
+**	@param channels	output channels
+*/
+void CodecSetAudioOutput(int rate, int channels)
+{
+    if (rate <= 0 || channels <= 0) {
+	rate = 0;
+	channels = 0;
+    }
+    CodecAudioOutputRate = rate;
+    CodecAudioOutputChannels = channels;
+}
+
 /**
 **	Reorder audio frame.
 **
@@ -587,6 +796,16 @@ static int CodecAudioUpdateHelper(AudioDecoder * audio_decoder, int *passthrough
 	audio_decoder->SpdifIndex = 0;	// reset buffer
 	audio_decoder->SpdifCount = 0;
 	*passthrough = 1;
+    } else if (CodecAudioOutputRate) {	// fixed output format
+	audio_decoder->HwSampleRate = CodecAudioOutputRate;
+	audio_decoder->HwChannels = CodecAudioOutputChannels;
+	// output unchanged, also over a codec reopen, keep audio device and ring buffer
+	if (AudioIsSetup(audio_decoder->HwSampleRate, audio_decoder->HwChannels, 0)) {
+	    Debug4("codec/audio: resample %s %dHz *%d -> fixed %dHz *%d",
+		av_get_sample_fmt_name(audio_ctx->sample_fmt), audio_ctx->sample_rate, audio_ctx->channels,
+		audio_decoder->HwSampleRate, audio_decoder->HwChannels);
+	    return 0;
+	}
     }
     // channels/sample-rate not support?
     if ((err = AudioSetup(&audio_decoder->HwSampleRate, &audio_decoder->HwChannels, *passthrough))) {
@@ -819,6 +1038,8 @@ static void CodecAudioUpdateFormat(AudioDecoder * audio_decoder)
 {
     int passthrough;
     const AVCodecContext *audio_ctx;
+    int64_t in_layout;
+    int64_t out_layout;
 
     if (CodecAudioUpdateHelper(audio_decoder, &passthrough)) {
 	// FIXME: handle swresample format conversions.
@@ -838,10 +1059,17 @@ static void CodecAudioUpdateFormat(AudioDecoder * audio_decoder)
     }
 #endif
 
+    in_layout = audio_ctx->channel_layout;
+    out_layout = in_layout;
+    if (audio_decoder->HwChannels != audio_ctx->channels) {    // fixed output format, remix
+	if (!in_layout) {
+	    in_layout = av_get_default_channel_layout(audio_ctx->channels);
+	}
+	out_layout = av_get_default_channel_layout(audio_decoder->HwChannels);
+    }
     audio_decoder->Resample =
-	swr_alloc_set_opts(audio_decoder->Resample, audio_ctx->channel_layout, AV_SAMPLE_FMT_S16,
-	audio_decoder->HwSampleRate, audio_ctx->channel_layout, audio_ctx->sample_fmt, audio_ctx->sample_rate, 0,
-	NULL);
+	swr_alloc_set_opts(audio_decoder->Resample, out_layout, AV_SAMPLE_FMT_S16, audio_decoder->HwSampleRate,
+	in_layout, audio_ctx->sample_fmt, audio_ctx->sample_rate, 0, NULL);
     if (audio_decoder->Resample) {
 	swr_init(audio_decoder->Resample);
     } else {
@@ -897,19 +1125,32 @@ void CodecAudioDecode(AudioDecoder * audio_decoder, const AVPacket * avpkt)
 		return;
 	    }
 	    if (audio_decoder->Resample) {
-		uint8_t outbuf[8192 * 2 * 8];
 		uint8_t *out[1];
+		int samples;
 
-		out[0] = outbuf;
+		// grows to the biggest frame seen, av_malloc aligned
+		samples = swr_get_out_samples(audio_decoder->Resample, frame->nb_samples);
+		if (samples <= 0) {
+		    samples = frame->nb_samples;
+		}
+		av_fast_malloc(&audio_decoder->Buffer, &audio_decoder->BufferSize,
+		    samples * 2 * audio_decoder->HwChannels);
+		if (!audio_decoder->Buffer) {
+		    Error("codec/audio: can't allocate resample buffer");
+		    audio_decoder->BufferSize = 0;
+		    return;
+		}
+		out[0] = audio_decoder->Buffer;
 		ret =
-		    swr_convert(audio_decoder->Resample, out, sizeof(outbuf) / (2 * audio_decoder->HwChannels),
+		    swr_convert(audio_decoder->Resample, out,
+		    audio_decoder->BufferSize / (2 * audio_decoder->HwChannels),
 		    (const uint8_t **)frame->extended_data, frame->nb_samples);
 		if (ret > 0) {
 		    if (!(audio_decoder->Passthrough & CodecPCM)) {
-			CodecReorderAudioFrame((int16_t *) outbuf, ret * 2 * audio_decoder->HwChannels,
+			CodecReorderAudioFrame((int16_t *) audio_decoder->Buffer, ret * 2 * audio_decoder->HwChannels,
 			    audio_decoder->HwChannels);
 		    }
-		    AudioEnqueue(outbuf, ret * 2 * audio_decoder->HwChannels);
+		    AudioEnqueue(audio_decoder->Buffer, ret * 2 * audio_decoder->HwChannels);
 		}
 		return;
 	    }
@@ -17,6 +17,13 @@
 
 #define AVCODEC_MAX_AUDIO_FRAME_SIZE 192000
 
+#if LIBAVCODEC_VERSION_INT >= AV_VERSION_INT(58,18,100)
+#define USE_AV1				///< libavcodec knows AV1
+#define USE_EXTRA_HW_FRAMES		///< libavcodec can add hw frames to its pool
+#endif
+
+#define CODEC_VIDEO_FALLBACKS 6		///< codecs remembered for software fallback
+
 ///
 /// Video decoder structure.
 ///
@@ -28,6 +35,19 @@ struct _video_decoder_
     AVCodecContext *VideoCtx;		///< video codec context
     int FirstKeyFrame;			///< flag first frame
     AVFrame *Frame;			///< decoded video frame
+    char Software;			///< flag codec context opened for software decoding
+    char Restart;			///< flag reopen codec for other decoder type
+    int SoftwareProfile;		///< stream profile the hw decoder wasn't used for
+    char FramesPending;			///< flag decoder holds frames the output had no room for
+
+    /// decoder type of the last stream per codec, kept over reopens
+    struct
+    {
+	int CodecID;			///< codec id of entry
+	int Profile;			///< profile of the last stream
+	char Software;			///< flag last stream was software decoded
+    } Fallback[CODEC_VIDEO_FALLBACKS];
+    const AVBufferRef *FallbackDevice;	///< hw device the fallbacks were found with
 };
 
 //----------------------------------------------------------------------------
@@ -67,11 +87,17 @@ extern void CodecVideoOpen(VideoDecoder *, int);
 extern void CodecVideoClose(VideoDecoder *);
 
     /// Decode a video packet.
-extern void CodecVideoDecode(VideoDecoder *, const AVPacket *);
+extern int CodecVideoDecode(VideoDecoder *, const AVPacket *);
+
+    /// Receive decoded video frames.
+extern int CodecVideoReceive(VideoDecoder *);
 
     /// Flush video buffers.
 extern void CodecVideoFlushBuffers(VideoDecoder *);
 
+    /// Set software video decoder threads.
+extern void CodecSetVideoThreads(int);
+
     /// Allocate a new audio decoder context.
 extern AudioDecoder *CodecAudioNewDecoder(void);
 
@@ -96,6 +122,9 @@ extern void CodecSetAudioPassthrough(int);
     /// Set audio downmix.
 extern void CodecSetAudioDownmix(int);
 
+    /// Set fixed audio output format.
+extern void CodecSetAudioOutput(int, int);
+
     /// Decode an audio packet.
 extern void CodecAudioDecode(AudioDecoder *, const AVPacket *);
 
@@ -0,0 +1,508 @@
+/// Copyright (C) 2018 by pesintta, rofafor.
+///
+/// SPDX-License-Identifier: AGPL-3.0-only
+
+///
+/// Audio dsp kernel regression test.
+///
+/// Includes audio.c to reach its static dsp kernels and compares them
+/// with the scalar code they replaced: the clipping scale loops of the
+/// amplifier, compressor and normalizer and the per frame channel
+/// switch of the surround downmix.  The output and the compressor and
+/// normalizer state must be bit-exact on random input at several levels.
+///
+/// The kernel clone for the cpu running the test is checked.
+///
+/// Usage: dsptest [rounds]
+///
+
+#include "audio.c"
+
+int TraceMode;				///< trace mode for debugging
+int VideoAudioDelay;			///< audio/video delay
+volatile char SoftIsPlayingVideo;	///< stream contains video data
+
+#define DSP_SAMPLES_MAX 8192		///< largest sample block
+
+static int DspErrors;			///< number of detected errors
+
+/**
+**	Logging function, not used by the kernels.
+*/
+void LogMessage( __attribute__ ((unused))
+    int trace, __attribute__ ((unused))
+    int level, __attribute__ ((unused))
+    const char *format, ...)
+{
+}
+
+/**
+**	Pseudo random number generator (xorshift32).
+**
+**	@param state	generator state, not 0
+*/
+static uint32_t Random(uint32_t * state)
+{
+    uint32_t x;
+
+    x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *state = x;
+}
+
+/**
+**	Fill a sample buffer with noise.
+**
+**	Full scale samples are mixed in, to hit the clipping.
+**
+**	@param seed	generator state
+**	@param samples	sample buffer
+**	@param n	number of samples
+**	@param shift	level, 0 is full scale
+*/
+static void DspNoise(uint32_t * seed, int16_t * samples, int n, int shift)
+{
+    int i;
+
+    for (i = 0; i < n; ++i) {
+	uint32_t r;
+
+	r = Random(seed);
+	switch (r & 0xFF) {
+	    case 0:
+		samples[i] = INT16_MIN;
+		break;
+	    case 1:
+		samples[i] = INT16_MAX;
+		break;
+	    default:
+		samples[i] = (int16_t) (r >> 16) >> shift;
+		break;
+	}
+    }
+}
+
+/**
+**	Compare two sample buffers.
+**
+**	@param what	name of the checked kernel
+**	@param a	new kernel output
+**	@param b	scalar kernel output
+**	@param n	number of samples
+*/
+static void DspCompare(const char *what, const int16_t * a, const int16_t * b, int n)
+{
+    int i;
+
+    for (i = 0; i < n; ++i) {
+	if (a[i] != b[i]) {
+	    if (++DspErrors < 10) {
+		fprintf(stderr, "dsptest: %s sample %d/%d is %d, expected %d\n", what, i, n, a[i], b[i]);
+	    }
+	    return;
+	}
+    }
+}
+
+//----------------------------------------------------------------------------
+//  Scalar kernels, as before the dsp kernels
+//----------------------------------------------------------------------------
+
+static uint32_t ScalarNormAverage[AudioNormMaxIndex];	///< average of n last sample blocks
+static int ScalarNormIndex;		///< index into average table
+static int ScalarNormReady;		///< index counter
+static int ScalarNormCounter;		///< sample counter
+static int ScalarNormalizeFactor;	///< current normalize factor
+static int ScalarCompressionFactor;	///< current compression factor
+
+/**
+**	Scale samples with clipping, the old loop.
+**
+**	@param samples	sample buffer
+**	@param n	number of samples in sample buffer
+**	@param factor	scale factor * 1000
+*/
+static void ScalarScaleSamples(int16_t * samples, int n, int factor)
+{
+    int i;
+
+    for (i = 0; i < n; ++i) {
+	int t;
+
+	t = (samples[i] * factor) / 1000;
+	if (t < INT16_MIN) {
+	    t = INT16_MIN;
+	} else if (t > INT16_MAX) {
+	    t = INT16_MAX;
+	}
+	samples[i] = t;
+    }
+}
+
+/**
+**	Audio normalizer, the old code.
+**
+**	@param samples	sample buffer
+**	@param count	number of bytes in sample buffer
+*/
+static void ScalarNormalizer(int16_t * samples, int count)
+{
+    int i;
+    int l;
+    int factor;
+    int16_t *data;
+
+    // average samples
+    l = count / AudioBytesProSample;
+    data = samples;
+    do {
+	uint32_t avg;
+	int n = l;
+
+	if (ScalarNormCounter + n > AudioNormSamples) {
+	    n = AudioNormSamples - ScalarNormCounter;
+	}
+	avg = ScalarNormAverage[ScalarNormIndex];
+	for (i = 0; i < n; ++i) {
+	    int t;
+
+	    t = data[i];
+	    avg += (t * t) / AudioNormSamples;
+	}
+	ScalarNormAverage[ScalarNormIndex] = avg;
+	ScalarNormCounter += n;
+	if (ScalarNormCounter >= AudioNormSamples) {
+	    if (ScalarNormReady < AudioNormMaxIndex) {
+		ScalarNormReady++;
+	    } else {
+		avg = 0;
+		for (i = 0; i < AudioNormMaxIndex; ++i) {
+		    avg += ScalarNormAverage[i] / AudioNormMaxIndex;
+		}
+
+		// calculate normalize factor
+		if (avg > 0) {
+		    factor = ((INT16_MAX / 8) * 1000U) / (uint32_t) sqrt(avg);
+		    // smooth normalize
+		    ScalarNormalizeFactor = (ScalarNormalizeFactor * 500 + factor * 500) / 1000;
+		    if (ScalarNormalizeFactor < AudioMinNormalize) {
+			ScalarNormalizeFactor = AudioMinNormalize;
+		    }
+		    if (ScalarNormalizeFactor > AudioMaxNormalize) {
+			ScalarNormalizeFactor = AudioMaxNormalize;
+		    }
+		}
+	    }
+
+	    ScalarNormIndex = (ScalarNormIndex + 1) % AudioNormMaxIndex;
+	    ScalarNormCounter = 0;
+	    ScalarNormAverage[ScalarNormIndex] = 0U;
+	}
+	data += n;
+	l -= n;
+    } while (l > 0);
+
+    // apply normalize factor
+    ScalarScaleSamples(samples, count / AudioBytesProSample, ScalarNormalizeFactor);
+}
+
+/**
+**	Audio compression, the old code.
+**
+**	@param samples	sample buffer
+**	@param count	number of bytes in sample buffer
+*/
+static void ScalarCompressor(int16_t * samples, int count)
+{
+    // find loudest sample
+    int max_sample = 0;
+
+    for (int i = 0; i < count / AudioBytesProSample; ++i) {
+	int t = abs(samples[i]);
+
+	if (t > max_sample) {
+	    max_sample = t;
+	}
+    }
+
+    // calculate compression factor
+    if (max_sample > 0) {
+	int factor = (INT16_MAX * 1000) / max_sample;
+
+	// smooth compression
+	ScalarCompressionFactor = (ScalarCompressionFactor * 950 + factor * 50) / 1000;
+	if (ScalarCompressionFactor > factor) {
+	    ScalarCompressionFactor = factor;	// no clipping
+	}
+	if (ScalarCompressionFactor > AudioMaxCompression) {
+	    ScalarCompressionFactor = AudioMaxCompression;
+	}
+
+	// apply compression factor
+	ScalarScaleSamples(samples, count / AudioBytesProSample, ScalarCompressionFactor);
+    }
+}
+
+/**
+**	Downmix stereo to mono, the old code.
+**
+**	@param in	input sample buffer
+**	@param frames	number of frames in sample buffer
+**	@param out	output sample buffer
+*/
+static void ScalarStereo2Mono(const int16_t * in, int frames, int16_t * out)
+{
+    int i;
+
+    for (i = 0; i < frames; i += 2) {
+	out[i / 2] = (in[i + 0] + in[i + 1]) / 2;
+    }
+}
+
+/**
+**	Downmix surround to stereo, the old code.
+**
+**	@param in	input sample buffer
+**	@param in_chan	nr. of input channels
+**	@param frames	number of frames in sample buffer
+**	@param out	output sample buffer
+*/
+static void ScalarSurround2Stereo(const int16_t * in, int in_chan, int frames, int16_t * out)
+{
+    while (frames--) {
+	int l;
+	int r;
+
+	switch (in_chan) {
+	    case 3:		       // stereo or surround? =>stereo
+		l = in[0] * 600;	// L
+		r = in[1] * 600;	// R
+		l += in[2] * 400;	// C
+		r += in[2] * 400;
+		break;
+	    case 4:		       // quad or surround? =>quad
+		l = in[0] * 600;	// L
+		r = in[1] * 600;	// R
+		l += in[2] * 400;	// Ls
+		r += in[3] * 400;	// Rs
+		break;
+	    case 5:		       // 5.0
+		l = in[0] * 500;	// L
+		r = in[1] * 500;	// R
+		l += in[2] * 200;	// Ls
+		r += in[3] * 200;	// Rs
+		l += in[4] * 300;	// C
+		r += in[4] * 300;
+		break;
+	    case 6:		       // 5.1
+		l = in[0] * 400;	// L
+		r = in[1] * 400;	// R
+		l += in[2] * 200;	// Ls
+		r += in[3] * 200;	// Rs
+		l += in[4] * 300;	// C
+		r += in[4] * 300;
+		l += in[5] * 100;	// LFE
+		r += in[5] * 100;
+		break;
+	    case 7:		       // 7.0
+		l = in[0] * 400;	// L
+		r = in[1] * 400;	// R
+		l += in[2] * 200;	// Ls
+		r += in[3] * 200;	// Rs
+		l += in[4] * 300;	// C
+		r += in[4] * 300;
+		l += in[5] * 100;	// RL
+		r += in[6] * 100;	// RR
+		break;
+	    case 8:		       // 7.1
+		l = in[0] * 400;	// L
+		r = in[1] * 400;	// R
+		l += in[2] * 150;	// Ls
+		r += in[3] * 150;	// Rs
+		l += in[4] * 250;	// C
+		r += in[4] * 250;
+		l += in[5] * 100;	// LFE
+		r += in[5] * 100;
+		l += in[6] * 100;	// RL
+		r += in[7] * 100;	// RR
+		break;
+	    default:
+		abort();
+	}
+	in += in_chan;
+
+	out[0] = l / 1000;
+	out[1] = r / 1000;
+	out += 2;
+    }
+}
+
+//----------------------------------------------------------------------------
+//  Tests
+//----------------------------------------------------------------------------
+
+/**
+**	Check AudioScaleSamples() with many factors, sizes and offsets.
+**
+**	@param seed	generator state
+**	@param rounds	number of runs
+*/
+static void DspTestScale(uint32_t * seed, int rounds)
+{
+    static const int factors[] = { 0, 1, 100, 500, 999, 1000, 1001, 1500, 2000, 5000, 10000, 32767, 65535 };
+    int16_t in[DSP_SAMPLES_MAX + 16];
+    int16_t a[DSP_SAMPLES_MAX + 16];
+    int16_t b[DSP_SAMPLES_MAX + 16];
+    int r;
+
+    for (r = 0; r < rounds; ++r) {
+	unsigned f;
+
+	for (f = 0; f < sizeof(factors) / sizeof(*factors); ++f) {
+	    int offset;
+	    int n;
+
+	    // short blocks hit the vector tails, odd offsets the alignment
+	    offset = Random(seed) % 16;
+	    n = Random(seed) & 1 ? Random(seed) % 80 : Random(seed) % DSP_SAMPLES_MAX;
+	    DspNoise(seed, in, n + offset, r % 16);
+	    memcpy(a, in, sizeof(*in) * (n + offset));
+	    memcpy(b, in, sizeof(*in) * (n + offset));
+
+	    AudioScaleSamples(a + offset, n, factors[f]);
+	    ScalarScaleSamples(b + offset, n, factors[f]);
+	    DspCompare("AudioScaleSamples", a, b, n + offset);
+	}
+    }
+    printf("AudioScaleSamples:    %d rounds\n", rounds);
+}
+
+/**
+**	Check AudioSurround2Stereo() and AudioStereo2Mono() for all layouts.
+**
+**	@param seed	generator state
+**	@param rounds	number of runs
+*/
+static void DspTestDownmix(uint32_t * seed, int rounds)
+{
+    static int16_t in[DSP_SAMPLES_MAX * 8];
+    int16_t a[DSP_SAMPLES_MAX * 2];
+    int16_t b[DSP_SAMPLES_MAX * 2];
+    int r;
+
+    for (r = 0; r < rounds; ++r) {
+	int in_chan;
+	int frames;
+
+	for (in_chan = 3; in_chan <= 8; ++in_chan) {
+	    frames = Random(seed) & 1 ? Random(seed) % 40 : Random(seed) % DSP_SAMPLES_MAX;
+	    DspNoise(seed, in, frames * in_chan, r % 16);
+	    memset(a, 0, sizeof(a));
+	    memset(b, 0, sizeof(b));
+
+	    AudioSurround2Stereo(in, in_chan, frames, a);
+	    ScalarSurround2Stereo(in, in_chan, frames, b);
+	    DspCompare("AudioSurround2Stereo", a, b, frames * 2);
+	}
+
+	// called with the number of samples, which is always even
+	frames = (Random(seed) % DSP_SAMPLES_MAX) & ~1;
+	DspNoise(seed, in, frames, r % 16);
+	memset(a, 0, sizeof(a));
+	memset(b, 0, sizeof(b));
+
+	AudioStereo2Mono(in, frames, a);
+	ScalarStereo2Mono(in, frames, b);
+	DspCompare("AudioStereo2Mono", a, b, frames / 2);
+    }
+    printf("AudioSurround2Stereo: %d rounds\n", rounds);
+}
+
+/**
+**	Check the compressor and the normalizer, output and state.
+**
+**	The level changes slowly, that the factors move over the whole range.
+**
+**	@param seed	generator state
+**	@param rounds	number of runs
+*/
+static void DspTestFilters(uint32_t * seed, int rounds)
+{
+    int16_t a[DSP_SAMPLES_MAX];
+    int16_t b[DSP_SAMPLES_MAX];
+    int r;
+
+    AudioSetNormalize(1, 10000);
+    AudioSetCompression(1, 10000);
+    AudioResetNormalizer();
+    AudioResetCompressor();
+    memset(ScalarNormAverage, 0, sizeof(ScalarNormAverage));
+    ScalarNormIndex = AudioNormIndex;
+    ScalarNormReady = 0;
+    ScalarNormCounter = 0;
+    ScalarNormalizeFactor = AudioNormalizeFactor;
+    ScalarCompressionFactor = AudioCompressionFactor;
+
+    for (r = 0; r < rounds * 16; ++r) {
+	int n;
+
+	n = Random(seed) % DSP_SAMPLES_MAX;
+	DspNoise(seed, a, n, (r / 256) % 16);
+	memcpy(b, a, sizeof(*a) * n);
+
+	AudioCompressor(a, n * AudioBytesProSample);
+	ScalarCompressor(b, n * AudioBytesProSample);
+	DspCompare("AudioCompressor", a, b, n);
+	if (AudioCompressionFactor != ScalarCompressionFactor) {
+	    if (++DspErrors < 10) {
+		fprintf(stderr, "dsptest: compression factor %d, expected %d\n", AudioCompressionFactor,
+		    ScalarCompressionFactor);
+	    }
+	    ScalarCompressionFactor = AudioCompressionFactor;
+	}
+
+	AudioNormalizer(a, n * AudioBytesProSample);
+	ScalarNormalizer(b, n * AudioBytesProSample);
+	DspCompare("AudioNormalizer", a, b, n);
+	if (AudioNormalizeFactor != ScalarNormalizeFactor
+	    || memcmp(AudioNormAverage, ScalarNormAverage, sizeof(AudioNormAverage))) {
+	    if (++DspErrors < 10) {
+		fprintf(stderr, "dsptest: normalize factor %d, expected %d\n", AudioNormalizeFactor,
+		    ScalarNormalizeFactor);
+	    }
+	    ScalarNormalizeFactor = AudioNormalizeFactor;
+	    memcpy(ScalarNormAverage, AudioNormAverage, sizeof(AudioNormAverage));
+	}
+    }
+    printf("AudioCompressor:      %d blocks, factor %d\n", rounds * 16, AudioCompressionFactor);
+    printf("AudioNormalizer:      %d blocks, factor %d\n", rounds * 16, AudioNormalizeFactor);
+}
+
+/**
+**	Regression test main.
+*/
+int main(int argc, char *argv[])
+{
+    uint32_t seed;
+    int rounds;
+
+    if (argc > 2) {
+	fprintf(stderr, "Usage: %s [rounds]\n", argv[0]);
+	return 1;
+    }
+    rounds = argc > 1 ? atoi(argv[1]) : 200;
+    if (rounds < 1) {
+	rounds = 1;
+    }
+
+    seed = 0x2545f491;
+    DspTestScale(&seed, rounds);
+    DspTestDownmix(&seed, rounds);
+    DspTestFilters(&seed, rounds);
+
+    printf("%d errors\n", DspErrors);
+
+    return DspErrors != 0;
+}
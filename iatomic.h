@@ -7,6 +7,9 @@
 //  Defines
 //////////////////////////////////////////////////////////////////////////////
 
+    /// size of a cache line, used to keep producer and consumer data apart
+#define ATOMIC_CACHE_LINE 64
+
 //////////////////////////////////////////////////////////////////////////////
 //  Declares
 //////////////////////////////////////////////////////////////////////////////
@@ -24,38 +27,46 @@ typedef volatile int atomic_t;
 //  Inlines
 //////////////////////////////////////////////////////////////////////////////
 
+//
+//  The atomics are only used for single producer, single consumer
+//  rings: the producer fills a slot and then publishes it with a
+//  release, the consumer sees it with an acquire before using the slot.
+//  No sequential consistency is needed, which avoids the full barriers
+//  on weakly ordered cpus.
+//
+
 ///
-/// Set atomic value.
+/// Set atomic value, publishes all previous writes.
 ///
 #define atomic_set(ptr, val) \
-    __atomic_store_n(ptr, val, __ATOMIC_SEQ_CST)
+    __atomic_store_n(ptr, val, __ATOMIC_RELEASE)
 
 ///
-/// Read atomic value.
+/// Read atomic value, later reads see what was published before.
 ///
 #define atomic_read(ptr) \
-    __atomic_load_n(ptr, __ATOMIC_SEQ_CST)
+    __atomic_load_n(ptr, __ATOMIC_ACQUIRE)
 
 ///
 /// Increment atomic value.
 ///
 #define atomic_inc(ptr) \
-    __atomic_add_fetch(ptr, 1, __ATOMIC_SEQ_CST)
+    __atomic_add_fetch(ptr, 1, __ATOMIC_ACQ_REL)
 
 ///
 /// Decrement atomic value.
 ///
 #define atomic_dec(ptr) \
-    __atomic_sub_fetch(ptr, 1, __ATOMIC_SEQ_CST)
+    __atomic_sub_fetch(ptr, 1, __ATOMIC_ACQ_REL)
 
 ///
 /// Add to atomic value.
 ///
 #define atomic_add(val, ptr) \
-    __atomic_add_fetch(ptr, val, __ATOMIC_SEQ_CST)
+    __atomic_add_fetch(ptr, val, __ATOMIC_ACQ_REL)
 
 ///
 /// Subtract from atomic value.
 ///
 #define atomic_sub(val, ptr) \
-    __atomic_sub_fetch(ptr, val, __ATOMIC_SEQ_CST)
+    __atomic_sub_fetch(ptr, val, __ATOMIC_ACQ_REL)
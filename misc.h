@@ -6,6 +6,7 @@
 #include <syslog.h>
 #include <stdarg.h>
 #include <time.h>			// clock_gettime
+#include <string.h>			// memchr
 
 //////////////////////////////////////////////////////////////////////////////
 //  Defines
@@ -108,3 +109,111 @@ static inline uint32_t GetMsTicks(void)
 {
     return GetUsTicks() / 1000;
 }
+
+/**
+**	Find next start code prefix 0x00 0x00 0x01.
+**
+**	Searches the 0x01 byte with memchr(), libc selects the fastest
+**	(vectorized) variant for the cpu at runtime.
+**
+**	@param data	buffer to scan
+**	@param size	number of bytes in buffer
+**
+**	@returns pointer to the start code prefix, NULL if not found.
+*/
+static inline const uint8_t *FindStartCode(const uint8_t * data, int size)
+{
+    const uint8_t *p;
+    const uint8_t *end;
+
+    p = data + 2;
+    end = data + size;
+    while (p < end && (p = (const uint8_t *)memchr(p, 0x01, end - p))) {
+	if (!p[-1] && !p[-2]) {
+	    return p - 2;
+	}
+	// 0x01 can't be part of the next prefix
+	p += 3;
+    }
+    return NULL;
+}
+
+/**
+**	Convert AV1 OBUs from start code to low overhead bitstream format.
+**
+**	MPEG-TS carries AV1 OBUs with 0x000001 start codes and emulation
+**	prevention bytes, ffmpeg expects OBUs with size fields.  A 4 byte
+**	padded leb128 obu_size is reserved behind the OBU header before the
+**	payload is copied, so the payload is never moved.
+**
+**	@param dst	output buffer, at least @a size + @a size / 4 bytes
+**	@param src	OBUs with start codes
+**	@param size	number of bytes in @a src
+**
+**	@returns number of bytes written to @a dst.
+*/
+static inline int Av1Unescape(uint8_t * dst, const uint8_t * src, int size)
+{
+    uint8_t *out;
+    int i;
+
+    out = dst;
+    i = 0;
+    while (i + 3 < size) {
+	uint8_t *obu;
+	uint8_t *payload;
+	unsigned n;
+	int zeros;
+
+	if (src[i] || src[i + 1] || src[i + 2] != 0x01) {   // find start code
+	    ++i;
+	    continue;
+	}
+	// copy OBU upto the next start code, drop emulation prevention bytes
+	obu = out;
+	payload = NULL;
+	zeros = 0;
+	for (i += 3; i < size; ++i) {
+	    if (zeros >= 2 && src[i] == 0x03) {
+		zeros = 0;
+		continue;
+	    }
+	    if (zeros >= 2 && src[i] == 0x01) {
+		break;
+	    }
+	    zeros = src[i] ? 0 : zeros + 1;
+	    *out++ = src[i];
+	    // OBU header complete, obu_extension_flag selects its length,
+	    // obu_type 0 is reserved, a zero byte starts the next start code
+	    if (!payload && obu[0] && out - obu == (obu[0] & 0x04 ? 2 : 1)) {
+		if (!(obu[0] & 0x02)) {	// reserve obu_size
+		    out += 4;
+		}
+		payload = out;
+	    }
+	}
+	if (!payload) {			// empty, truncated or reserved OBU
+	    out = obu;
+	    if (i < size) {
+		i -= 2;
+	    }
+	    continue;
+	}
+	if (i < size) {			// trailing zeros belong to the start code
+	    n = out - payload;
+	    out -= (unsigned)zeros < n ? (unsigned)zeros : n;
+	    i -= 2;
+	}
+	if (obu[0] & 0x02) {		// obu_has_size_field
+	    continue;
+	}
+	n = out - payload;
+	payload[-4] = (n & 0x7F) | 0x80;
+	payload[-3] = ((n >> 7) & 0x7F) | 0x80;
+	payload[-2] = ((n >> 14) & 0x7F) | 0x80;
+	payload[-1] = (n >> 21) & 0x7F;
+	obu[0] |= 0x02;
+    }
+
+    return out - dst;
+}
@@ -6,6 +6,14 @@
 ///
 /// Lock free ring buffer with only one writer and one reader.
 ///
+/// If possible the buffer memory is mapped twice back-to-back, then
+/// every readable or writable region is contiguous and the wrap at the
+/// end of the buffer is invisible for the users of the read and write
+/// pointers.
+///
+
+#include <sys/mman.h>
+#include <unistd.h>
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -20,12 +28,22 @@ struct _ring_buffer_
     char *Buffer;			///< ring buffer data
     const char *BufferEnd;		///< end of buffer
     size_t Size;			///< bytes in buffer (for faster calc)
+    size_t Capacity;			///< bytes usable, <= Size
+    int Mirrored;			///< buffer is mapped twice back-to-back
 
+    /// keep the reader data in its own cache line
+    char ReaderPad[ATOMIC_CACHE_LINE];
     const char *ReadPointer;		///< only used by reader
+    size_t ReadCount;			///< total bytes read, published by reader
+    size_t WriteCache;			///< last seen WriteCount of reader
+
+    /// keep the writer data in its own cache line
+    char WriterPad[ATOMIC_CACHE_LINE];
     char *WritePointer;			///< only used by writer
+    size_t WriteCount;			///< total bytes written, published by writer
+    size_t ReadCache;			///< last seen ReadCount of writer
 
-    /// The only thing modified by both
-    atomic_t Filled;			///< how many of the buffer is used
+    char EndPad[ATOMIC_CACHE_LINE];	///< no false sharing with next object
 };
 
 /**
@@ -37,7 +55,66 @@ void RingBufferReset(RingBuffer * rb)
 {
     rb->ReadPointer = rb->Buffer;
     rb->WritePointer = rb->Buffer;
-    atomic_set(&rb->Filled, 0);
+    rb->WriteCache = 0;
+    rb->ReadCache = 0;
+    atomic_set(&rb->ReadCount, 0);
+    atomic_set(&rb->WriteCount, 0);
+}
+
+/**
+**	Map the same memory twice back-to-back for the ring buffer.
+**
+**	The mapped size is rounded up to full pages, only the requested
+**	size is used, so that the used bytes keep the granularity the
+**	caller chose (fe. complete audio frames).
+**
+**	@param rb	Ring buffer.
+**	@param size	Size of the ring buffer.
+**
+**	@returns	True, if the mirrored buffer could be mapped.
+*/
+static int RingBufferMapMirrored(RingBuffer * rb, size_t size)
+{
+#ifdef MFD_CLOEXEC
+    long page;
+    int fd;
+    char *base;
+
+    if ((page = sysconf(_SC_PAGESIZE)) <= 0) {
+	return 0;
+    }
+    size = (size + page - 1) / page * page;
+
+    if ((fd = memfd_create("ringbuffer", MFD_CLOEXEC)) < 0) {
+	return 0;
+    }
+    if (ftruncate(fd, size) < 0) {
+	close(fd);
+	return 0;
+    }
+    // reserve the address range, then map the memory into both halves
+    base = mmap(NULL, 2 * size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) {
+	close(fd);
+	return 0;
+    }
+    if (mmap(base, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED
+	|| mmap(base + size, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+	munmap(base, 2 * size);
+	close(fd);
+	return 0;
+    }
+    close(fd);				// the mappings keep the memory
+
+    rb->Buffer = base;
+    rb->Size = size;
+    rb->Mirrored = 1;
+    return 1;
+#else
+    (void)rb;
+    (void)size;
+    return 0;
+#endif
 }
 
 /**
@@ -55,13 +132,17 @@ RingBuffer *RingBufferNew(size_t size)
     if (!(rb = malloc(sizeof(*rb)))) {	// allocate structure
 	return rb;
     }
-    if (!(rb->Buffer = malloc(size))) { // allocate buffer
-	free(rb);
-	return NULL;
+    if (!RingBufferMapMirrored(rb, size)) {
+	if (!(rb->Buffer = malloc(size))) { // allocate buffer
+	    free(rb);
+	    return NULL;
+	}
+	rb->Size = size;
+	rb->Mirrored = 0;
     }
 
-    rb->Size = size;
-    rb->BufferEnd = rb->Buffer + size;
+    rb->Capacity = size;
+    rb->BufferEnd = rb->Buffer + rb->Size;
     RingBufferReset(rb);
 
     return rb;
@@ -72,10 +153,60 @@ RingBuffer *RingBufferNew(size_t size)
 */
 void RingBufferDel(RingBuffer * rb)
 {
-    free(rb->Buffer);
+    if (rb->Mirrored) {
+	munmap(rb->Buffer, 2 * rb->Size);
+    } else {
+	free(rb->Buffer);
+    }
     free(rb);
 }
 
+/**
+**	Get free bytes for the writer.
+**
+**	The read counter of the reader is only fetched, if the cached value
+**	doesn't give enough space.
+**
+**	@param rb	Ring buffer.
+**	@param cnt	Number of bytes wanted.
+**
+**	@returns	Number of bytes free in buffer.
+*/
+static inline size_t RingBufferWriterFree(RingBuffer * rb, size_t cnt)
+{
+    size_t n;
+
+    n = rb->Capacity - (rb->WriteCount - rb->ReadCache);
+    if (cnt > n) {			// refresh from reader
+	rb->ReadCache = atomic_read(&rb->ReadCount);
+	n = rb->Capacity - (rb->WriteCount - rb->ReadCache);
+    }
+    return n;
+}
+
+/**
+**	Get used bytes for the reader.
+**
+**	The write counter of the writer is only fetched, if the cached value
+**	doesn't give enough data.
+**
+**	@param rb	Ring buffer.
+**	@param cnt	Number of bytes wanted.
+**
+**	@returns	Number of bytes used in buffer.
+*/
+static inline size_t RingBufferReaderUsed(RingBuffer * rb, size_t cnt)
+{
+    size_t n;
+
+    n = rb->WriteCache - rb->ReadCount;
+    if (cnt > n) {			// refresh from writer
+	rb->WriteCache = atomic_read(&rb->WriteCount);
+	n = rb->WriteCache - rb->ReadCount;
+    }
+    return n;
+}
+
 /**
 **	Advance write pointer in ring buffer.
 **
@@ -88,7 +219,7 @@ size_t RingBufferWriteAdvance(RingBuffer * rb, size_t cnt)
 {
     size_t n;
 
-    n = rb->Size - atomic_read(&rb->Filled);
+    n = RingBufferWriterFree(rb, cnt);
     if (cnt > n) {			// not enough space
 	cnt = n;
     }
@@ -107,9 +238,9 @@ size_t RingBufferWriteAdvance(RingBuffer * rb, size_t cnt)
     }
 
     //
-    //	Only atomic modification!
+    //	Publish the written data to the reader
     //
-    atomic_add(cnt, &rb->Filled);
+    atomic_set(&rb->WriteCount, rb->WriteCount + cnt);
     return cnt;
 }
 
@@ -127,7 +258,7 @@ size_t RingBufferWrite(RingBuffer * rb, const void *buf, size_t cnt)
 {
     size_t n;
 
-    n = rb->Size - atomic_read(&rb->Filled);
+    n = RingBufferWriterFree(rb, cnt);
     if (cnt > n) {			// not enough space
 	cnt = n;
     }
@@ -138,6 +269,9 @@ size_t RingBufferWrite(RingBuffer * rb, const void *buf, size_t cnt)
     if (n > cnt) {			// don't cross the end
 	memcpy(rb->WritePointer, buf, cnt);
 	rb->WritePointer += cnt;
+    } else if (rb->Mirrored) {		// mirror continues behind the end
+	memcpy(rb->WritePointer, buf, cnt);
+	rb->WritePointer = rb->Buffer + (cnt - n);
     } else {				// reached or cross the end
 	memcpy(rb->WritePointer, buf, n);
 	rb->WritePointer = rb->Buffer;
@@ -150,9 +284,9 @@ size_t RingBufferWrite(RingBuffer * rb, const void *buf, size_t cnt)
     }
 
     //
-    //	Only atomic modification!
+    //	Publish the written data to the reader
     //
-    atomic_add(cnt, &rb->Filled);
+    atomic_set(&rb->WriteCount, rb->WriteCount + cnt);
     return cnt;
 }
 
@@ -163,22 +297,23 @@ size_t RingBufferWrite(RingBuffer * rb, const void *buf, size_t cnt)
 **	@param[out] wp	Write pointer is placed here
 **
 **	@returns	The number of bytes that could be placed in the ring
-**			buffer at the write pointer.
+**			buffer at the write pointer, with a mirrored buffer
+**			all free bytes.
 */
 size_t RingBufferGetWritePointer(RingBuffer * rb, void **wp)
 {
     size_t n;
     size_t cnt;
 
-    //	Total free bytes available in ring buffer
-    cnt = rb->Size - atomic_read(&rb->Filled);
-
     *wp = rb->WritePointer;
 
     //
     //	Hitting end of buffer?
     //
-    n = rb->BufferEnd - rb->WritePointer;
+    n = rb->Mirrored ? rb->Capacity : (size_t)(rb->BufferEnd - rb->WritePointer);
+
+    //	Total free bytes available in ring buffer
+    cnt = RingBufferWriterFree(rb, n);
     if (n <= cnt) {			// reached or cross the end
 	return n;
     }
@@ -197,7 +332,7 @@ size_t RingBufferReadAdvance(RingBuffer * rb, size_t cnt)
 {
     size_t n;
 
-    n = atomic_read(&rb->Filled);
+    n = RingBufferReaderUsed(rb, cnt);
     if (cnt > n) {			// not enough filled
 	cnt = n;
     }
@@ -216,9 +351,9 @@ size_t RingBufferReadAdvance(RingBuffer * rb, size_t cnt)
     }
 
     //
-    //	Only atomic modification!
+    //	Give the read space back to the writer
     //
-    atomic_sub(cnt, &rb->Filled);
+    atomic_set(&rb->ReadCount, rb->ReadCount + cnt);
     return cnt;
 }
 
@@ -235,7 +370,7 @@ size_t RingBufferRead(RingBuffer * rb, void *buf, size_t cnt)
 {
     size_t n;
 
-    n = atomic_read(&rb->Filled);
+    n = RingBufferReaderUsed(rb, cnt);
     if (cnt > n) {			// not enough filled
 	cnt = n;
     }
@@ -246,6 +381,9 @@ size_t RingBufferRead(RingBuffer * rb, void *buf, size_t cnt)
     if (n > cnt) {			// don't cross the end
 	memcpy(buf, rb->ReadPointer, cnt);
 	rb->ReadPointer += cnt;
+    } else if (rb->Mirrored) {		// mirror continues behind the end
+	memcpy(buf, rb->ReadPointer, cnt);
+	rb->ReadPointer = rb->Buffer + (cnt - n);
     } else {				// reached or cross the end
 	memcpy(buf, rb->ReadPointer, n);
 	rb->ReadPointer = rb->Buffer;
@@ -258,9 +396,9 @@ size_t RingBufferRead(RingBuffer * rb, void *buf, size_t cnt)
     }
 
     //
-    //	Only atomic modification!
+    //	Give the read space back to the writer
     //
-    atomic_sub(cnt, &rb->Filled);
+    atomic_set(&rb->ReadCount, rb->ReadCount + cnt);
     return cnt;
 }
 
@@ -271,22 +409,23 @@ size_t RingBufferRead(RingBuffer * rb, void *buf, size_t cnt)
 **	@param[out] rp	Read pointer is placed here
 **
 **	@returns	The number of bytes that could be read from the ring
-**			buffer at the read pointer.
+**			buffer at the read pointer, with a mirrored buffer all
+**			used bytes.
 */
 size_t RingBufferGetReadPointer(RingBuffer * rb, const void **rp)
 {
     size_t n;
     size_t cnt;
 
-    //	Total used bytes in ring buffer
-    cnt = atomic_read(&rb->Filled);
-
     *rp = rb->ReadPointer;
 
     //
     //	Hitting end of buffer?
     //
-    n = rb->BufferEnd - rb->ReadPointer;
+    n = rb->Mirrored ? rb->Capacity : (size_t)(rb->BufferEnd - rb->ReadPointer);
+
+    //	Total used bytes in ring buffer
+    cnt = RingBufferReaderUsed(rb, n);
     if (n <= cnt) {			// reached or cross the end
 	return n;
     }
@@ -302,7 +441,7 @@ size_t RingBufferGetReadPointer(RingBuffer * rb, const void **rp)
 */
 size_t RingBufferFreeBytes(RingBuffer * rb)
 {
-    return rb->Size - atomic_read(&rb->Filled);
+    return rb->Capacity - RingBufferUsedBytes(rb);
 }
 
 /**
@@ -314,5 +453,23 @@ size_t RingBufferFreeBytes(RingBuffer * rb)
 */
 size_t RingBufferUsedBytes(RingBuffer * rb)
 {
-    return atomic_read(&rb->Filled);
+    size_t write;
+    size_t used;
+
+    write = atomic_read(&rb->WriteCount);
+    used = write - atomic_read(&rb->ReadCount);
+    // a third thread can see the reader ahead of the loaded write counter
+    return used > rb->Capacity ? 0 : used;
+}
+
+/**
+**	Check if all used and free bytes of the ring buffer are contiguous.
+**
+**	@param rb	Ring buffer.
+**
+**	@returns	True, if read and write pointer give complete spans.
+*/
+int RingBufferIsContiguous(const RingBuffer * rb)
+{
+    return rb->Mirrored;
 }
@@ -38,3 +38,6 @@ extern size_t RingBufferFreeBytes(RingBuffer *);
 
     /// used bytes ring buffer
 extern size_t RingBufferUsedBytes(RingBuffer *);
+
+    /// all free/used bytes are contiguous at the write/read pointer
+extern int RingBufferIsContiguous(const RingBuffer *);
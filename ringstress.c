@@ -0,0 +1,396 @@
+/// Copyright (C) 2018 by pesintta, rofafor.
+///
+/// SPDX-License-Identifier: AGPL-3.0-only
+
+///
+/// Ring buffer stress test.
+///
+/// Runs a writer and a reader thread against the lock free RingBuffer,
+/// with the copy and the zero copy interface, while a third thread polls
+/// the used and free bytes.  A second run moves records through a slot
+/// ring with an atomic_t fill counter, like SurfacesRb and PacketRb.
+/// The byte stream and the records are verified by the readers.
+///
+/// Built with ThreadSanitizer by "make stress", which reports any data
+/// race the ordering of iatomic.h allows.
+///
+/// Usage: ringstress [MiB]
+///
+
+#include <pthread.h>
+#include <sched.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+
+#include "iatomic.h"
+#include "ringbuffer.h"
+
+#define RING_CHUNK_MAX 4096		///< largest single write or read
+#define SLOT_MAX 4			///< slots of the slot ring, like VIDEO_SURFACES_MAX
+
+///
+/// Byte stream stress test data.
+///
+typedef struct _ring_stress_
+{
+    RingBuffer *Ring;			///< ring buffer under test
+    size_t Capacity;			///< usable bytes of the ring
+    uint64_t Total;			///< bytes to move through the ring
+    atomic_t Done;			///< reader has seen all bytes
+    atomic_t Errors;			///< number of detected errors
+} RingStress;
+
+///
+/// Slot ring record, written by the producer before it is published.
+///
+typedef struct _slot_record_
+{
+    uint32_t Sequence;			///< running number of the record
+    uint32_t Check;			///< derived from sequence
+    uint8_t Payload[64];		///< filled from sequence
+} SlotRecord;
+
+///
+/// Slot ring stress test data.
+///
+typedef struct _slot_stress_
+{
+    SlotRecord Slots[SLOT_MAX];		///< record ring
+    int Write;				///< write index, producer only
+    int Read;				///< read index, consumer only
+    atomic_t Filled;			///< how many slots are used
+    uint32_t Total;			///< records to move through the ring
+    atomic_t Errors;			///< number of detected errors
+} SlotStress;
+
+/**
+**	Pseudo random number generator (xorshift32).
+**
+**	@param state	generator state, not 0
+*/
+static uint32_t Random(uint32_t * state)
+{
+    uint32_t x;
+
+    x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *state = x;
+}
+
+/**
+**	Byte expected at a position of the stream.
+**
+**	@param pos	stream position
+*/
+static uint8_t Pattern(uint64_t pos)
+{
+    return (uint8_t) (pos * 7 + (pos >> 11));
+}
+
+/**
+**	Get the next chunk size.
+**
+**	@param seed	generator state
+**	@param left	bytes left in the stream
+*/
+static size_t ChunkSize(uint32_t * seed, uint64_t left)
+{
+    size_t n;
+
+    // mostly small chunks, sometimes large ones to wrap the buffer
+    n = 1 + Random(seed) % (Random(seed) & 7 ? 64 : RING_CHUNK_MAX);
+    return n < left ? n : left;
+}
+
+/**
+**	Writer thread of the byte stream test.
+**
+**	@param arg	stress test data
+*/
+static void *RingWriter(void *arg)
+{
+    RingStress *stress;
+    uint8_t chunk[RING_CHUNK_MAX];
+    uint64_t pos;
+    uint32_t seed;
+
+    stress = arg;
+    seed = 0x12345678;
+    for (pos = 0; pos < stress->Total;) {
+	size_t want;
+	size_t n;
+	size_t i;
+
+	want = ChunkSize(&seed, stress->Total - pos);
+	if (Random(&seed) & 1) {	// copy interface
+	    for (i = 0; i < want; ++i) {
+		chunk[i] = Pattern(pos + i);
+	    }
+	    n = RingBufferWrite(stress->Ring, chunk, want);
+	} else {			// zero copy interface
+	    void *p;
+	    uint8_t *wp;
+
+	    n = RingBufferGetWritePointer(stress->Ring, &p);
+	    if (n > want) {
+		n = want;
+	    }
+	    wp = p;
+	    for (i = 0; i < n; ++i) {
+		wp[i] = Pattern(pos + i);
+	    }
+	    n = RingBufferWriteAdvance(stress->Ring, n);
+	}
+	if (!n) {			// ring full
+	    sched_yield();
+	}
+	pos += n;
+    }
+    return NULL;
+}
+
+/**
+**	Reader thread of the byte stream test.
+**
+**	@param arg	stress test data
+*/
+static void *RingReader(void *arg)
+{
+    RingStress *stress;
+    uint8_t chunk[RING_CHUNK_MAX];
+    uint64_t pos;
+    uint32_t seed;
+
+    stress = arg;
+    seed = 0x9abcdef0;
+    for (pos = 0; pos < stress->Total;) {
+	const uint8_t *rp;
+	size_t want;
+	size_t n;
+	size_t i;
+
+	want = ChunkSize(&seed, stress->Total - pos);
+	if (Random(&seed) & 1) {	// copy interface
+	    n = RingBufferRead(stress->Ring, chunk, want);
+	    rp = chunk;
+	} else {			// zero copy interface
+	    const void *p;
+
+	    n = RingBufferGetReadPointer(stress->Ring, &p);
+	    if (n > want) {
+		n = want;
+	    }
+	    rp = p;
+	}
+	for (i = 0; i < n; ++i) {
+	    if (rp[i] != Pattern(pos + i)) {
+		if (atomic_inc(&stress->Errors) < 10) {
+		    fprintf(stderr, "ringstress: byte %" PRIu64 " is %#04x, expected %#04x\n", pos + i, rp[i],
+			Pattern(pos + i));
+		}
+	    }
+	}
+	if (rp != chunk) {
+	    n = RingBufferReadAdvance(stress->Ring, n);
+	}
+	if (!n) {			// ring empty
+	    sched_yield();
+	}
+	pos += n;
+    }
+    atomic_set(&stress->Done, 1);
+    return NULL;
+}
+
+/**
+**	Observer thread of the byte stream test, polls like AudioGetDelay().
+**
+**	@param arg	stress test data
+*/
+static void *RingObserver(void *arg)
+{
+    RingStress *stress;
+
+    stress = arg;
+    while (!atomic_read(&stress->Done)) {
+	size_t used;
+	size_t free;
+
+	used = RingBufferUsedBytes(stress->Ring);
+	free = RingBufferFreeBytes(stress->Ring);
+	if (used > stress->Capacity || free > stress->Capacity) {
+	    if (atomic_inc(&stress->Errors) < 10) {
+		fprintf(stderr, "ringstress: used %zu free %zu capacity %zu\n", used, free, stress->Capacity);
+	    }
+	}
+	sched_yield();
+    }
+    return NULL;
+}
+
+/**
+**	Run the byte stream test.
+**
+**	@param size	ring buffer size
+**	@param total	bytes to move through the ring
+**
+**	@returns number of detected errors.
+*/
+static int RingStressRun(size_t size, uint64_t total)
+{
+    RingStress stress[1];
+    pthread_t threads[3];
+    int i;
+
+    memset(stress, 0, sizeof(stress));
+    if (!(stress->Ring = RingBufferNew(size))) {
+	fprintf(stderr, "ringstress: can't allocate ring buffer\n");
+	return 1;
+    }
+    stress->Capacity = RingBufferFreeBytes(stress->Ring);
+    stress->Total = total;
+
+    pthread_create(&threads[0], NULL, RingWriter, stress);
+    pthread_create(&threads[1], NULL, RingReader, stress);
+    pthread_create(&threads[2], NULL, RingObserver, stress);
+    for (i = 0; i < 3; ++i) {
+	pthread_join(threads[i], NULL);
+    }
+    if (RingBufferUsedBytes(stress->Ring)) {
+	fprintf(stderr, "ringstress: %zu bytes left in ring\n", RingBufferUsedBytes(stress->Ring));
+	atomic_inc(&stress->Errors);
+    }
+
+    printf("ring %6zu bytes %s: %" PRIu64 " bytes, %d errors\n", size,
+	RingBufferIsContiguous(stress->Ring) ? "mirrored" : "plain   ", total, atomic_read(&stress->Errors));
+    RingBufferDel(stress->Ring);
+
+    return atomic_read(&stress->Errors);
+}
+
+/**
+**	Producer thread of the slot ring test.
+**
+**	@param arg	stress test data
+*/
+static void *SlotProducer(void *arg)
+{
+    SlotStress *stress;
+    uint32_t seq;
+
+    stress = arg;
+    for (seq = 0; seq < stress->Total;) {
+	SlotRecord *slot;
+
+	// same full check as VaapiQueueSurface()
+	if (atomic_read(&stress->Filled) >= SLOT_MAX - 1) {
+	    sched_yield();
+	    continue;
+	}
+	slot = &stress->Slots[stress->Write];
+	slot->Sequence = seq;
+	slot->Check = seq * 2654435761u;
+	memset(slot->Payload, (uint8_t) seq, sizeof(slot->Payload));
+	stress->Write = (stress->Write + 1) % SLOT_MAX;
+	atomic_inc(&stress->Filled);
+	++seq;
+    }
+    return NULL;
+}
+
+/**
+**	Consumer thread of the slot ring test.
+**
+**	@param arg	stress test data
+*/
+static void *SlotConsumer(void *arg)
+{
+    SlotStress *stress;
+    uint32_t seq;
+
+    stress = arg;
+    for (seq = 0; seq < stress->Total;) {
+	const SlotRecord *slot;
+	size_t i;
+
+	if (!atomic_read(&stress->Filled)) {
+	    sched_yield();
+	    continue;
+	}
+	slot = &stress->Slots[stress->Read];
+	if (slot->Sequence != seq || slot->Check != seq * 2654435761u) {
+	    if (atomic_inc(&stress->Errors) < 10) {
+		fprintf(stderr, "ringstress: slot %u has record %u\n", seq, slot->Sequence);
+	    }
+	}
+	for (i = 0; i < sizeof(slot->Payload); ++i) {
+	    if (slot->Payload[i] != (uint8_t) seq) {
+		atomic_inc(&stress->Errors);
+		break;
+	    }
+	}
+	stress->Read = (stress->Read + 1) % SLOT_MAX;
+	atomic_dec(&stress->Filled);
+	++seq;
+    }
+    return NULL;
+}
+
+/**
+**	Run the slot ring test.
+**
+**	@param total	records to move through the ring
+**
+**	@returns number of detected errors.
+*/
+static int SlotStressRun(uint32_t total)
+{
+    SlotStress stress[1];
+    pthread_t producer;
+    pthread_t consumer;
+
+    memset(stress, 0, sizeof(stress));
+    stress->Total = total;
+
+    pthread_create(&producer, NULL, SlotProducer, stress);
+    pthread_create(&consumer, NULL, SlotConsumer, stress);
+    pthread_join(producer, NULL);
+    pthread_join(consumer, NULL);
+
+    printf("slot ring %d slots: %u records, %d errors\n", SLOT_MAX, total, atomic_read(&stress->Errors));
+
+    return atomic_read(&stress->Errors);
+}
+
+/**
+**	Stress test main.
+*/
+int main(int argc, char *argv[])
+{
+    uint64_t total;
+    int errors;
+
+    if (argc > 2) {
+	fprintf(stderr, "Usage: %s [MiB]\n", argv[0]);
+	return 1;
+    }
+    total = (uint64_t) (argc > 1 ? atoi(argv[1]) : 16) * 1024 * 1024;
+    if (!total) {
+	total = 1024 * 1024;
+    }
+
+    errors = 0;
+    // page sized, odd sized and audio ring sized buffers
+    errors += RingStressRun(4096, total);
+    errors += RingStressRun(3 * 1000 + 7, total);
+    errors += RingStressRun(3 * 5 * 7 * 8 * 1024, total);
+    errors += SlotStressRun(total / 64);
+
+    return errors != 0;
+}
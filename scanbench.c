@@ -0,0 +1,287 @@
+/// Copyright (C) 2018 by pesintta, rofafor.
+///
+/// SPDX-License-Identifier: AGPL-3.0-only
+
+///
+/// Start code scanner micro-benchmark.
+///
+/// Extracts the video PES payloads of a recorded transport stream and
+/// splits them at MPEG-2 picture start codes, once with the byte loop
+/// VideoMpegEnqueue() used before and once with FindStartCode().  Both
+/// scanners must find the same picture start codes.
+///
+/// Usage: scanbench file.ts [rounds]
+///
+
+#include <fcntl.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <string.h>
+
+#include "misc.h"
+
+#define TS_PACKET_SIZE 188		///< size of a transport stream packet
+#define TS_PACKET_SYNC 0x47		///< sync byte of a transport stream packet
+
+int TraceMode;				///< trace mode for debugging
+
+/**
+**	Logging function, not used by the scanner.
+*/
+void LogMessage( __attribute__ ((unused))
+    int trace, __attribute__ ((unused))
+    int level, __attribute__ ((unused))
+    const char *format, ...)
+{
+}
+
+///
+/// Recorded video PES payloads.
+///
+typedef struct _scan_payloads_
+{
+    uint8_t *Data;			///< all payloads back to back
+    size_t Size;			///< used bytes of data
+    size_t Alloc;			///< allocated bytes of data
+    size_t *Offset;			///< start of payloads in data
+    unsigned Count;			///< number of payloads
+    unsigned Max;			///< allocated offsets
+} ScanPayloads;
+
+/**
+**	Append bytes to the current payload.
+**
+**	@param payloads	recorded payloads
+**	@param data	bytes to append
+**	@param size	number of bytes
+*/
+static void PayloadAppend(ScanPayloads * payloads, const uint8_t * data, size_t size)
+{
+    if (payloads->Size + size > payloads->Alloc) {
+	payloads->Alloc = (payloads->Size + size) * 2;
+	if (!(payloads->Data = realloc(payloads->Data, payloads->Alloc))) {
+	    abort();
+	}
+    }
+    memcpy(payloads->Data + payloads->Size, data, size);
+    payloads->Size += size;
+}
+
+/**
+**	Start a new payload.
+**
+**	@param payloads	recorded payloads
+*/
+static void PayloadStart(ScanPayloads * payloads)
+{
+    if (payloads->Count + 1 >= payloads->Max) {
+	payloads->Max = payloads->Max ? payloads->Max * 2 : 1024;
+	if (!(payloads->Offset = realloc(payloads->Offset, payloads->Max * sizeof(*payloads->Offset)))) {
+	    abort();
+	}
+    }
+    payloads->Offset[payloads->Count++] = payloads->Size;
+}
+
+/**
+**	Read the video PES payloads of a transport stream.
+**
+**	The first PID with a video PES stream id is used, the PES headers
+**	are removed.
+**
+**	@param fd	file descriptor of the transport stream
+**	@param payloads	recorded payloads
+*/
+static void ReadPayloads(int fd, ScanPayloads * payloads)
+{
+    uint8_t packet[TS_PACKET_SIZE];
+    int video_pid;
+    int in_pes;
+
+    video_pid = -1;
+    in_pes = 0;
+    while (read(fd, packet, sizeof(packet)) == sizeof(packet)) {
+	const uint8_t *p;
+	const uint8_t *e;
+	int pid;
+
+	if (packet[0] != TS_PACKET_SYNC) {
+	    fprintf(stderr, "scanbench: lost ts sync\n");
+	    break;
+	}
+	pid = (packet[1] & 0x1F) << 8 | packet[2];
+	p = packet + 4;
+	e = packet + TS_PACKET_SIZE;
+	if (packet[3] & 0x20) {		// adaptation field
+	    p += 1 + packet[4];
+	}
+	if (!(packet[3] & 0x10) || p >= e || (video_pid >= 0 && pid != video_pid)) {
+	    continue;
+	}
+	if (packet[1] & 0x40) {		// payload unit start
+	    if (p + 9 > e || p[0] || p[1] || p[2] != 0x01 || (p[3] & 0xF0) != 0xE0 || p + 9 + p[8] > e) {
+		in_pes = 0;
+		continue;
+	    }
+	    video_pid = pid;
+	    PayloadStart(payloads);
+	    p += 9 + p[8];
+	    in_pes = 1;
+	}
+	if (in_pes) {
+	    PayloadAppend(payloads, p, e - p);
+	}
+    }
+    if (payloads->Count) {		// end of last payload
+	payloads->Offset[payloads->Count] = payloads->Size;
+    }
+}
+
+/**
+**	Count picture start codes with the old byte loop.
+**
+**	@param p	PES payload
+**	@param n	number of bytes
+*/
+static unsigned ScanScalar(const uint8_t * p, int n)
+{
+    unsigned found;
+
+    found = 0;
+    while (n > 3) {
+	if (!p[0] && !p[1] && p[2] == 0x01 && !p[3]) {
+	    ++found;
+	    n -= 4;
+	    p += 4;
+	    continue;
+	}
+	--n;
+	++p;
+    }
+    return found;
+}
+
+/**
+**	Count picture start codes like VideoMpegEnqueue().
+**
+**	@param p	PES payload
+**	@param n	number of bytes
+*/
+static unsigned ScanFindStartCode(const uint8_t * p, int n)
+{
+    unsigned found;
+
+    found = 0;
+    while (n > 3) {
+	const uint8_t *s;
+
+	if (!(s = FindStartCode(p, n - 1))) {
+	    break;
+	}
+	n -= s - p;
+	p = s;
+	if (!p[3]) {
+	    ++found;
+	    n -= 4;
+	    p += 4;
+	    continue;
+	}
+	--n;
+	++p;
+    }
+    return found;
+}
+
+/**
+**	Run a scanner over all payloads.
+**
+**	@param payloads	recorded payloads
+**	@param scan	scanner
+**	@param rounds	number of runs over all payloads
+**	@param[out] found	picture start codes found per round
+**
+**	@returns time used in ns.
+*/
+static uint64_t Bench(const ScanPayloads * payloads, unsigned (*scan)(const uint8_t *, int), int rounds,
+    unsigned *found)
+{
+    uint64_t start;
+    int r;
+
+    start = GetNsTicks();
+    for (r = 0; r < rounds; ++r) {
+	unsigned i;
+
+	*found = 0;
+	for (i = 0; i < payloads->Count; ++i) {
+	    *found += scan(payloads->Data + payloads->Offset[i], payloads->Offset[i + 1] - payloads->Offset[i]);
+	}
+    }
+    return GetNsTicks() - start;
+}
+
+/**
+**	Benchmark main.
+*/
+int main(int argc, char *argv[])
+{
+    ScanPayloads payloads[1];
+    uint64_t scalar;
+    uint64_t memchr_ns;
+    unsigned found_scalar;
+    unsigned found_memchr;
+    unsigned i;
+    int rounds;
+    int fd;
+
+    if (argc < 2 || argc > 3) {
+	fprintf(stderr, "Usage: %s file.ts [rounds]\n", argv[0]);
+	return 1;
+    }
+    rounds = argc > 2 ? atoi(argv[2]) : 20;
+    if (rounds < 1) {
+	rounds = 1;
+    }
+    if ((fd = open(argv[1], O_RDONLY)) < 0) {
+	perror(argv[1]);
+	return 1;
+    }
+    memset(payloads, 0, sizeof(payloads));
+    ReadPayloads(fd, payloads);
+    close(fd);
+    if (!payloads->Count) {
+	fprintf(stderr, "%s: no video PES found\n", argv[1]);
+	return 1;
+    }
+    // check, both must split at the same picture start codes
+    for (i = 0; i < payloads->Count; ++i) {
+	const uint8_t *data;
+	int size;
+
+	data = payloads->Data + payloads->Offset[i];
+	size = payloads->Offset[i + 1] - payloads->Offset[i];
+	if (ScanScalar(data, size) != ScanFindStartCode(data, size)) {
+	    fprintf(stderr, "scanbench: mismatch in PES %u\n", i);
+	    return 1;
+	}
+    }
+
+    scalar = Bench(payloads, ScanScalar, rounds, &found_scalar);
+    memchr_ns = Bench(payloads, ScanFindStartCode, rounds, &found_memchr);
+
+    printf("%s: %u PES, %zu bytes, %u picture start codes, %d rounds\n", argv[1], payloads->Count, payloads->Size,
+	found_scalar, rounds);
+    printf("scalar:        %8.3f ms/round %8.1f MB/s\n", scalar / 1e6 / rounds,
+	payloads->Size * (double)rounds / (scalar / 1e9) / 1e6);
+    printf("FindStartCode: %8.3f ms/round %8.1f MB/s\n", memchr_ns / 1e6 / rounds,
+	payloads->Size * (double)rounds / (memchr_ns / 1e9) / 1e6);
+
+    free(payloads->Data);
+    free(payloads->Offset);
+
+    return found_scalar != found_memchr;
+}
@@ -0,0 +1,341 @@
+/// Copyright (C) 2018 by pesintta, rofafor.
+///
+/// SPDX-License-Identifier: AGPL-3.0-only
+
+///
+/// Offline replay benchmark.
+///
+/// Feeds a recorded transport stream through PlayTsVideo() and
+/// PlayTsAudio() as fast as possible.  The plugin runs with the headless
+/// null video output without frame pacing and the noop audio output, the
+/// VDR symbols used by the C part of the plugin are stubbed here.
+///
+/// Usage: tsreplay file.ts [plugin arguments]
+///
+
+#include <fcntl.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <string.h>
+
+#include "misc.h"
+#include "vaapidevice.h"
+
+//////////////////////////////////////////////////////////////////////////////
+//  VDR stubs
+//////////////////////////////////////////////////////////////////////////////
+
+int SysLogLevel = 2;			///< VDR's global log level
+int ConfigAudioBufferTime;		///< config size ms of audio buffer
+volatile char SoftIsPlayingVideo = 1;	///< stream contains video data
+
+/**
+**	Logging function, writes to stderr instead of syslog.
+*/
+void LogMessage(int trace, int level, const char *format, ...)
+{
+    va_list ap;
+
+    if (SysLogLevel <= level) {
+	return;
+    }
+    if (level == 2 && !((1 << (trace - 1)) & 0xFFFF & TraceMode)) {
+	return;
+    }
+    fputs(level ? "VAAPI: " : "VAAPI-ERROR: ", stderr);
+    va_start(ap, format);
+    vfprintf(stderr, format, ap);
+    va_end(ap);
+    fputc('\n', stderr);
+}
+
+/**
+**	Feed key press, there is no remote.
+*/
+void FeedKeyPress( __attribute__ ((unused))
+    const char *keymap, __attribute__ ((unused))
+    const char *key, __attribute__ ((unused))
+    int repeat, __attribute__ ((unused))
+    int release, __attribute__ ((unused))
+    const char *letter)
+{
+}
+
+/**
+**	Create jpeg image, not supported.
+*/
+uint8_t *CreateJpeg( __attribute__ ((unused))
+    uint8_t * image, int *size, __attribute__ ((unused))
+    int quality, __attribute__ ((unused))
+    int width, __attribute__ ((unused))
+    int height)
+{
+    *size = 0;
+    return NULL;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//  Replay
+//////////////////////////////////////////////////////////////////////////////
+
+#define TS_PACKET_SIZE 188		///< size of a transport stream packet
+#define TS_PACKET_SYNC 0x47		///< sync byte of a transport stream packet
+#define TS_READ_PACKETS 1024		///< packets read at once
+#define TS_BUSY_TIMEOUT 5000		///< give up a busy packet after ms
+
+///
+/// Elementary stream type of a PID.
+///
+enum
+{
+    TS_PID_UNKNOWN = 0,			///< no PES start seen
+    TS_PID_VIDEO,			///< video PES
+    TS_PID_AUDIO,			///< first audio PES
+    TS_PID_OTHER,			///< tables, other audio tracks, ...
+};
+
+///
+/// Replay counters of one elementary stream.
+///
+typedef struct _ts_replay_stream_
+{
+    int Pid;				///< PID of the stream, -1 none
+    unsigned Packets;			///< TS packets fed
+    unsigned Busy;			///< times the device was busy
+    unsigned Lost;			///< packets given up after busy timeout
+    uint64_t Ns;			///< time spent in PlayTs* in ns
+} TsReplayStream;
+
+static unsigned char PidType[8192];	///< elementary stream type of PIDs
+static TsReplayStream ReplayVideo = {.Pid = -1 };   ///< video stream counters
+static TsReplayStream ReplayAudio = {.Pid = -1 };   ///< audio stream counters
+
+/**
+**	Classify the PID of a TS packet by its PES stream id.
+**
+**	@param data	TS packet
+**	@param pid	PID of the packet
+*/
+static void ReplayClassify(const uint8_t * data, int pid)
+{
+    const uint8_t *p;
+
+    if (!(data[1] & 0x40)) {		// no payload unit start
+	return;
+    }
+    p = data + 4;
+    if (data[3] & 0x20) {		// adaptation field
+	p += 1 + data[4];
+    }
+    if (!(data[3] & 0x10) || p + 4 > data + TS_PACKET_SIZE) {
+	return;
+    }
+    PidType[pid] = TS_PID_OTHER;
+    if (p[0] || p[1] || p[2] != 0x01) {	// no PES, PSI tables
+	return;
+    }
+    if ((p[3] & 0xF0) == 0xE0) {
+	if (ReplayVideo.Pid < 0) {
+	    ReplayVideo.Pid = pid;
+	    PidType[pid] = TS_PID_VIDEO;
+	}
+    } else if ((p[3] & 0xE0) == 0xC0 || p[3] == 0xBD) {
+	if (ReplayAudio.Pid < 0) {
+	    ReplayAudio.Pid = pid;
+	    PidType[pid] = TS_PID_AUDIO;
+	}
+    }
+}
+
+/**
+**	Feed one TS packet, retry while the device is busy.
+**
+**	@param stream	stream counters
+**	@param play	PlayTsVideo() or PlayTsAudio()
+**	@param data	TS packet
+*/
+static void ReplayFeed(TsReplayStream * stream, int (*play)(const uint8_t *, int), const uint8_t * data)
+{
+    int busy;
+
+    for (busy = 0;; ++busy) {
+	uint64_t start;
+	int n;
+
+	start = GetNsTicks();
+	n = play(data, TS_PACKET_SIZE);
+	stream->Ns += GetNsTicks() - start;
+	if (n) {
+	    break;
+	}
+	if (busy >= TS_BUSY_TIMEOUT) {
+	    ++stream->Lost;
+	    break;
+	}
+	++stream->Busy;
+	usleep(1 * 1000);		// let decoder threads work
+    }
+    ++stream->Packets;
+}
+
+/**
+**	Print replay counters of one elementary stream.
+**
+**	@param name	stream name
+**	@param what	what is measured in PlayTs*
+**	@param stream	stream counters
+**	@param info	codec info of the plugin
+*/
+static void ReplayPrintStream(const char *name, const char *what, const TsReplayStream * stream, char *info)
+{
+    printf("%s: pid %d packets %u %s %.3fs (%" PRIu64 "ns/packet) busy %u lost %u\n", name, stream->Pid,
+	stream->Packets, what, stream->Ns / 1e9, stream->Packets ? stream->Ns / stream->Packets : 0, stream->Busy,
+	stream->Lost);
+    if (info) {
+	printf("%s:%s\n", name, info);
+	free(info);
+    }
+}
+
+/**
+**	Replay a transport stream file.
+**
+**	@param fd	file descriptor of the transport stream
+**
+**	@returns number of bytes read.
+*/
+static uint64_t Replay(int fd)
+{
+    static uint8_t buffer[TS_READ_PACKETS * TS_PACKET_SIZE];
+    uint64_t total;
+    size_t fill;
+    ssize_t n;
+
+    total = 0;
+    fill = 0;
+    while ((n = read(fd, buffer + fill, sizeof(buffer) - fill)) > 0) {
+	const uint8_t *p;
+	const uint8_t *e;
+
+	total += n;
+	fill += n;
+	p = buffer;
+	e = buffer + fill;
+	while (p + TS_PACKET_SIZE <= e) {
+	    int pid;
+
+	    if (*p != TS_PACKET_SYNC) {	// resync
+		const uint8_t *s;
+
+		if (!(s = memchr(p + 1, TS_PACKET_SYNC, e - p - 1))) {
+		    p = e;
+		    break;
+		}
+		p = s;
+		continue;
+	    }
+	    pid = (p[1] & 0x1F) << 8 | p[2];
+	    if (PidType[pid] == TS_PID_UNKNOWN) {
+		ReplayClassify(p, pid);
+	    }
+	    switch (PidType[pid]) {
+		case TS_PID_VIDEO:
+		    ReplayFeed(&ReplayVideo, PlayTsVideo, p);
+		    break;
+		case TS_PID_AUDIO:
+		    ReplayFeed(&ReplayAudio, PlayTsAudio, p);
+		    break;
+		default:
+		    break;
+	    }
+	    p += TS_PACKET_SIZE;
+	}
+	fill = e - p;
+	memmove(buffer, p, fill);
+    }
+    if (n < 0) {
+	perror("tsreplay: read");
+    }
+
+    return total;
+}
+
+/**
+**	Benchmark main.
+*/
+int main(int argc, char *argv[])
+{
+    char *args[64];
+    int argn;
+    int fd;
+    int i;
+    uint64_t start;
+    uint64_t fed;
+    uint64_t end;
+    uint64_t total;
+    unsigned packets;
+    double seconds;
+    char *stats;
+
+    if (argc < 2 || argc > (int)(sizeof(args) / sizeof(*args)) - 5) {
+	fprintf(stderr, "Usage: %s file.ts [plugin arguments]\n%s", argv[0], CommandLineHelp());
+	return 1;
+    }
+    if ((fd = open(argv[1], O_RDONLY)) < 0) {
+	perror(argv[1]);
+	return 1;
+    }
+    // later plugin arguments override the defaults
+    argn = 0;
+    args[argn++] = argv[0];
+    args[argn++] = "-v";
+    args[argn++] = "null";
+    args[argn++] = "-w";
+    args[argn++] = "null-free-run";
+    for (i = 2; i < argc; ++i) {
+	args[argn++] = argv[i];
+    }
+    args[argn] = NULL;
+    if (!ProcessArgs(argn, args)) {
+	return 1;
+    }
+    if (TraceMode) {
+	SysLogLevel = 3;
+    }
+
+    Start();
+    SetPlayMode(1);
+
+    start = GetNsTicks();
+    total = Replay(fd);
+    fed = GetNsTicks();
+    // wait until the decoder has consumed all packets
+    for (i = 0; i < 3000 && !Flush(10); ++i) {
+    }
+    usleep(100 * 1000);			// last frames
+    end = GetNsTicks();
+    close(fd);
+
+    packets = total / TS_PACKET_SIZE;
+    seconds = (end - start) / 1e9;
+    if (seconds <= 0.0) {
+	seconds = 1e-9;
+    }
+    printf("%s: %" PRIu64 " bytes, %u packets in %.3fs (feed %.3fs): %.2f MB/s %.0f packets/s\n", argv[1], total,
+	packets, seconds, (fed - start) / 1e9, total / seconds / 1e6, packets / seconds);
+    ReplayPrintStream("video", "PES assembly", &ReplayVideo, GetVideoInfo());
+    ReplayPrintStream("audio", "PES assembly+decode", &ReplayAudio, GetAudioInfo());
+    if ((stats = GetVideoStats())) {
+	printf("video:%s\n", stats);
+	free(stats);
+    }
+
+    Stop();
+    SoftHdDeviceExit();
+
+    return 0;
+}
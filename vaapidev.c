@@ -24,6 +24,7 @@
 #error "libavcodec is too old - please, upgrade!"
 #endif
 #include <libavutil/mem.h>
+#include <libavutil/buffer.h>
 
 #ifndef __USE_GNU
 #define __USE_GNU
@@ -469,6 +470,10 @@ void ResetChannelId(void)
 
 #define VIDEO_BUFFER_SIZE (512 * 1024)	///< video PES buffer default size
 #define VIDEO_PACKET_MAX 192		///< max number of video packets
+#define VIDEO_PACKET_MIN_SIZE (4 * 1024)    ///< smallest packet size class
+#define VIDEO_PACKET_CLASSES 10		///< size classes 4 KiB .. 2 MiB
+#define VIDEO_PACKET_IDLE_TIME 2000	///< ms without packets to release pool
+#define VIDEO_PACKET_CODECS 6		///< codecs tracked for high-water mark
 
 /**
 **	Video output stream device structure.	Parser, decoder, display.
@@ -501,13 +506,28 @@ struct __video_stream__
     int PacketWrite;			///< ring buffer write pointer
     int PacketRead;			///< ring buffer read pointer
     atomic_t PacketsFilled;		///< how many of the ring buffer is used
+
+    pthread_mutex_t PacketPoolMutex;	///< packet pool lock mutex
+    AVBufferPool *PacketPool[VIDEO_PACKET_CLASSES]; ///< size-classed packet buffers
+    uint32_t PacketTick;		///< ticks of last decoded packet, decoder thread
+
+    /// biggest finished packet per codec
+    struct
+    {
+	enum AVCodecID CodecID;		///< codec id of entry
+	int MaxSize;			///< high-water mark in bytes
+    } PacketHighWater[VIDEO_PACKET_CODECS];
+
+    uint32_t DecodedPackets;		///< packets sent to the decoder
+    uint32_t DecodedFrames;		///< frames received from the decoder
+    int PacketFrames;			///< frames received for the last packet
+    int MaxFramesPerPacket;		///< most frames received for one packet
 };
 
 static VideoStream MyVideoStream[1];	///< normal video stream
 
 #ifdef DEBUG
 uint32_t VideoSwitch;			///< debug video switch ticks
-static int VideoMaxPacketSize;		///< biggest used packet buffer
 #endif
 
 const char *X11DisplayName;		///< x11 display name
@@ -518,6 +538,9 @@ static volatile char Usr1Signal;	///< true got usr1 signal
 /**
 **	Initialize video packet ringbuffer.
 **
+**	Packet buffers are taken on demand from size-classed pools, see
+**	VideoPacketGrow().
+**
 **	@param stream	video stream
 */
 static void VideoPacketInit(VideoStream * stream)
@@ -528,14 +551,37 @@ static void VideoPacketInit(VideoStream * stream)
 	AVPacket *avpkt;
 
 	avpkt = &stream->PacketRb[i];
-	// build a clean ffmpeg av packet
-	if (av_new_packet(avpkt, VIDEO_BUFFER_SIZE)) {
-	    Fatal("[vaapidevice] out of memory");
-	}
+	// build a clean empty ffmpeg av packet
+	av_init_packet(avpkt);
+	avpkt->data = NULL;
+	avpkt->size = 0;
+	avpkt->stream_index = 0;
     }
 
     atomic_set(&stream->PacketsFilled, 0);
     stream->PacketRead = stream->PacketWrite = 0;
+    stream->PacketTick = GetMsTicks();
+}
+
+/**
+**	Release unused buffers of the video packet pools.
+**
+**	Buffers still used by packets or the decoder are freed, when their
+**	last reference is dropped.
+**
+**	@param stream	video stream
+*/
+static void VideoPacketPoolTrim(VideoStream * stream)
+{
+    int i;
+
+    pthread_mutex_lock(&stream->PacketPoolMutex);
+    for (i = 0; i < VIDEO_PACKET_CLASSES; ++i) {
+	if (stream->PacketPool[i]) {
+	    av_buffer_pool_uninit(&stream->PacketPool[i]);
+	}
+    }
+    pthread_mutex_unlock(&stream->PacketPoolMutex);
 }
 
 /**
@@ -552,11 +598,127 @@ static void VideoPacketExit(VideoStream * stream)
     for (i = 0; i < VIDEO_PACKET_MAX; ++i) {
 	av_packet_unref(&stream->PacketRb[i]);
     }
+    VideoPacketPoolTrim(stream);
+}
+
+/**
+**	Drop all filled packets of the video packet ringbuffer.
+**
+**	Called from the decoder thread, the packet buffers are given back
+**	to the pools at once.
+**
+**	@param stream	video stream
+*/
+static void VideoPacketClear(VideoStream * stream)
+{
+    int filled;
+
+    filled = atomic_read(&stream->PacketsFilled);
+    while (filled-- > 0) {
+	av_packet_unref(&stream->PacketRb[stream->PacketRead]);
+	stream->PacketRead = (stream->PacketRead + 1) % VIDEO_PACKET_MAX;
+	atomic_dec(&stream->PacketsFilled);
+    }
+}
+
+/**
+**	Grow video packet to the size class which fits size bytes.
+**
+**	Already stored data is kept.
+**
+**	@param stream	video stream
+**	@param avpkt	packet of the ringbuffer
+**	@param size	needed size of packet
+*/
+static void VideoPacketGrow(VideoStream * stream, AVPacket * avpkt, int size)
+{
+    AVBufferRef *buf;
+    int n;
+
+    n = 0;
+    while (n < VIDEO_PACKET_CLASSES && (VIDEO_PACKET_MIN_SIZE << n) <= size) {
+	++n;
+    }
+    if (n < VIDEO_PACKET_CLASSES) {
+	pthread_mutex_lock(&stream->PacketPoolMutex);
+	if (!stream->PacketPool[n]) {
+	    // reserve AV_INPUT_BUFFER_PADDING_SIZE for the decoder
+	    stream->PacketPool[n] =
+		av_buffer_pool_init((VIDEO_PACKET_MIN_SIZE << n) + AV_INPUT_BUFFER_PADDING_SIZE, NULL);
+	}
+	buf = stream->PacketPool[n] ? av_buffer_pool_get(stream->PacketPool[n]) : NULL;
+	pthread_mutex_unlock(&stream->PacketPoolMutex);
+    } else {
+	// bigger than biggest size class, don't keep it in a pool
+	Debug3("video: packet buffer too big for pool %d", size);
+	buf =
+	    av_buffer_alloc(((size + VIDEO_BUFFER_SIZE / 2) / (VIDEO_BUFFER_SIZE / 2)) * (VIDEO_BUFFER_SIZE / 2) +
+	    AV_INPUT_BUFFER_PADDING_SIZE);
+    }
+    if (!buf) {
+	Fatal("video: out of memory");
+    }
+
+    if (avpkt->stream_index) {
+	memcpy(buf->data, avpkt->data, avpkt->stream_index);
+    }
+    av_buffer_unref(&avpkt->buf);
+    avpkt->buf = buf;
+    avpkt->data = buf->data;
+    avpkt->size = buf->size - AV_INPUT_BUFFER_PADDING_SIZE;
+}
+
+/**
+**	Update packet size high-water mark of codec.
+**
+**	@param stream	video stream
+**	@param codec_id	codec id of packet
+**	@param size	size of finished packet
+*/
+static void VideoPacketHighWater(VideoStream * stream, enum AVCodecID codec_id, int size)
+{
+    int i;
+
+    for (i = 0; i < VIDEO_PACKET_CODECS; ++i) {
+	if (stream->PacketHighWater[i].CodecID == AV_CODEC_ID_NONE) {
+	    stream->PacketHighWater[i].CodecID = codec_id;
+	}
+	if (stream->PacketHighWater[i].CodecID == codec_id) {
+	    if (size > stream->PacketHighWater[i].MaxSize) {
+		stream->PacketHighWater[i].MaxSize = size;
+		Debug3("video: max used %s packet size: %d", avcodec_get_name(codec_id), size);
+	    }
+	    return;
+	}
+    }
+}
+
+/**
+**	Get packet size high-water mark of codec.
+**
+**	@param stream	video stream
+**	@param codec_id	codec id of packet
+**
+**	@returns biggest finished packet size, 0 if unknown.
+*/
+static int VideoPacketHighWaterSize(const VideoStream * stream, enum AVCodecID codec_id)
+{
+    int i;
+
+    for (i = 0; i < VIDEO_PACKET_CODECS; ++i) {
+	if (stream->PacketHighWater[i].CodecID == codec_id) {
+	    return stream->PacketHighWater[i].MaxSize;
+	}
+    }
+    return 0;
 }
 
 /**
 **	Place video data in packet ringbuffer.
 **
+**	A new packet starts in the size class of the biggest packet seen
+**	for the current codec, so that most packets are never grown.
+**
 **	@param stream	video stream
 **	@param pts	presentation timestamp of pes packet
 **	@param dts	decode timestamp of pes packet
@@ -573,30 +735,65 @@ static void VideoEnqueue(VideoStream * stream, int64_t pts, int64_t dts, const v
 	avpkt->dts = dts;
     }
     if (avpkt->stream_index + size >= avpkt->size) {
+	int need;
 
-	Error("video: packet buffer too small for %d", avpkt->stream_index + size);
+	need = avpkt->stream_index + size;
+	if (!avpkt->stream_index) {
+	    int high_water;
 
-	// new + grow reserves AV_INPUT_BUFFER_PADDING_SIZE
-	av_grow_packet(avpkt, ((size + VIDEO_BUFFER_SIZE / 2)
-		/ (VIDEO_BUFFER_SIZE / 2)) * (VIDEO_BUFFER_SIZE / 2));
-	// FIXME: out of memory!
-#ifdef DEBUG
-	if (avpkt->size <= avpkt->stream_index + size) {
-	    Fatal("%d %d %d\n", avpkt->size, avpkt->stream_index, size);
+	    high_water = VideoPacketHighWaterSize(stream, stream->CodecID);
+	    need = high_water > need ? high_water : need;
 	}
-#endif
+	VideoPacketGrow(stream, avpkt, need);
     }
 
     memcpy(avpkt->data + avpkt->stream_index, data, size);
     avpkt->stream_index += size;
-#ifdef DEBUG
-    if (avpkt->stream_index > VideoMaxPacketSize) {
-	VideoMaxPacketSize = avpkt->stream_index;
-	Debug3("video: max used PES packet size: %d", VideoMaxPacketSize);
+}
+
+#ifdef USE_AV1
+
+/**
+**	Check if a PES start can be detected as AV1.
+**
+**	0x00 0x00 0x01 0x10-0x17 are also MPEG-2 slice start codes, a PES
+**	starts with a slice, if pictures are split over PES packets.  A stream
+**	already detected as MPEG-2, H.264 or HEVC isn't switched to AV1, a
+**	channel switch resets the codec id.
+**
+**	@param stream	video stream
+*/
+static int VideoAv1Detectable(const VideoStream * stream)
+{
+    return stream->CodecID != AV_CODEC_ID_MPEG2VIDEO && stream->CodecID != AV_CODEC_ID_H264
+	&& stream->CodecID != AV_CODEC_ID_HEVC;
+}
+
+/**
+**	Convert finished AV1 packet for the decoder.
+**
+**	@param stream	video stream
+**	@param avpkt	packet of the ringbuffer
+*/
+static void VideoAv1Packet(VideoStream * stream, AVPacket * avpkt)
+{
+    AVBufferRef *src;
+    int size;
+
+    src = av_buffer_ref(avpkt->buf);
+    if (!src) {
+	Fatal("video: out of memory");
     }
-#endif
+    size = avpkt->stream_index;
+    // new buffer, 4 byte OBU size fields replace 3 byte start codes
+    avpkt->stream_index = 0;
+    VideoPacketGrow(stream, avpkt, size + size / 4 + 64);
+    avpkt->stream_index = Av1Unescape(avpkt->data, src->data, size);
+    av_buffer_unref(&src);
 }
 
+#endif
+
 /**
 **	Reset current packet.
 **
@@ -619,7 +816,7 @@ static void VideoResetPacket(VideoStream * stream)
 **	Finish current packet advance to next.
 **
 **	@param stream	video stream
-**	@param codec_id	codec id of packet (MPEG/H264)
+**	@param codec_id	codec id of packet (MPEG/H264/HEVC/AV1/VP9)
 */
 static void VideoNextPacket(VideoStream * stream, int codec_id)
 {
@@ -642,8 +839,18 @@ static void VideoNextPacket(VideoStream * stream, int codec_id)
 	}
 	return;
     }
+#ifdef USE_AV1
+    if (codec_id == AV_CODEC_ID_AV1) {
+	VideoAv1Packet(stream, avpkt);
+    }
+#endif
     // clear area for decoder, always enough space allocated
-    memset(avpkt->data + avpkt->stream_index, 0, AV_INPUT_BUFFER_PADDING_SIZE);
+    if (avpkt->data) {
+	memset(avpkt->data + avpkt->stream_index, 0, AV_INPUT_BUFFER_PADDING_SIZE);
+    }
+    if (codec_id != AV_CODEC_ID_NONE) {
+	VideoPacketHighWater(stream, codec_id, avpkt->stream_index);
+    }
 
     stream->CodecIDRb[stream->PacketWrite] = codec_id;
     //DumpH264(avpkt->data, avpkt->stream_index);
@@ -665,8 +872,6 @@ static void VideoNextPacket(VideoStream * stream, int codec_id)
 **     Split the packet into single picture packets.
 **     Nick/CC, Viva, MediaShop, Deutsches Music Fernsehen
 **
-**     FIXME: this code can be written much faster
-**
 **     @param stream   video stream
 **     @param pts      presentation timestamp of pes packet
 **     @param dts      presentation timestamp of pes packet
@@ -727,9 +932,19 @@ static void VideoMpegEnqueue(VideoStream * stream, int64_t pts, int64_t dts, con
 
     // b3 b4 b8 00 b5 ... 00 b5 ...
     while (n > 3) {
+	const uint8_t *s;
+
 	// scan for picture header 0x00000100
 	// FIXME: not perfect, must split at 0xb3 also
-	if (!p[0] && !p[1] && p[2] == 0x01 && !p[3]) {
+	if (!(s = FindStartCode(p, n - 1))) {
+	    // keep last bytes for packet border start code
+	    p += n - 3;
+	    n = 3;
+	    break;
+	}
+	n -= s - p;
+	p = s;
+	if (!p[3]) {
 	    const uint8_t *p2 = data;
 
 	    if (first) {
@@ -779,6 +994,30 @@ static void VideoMpegEnqueue(VideoStream * stream, int64_t pts, int64_t dts, con
     VideoEnqueue(stream, pts, dts, data, size);
 }
 
+/**
+**	Check for a VP9 frame at the start of a PES payload.
+**
+**	VP9 has no start codes, one frame (or superframe) is carried per
+**	PES packet.  The stream is detected at a key frame, following
+**	frames are accepted, while VP9 is played.
+**
+**	@param stream	video stream
+**	@param data	PES payload
+**	@param size	number of payload bytes
+*/
+static int VideoIsVp9Frame(const VideoStream * stream, const uint8_t * data, int size)
+{
+    if (size < 4 || (data[0] & 0xC0) != 0x80) {	// frame_marker
+	return 0;
+    }
+    if (stream->CodecID == AV_CODEC_ID_VP9) {
+	return 1;
+    }
+    // profile 0-2 key frame: show_existing_frame 0, frame_type 0 and sync code
+    return (data[0] & 0x30) != 0x30 && (data[0] & 0x0C) == 0x00 && data[1] == 0x49 && data[2] == 0x83
+	&& data[3] == 0x42;
+}
+
 /**
 **	Open video stream.
 **
@@ -855,8 +1094,7 @@ int VideoPollInput(VideoStream * stream)
 	return 1;
     }
     if (stream->ClearBuffers) {		// clear buffer request
-	atomic_set(&stream->PacketsFilled, 0);
-	stream->PacketRead = stream->PacketWrite;
+	VideoPacketClear(stream);
 	// FIXME: ->Decoder already checked
 	if (stream->Decoder) {
 	    CodecVideoFlushBuffers(stream->Decoder);
@@ -884,7 +1122,6 @@ int VideoDecodeInput(VideoStream * stream)
 {
     int filled;
     AVPacket *avpkt;
-    int saved_size;
 
     if (!stream->Decoder) {		// closing
 	return -1;
@@ -896,8 +1133,7 @@ int VideoDecodeInput(VideoStream * stream)
 	return 1;
     }
     if (stream->ClearBuffers) {		// clear buffer request
-	atomic_set(&stream->PacketsFilled, 0);
-	stream->PacketRead = stream->PacketWrite;
+	VideoPacketClear(stream);
 	// FIXME: ->Decoder already checked
 	if (stream->Decoder) {
 	    CodecVideoFlushBuffers(stream->Decoder);
@@ -910,9 +1146,29 @@ int VideoDecodeInput(VideoStream * stream)
 	// clear is called during freezed
 	return 1;
     }
+    if (stream->Decoder->FramesPending) {
+	int frames;
+
+	// output was full, frames held by the decoder go first.  They
+	// belong to the last sent packet.
+	frames = CodecVideoReceive(stream->Decoder);
+	stream->DecodedFrames += frames;
+	stream->PacketFrames += frames;
+	if (stream->PacketFrames > stream->MaxFramesPerPacket) {
+	    stream->MaxFramesPerPacket = stream->PacketFrames;
+	}
+	if (stream->Decoder->FramesPending) {
+	    return frames ? 0 : 1;
+	}
+    }
 
     filled = atomic_read(&stream->PacketsFilled);
     if (!filled) {
+	// stream idle, give packet buffers back
+	if (GetMsTicks() - stream->PacketTick > VIDEO_PACKET_IDLE_TIME) {
+	    VideoPacketPoolTrim(stream);
+	    stream->PacketTick = GetMsTicks();
+	}
 	return -1;
     }
     //
@@ -925,6 +1181,8 @@ int VideoDecodeInput(VideoStream * stream)
 	    if (stream->LastCodecID != AV_CODEC_ID_NONE) {
 		stream->LastCodecID = AV_CODEC_ID_NONE;
 		CodecVideoClose(stream->Decoder);
+		// new stream can use other packet sizes
+		VideoPacketPoolTrim(stream);
 		goto skip;
 	    }
 	    // FIXME: look if more close are in the queue
@@ -948,24 +1206,46 @@ int VideoDecodeInput(VideoStream * stream)
 		CodecVideoOpen(stream->Decoder, AV_CODEC_ID_HEVC);
 	    }
 	    break;
+#ifdef USE_AV1
+	case AV_CODEC_ID_AV1:
+	    if (stream->LastCodecID != AV_CODEC_ID_AV1) {
+		stream->LastCodecID = AV_CODEC_ID_AV1;
+		CodecVideoOpen(stream->Decoder, AV_CODEC_ID_AV1);
+	    }
+	    break;
+#endif
+	case AV_CODEC_ID_VP9:
+	    if (stream->LastCodecID != AV_CODEC_ID_VP9) {
+		stream->LastCodecID = AV_CODEC_ID_VP9;
+		CodecVideoOpen(stream->Decoder, AV_CODEC_ID_VP9);
+	    }
+	    break;
 
 	default:
 	    break;
     }
 
-    // avcodec_decode_video2 needs size
-    saved_size = avpkt->size;
+    // avcodec_send_packet needs size
     avpkt->size = avpkt->stream_index;
     avpkt->stream_index = 0;
 
-    // old version
     if (stream->Decoder) {
-	CodecVideoDecode(stream->Decoder, avpkt);
+	int frames;
+
+	frames = CodecVideoDecode(stream->Decoder, avpkt);
+	stream->DecodedPackets++;
+	stream->DecodedFrames += frames;
+	stream->PacketFrames = frames;
+	if (frames > stream->MaxFramesPerPacket) {
+	    stream->MaxFramesPerPacket = frames;
+	}
     }
 
-    avpkt->size = saved_size;
-
   skip:
+    // return buffer to packet pool
+    av_packet_unref(avpkt);
+    stream->PacketTick = GetMsTicks();
+
     // advance packet read
     stream->PacketRead = (stream->PacketRead + 1) % VIDEO_PACKET_MAX;
     atomic_dec(&stream->PacketsFilled);
@@ -1191,14 +1471,19 @@ static void PesReset(PesDemux * pesdx)
 /// Initialize a packetized elementary stream demuxer.
 ///
 /// @param pesdx    packetized elementary stream demuxer
+/// @param size size of payload buffer (0 = no buffer)
+///
+/// @note video payload is parsed in-place and doesn't need a buffer.
 ///
-static void PesInit(PesDemux * pesdx)
+static void PesInit(PesDemux * pesdx, int size)
 {
     memset(pesdx, 0, sizeof(*pesdx));
-    pesdx->Size = PES_MAX_PAYLOAD;
-    pesdx->Buffer = av_malloc(PES_MAX_PAYLOAD + AV_INPUT_BUFFER_PADDING_SIZE);
-    if (!pesdx->Buffer) {
-	Fatal("pesdemux: out of memory");
+    if (size) {
+	pesdx->Size = size;
+	pesdx->Buffer = av_malloc(size + AV_INPUT_BUFFER_PADDING_SIZE);
+	if (!pesdx->Buffer) {
+	    Fatal("pesdemux: out of memory");
+	}
     }
     PesReset(pesdx);
 }
@@ -1247,20 +1532,29 @@ static void PesParse(PesDemux * pesdx, const uint8_t * data, int size, int is_st
 
 	    case PES_START:	       // at start of pes packet payload
 	    case PES_INIT:	       // find start of packet
-		// FIXME: increase if needed the buffer
-
-		// fill buffer
-		n = pesdx->Size - pesdx->Index;
-		if (n > size) {
+		if (av == TS_PES_VIDEO) {
+		    // video payload is assembled directly in the packet
+		    // ringbuffer, no intermediate copy needed
+		    q = p;
 		    n = size;
-		}
-		memcpy(pesdx->Buffer + pesdx->Index, p, n);
-		pesdx->Index += n;
-		p += n;
-		size -= n;
+		    p += n;
+		    size = 0;
+		} else {
+		    // FIXME: increase if needed the buffer
 
-		q = pesdx->Buffer + pesdx->Skip;
-		n = pesdx->Index - pesdx->Skip;
+		    // fill buffer
+		    n = pesdx->Size - pesdx->Index;
+		    if (n > size) {
+			n = size;
+		    }
+		    memcpy(pesdx->Buffer + pesdx->Index, p, n);
+		    pesdx->Index += n;
+		    p += n;
+		    size -= n;
+
+		    q = pesdx->Buffer + pesdx->Skip;
+		    n = pesdx->Index - pesdx->Skip;
+		}
 
 		if (av == TS_PES_AUDIO) {   //audio
 		    while (n >= 5) {
@@ -1339,7 +1633,7 @@ static void PesParse(PesDemux * pesdx, const uint8_t * data, int size, int is_st
 		    l = n;
 		    z = 0;
 
-		    while (!*check) {	// count leading zeros
+		    while (l > 0 && !*check) {	// count leading zeros
 			if (l < 3) {
 			    z = 0;
 			    break;
@@ -1350,9 +1644,10 @@ static void PesParse(PesDemux * pesdx, const uint8_t * data, int size, int is_st
 		    }
 		    // H264 NAL AUD Access Unit Delimiter (0x00) 0x00 0x00 0x01 0x09
 		    // and next start code
-		    if ((z >= 2 && check[0] == 0x01 && check[1] == 0x09 && !check[3] && !check[4]) ||
+		    // short payload at the end of the TS packet: check l before indexing
+		    if ((z >= 2 && l >= 5 && check[0] == 0x01 && check[1] == 0x09 && !check[3] && !check[4]) ||
 			// H264 NAL SEQ PARAMETER SET (0x00) 0x00 0x00 0x01 0x06
-			(z >= 2 && check[0] == 0x01 && check[1] == 0x06 && is_start)) {
+			(z >= 2 && l >= 2 && check[0] == 0x01 && check[1] == 0x06 && is_start)) {
 			// old PES HDTV recording z == 2 -> stronger check!
 			if (MyVideoStream->CodecID == AV_CODEC_ID_H264) {
 #ifdef DUMP_TRICKSPEED
@@ -1375,7 +1670,7 @@ static void PesParse(PesDemux * pesdx, const uint8_t * data, int size, int is_st
 			    if (MyVideoStream->TrickSpeed && pesdx->PTS != (int64_t) AV_NOPTS_VALUE) {
 				// 1-5=SLICE 6=SEI 7=SPS 8=PPS
 				// NAL SPS sequence parameter set
-				if ((check[7] & 0x1F) == 0x07) {
+				if (l >= 8 && (check[7] & 0x1F) == 0x07) {
 				    // H264 NAL End of Sequence
 				    static uint8_t seq_end_h264[] = { 0x00, 0x00, 0x00, 0x01, 0x0A };
 
@@ -1391,13 +1686,12 @@ static void PesParse(PesDemux * pesdx, const uint8_t * data, int size, int is_st
 			}
 			// (ffmpeg supports short start code)
 			VideoEnqueue(MyVideoStream, pesdx->PTS, pesdx->DTS, check - 2, l + 2);
-			pesdx->Skip += n;
 			pesdx->PTS = AV_NOPTS_VALUE;
 			pesdx->DTS = AV_NOPTS_VALUE;
 			break;
 		    }
 		    // HEVC Codec
-		    if (z >= 2 && check[0] == 0x01 && check[1] == 0x46) {
+		    if (z >= 2 && l >= 2 && check[0] == 0x01 && check[1] == 0x46) {
 			// old PES HDTV recording z == 2 -> stronger check!
 			if (MyVideoStream->CodecID == AV_CODEC_ID_HEVC) {
 			    VideoNextPacket(MyVideoStream, AV_CODEC_ID_HEVC);
@@ -1407,17 +1701,45 @@ static void PesParse(PesDemux * pesdx, const uint8_t * data, int size, int is_st
 			}
 			// (ffmpeg supports short start code)
 			VideoEnqueue(MyVideoStream, pesdx->PTS, pesdx->DTS, check - 2, l + 2);
-			pesdx->Skip += n;
+			pesdx->PTS = AV_NOPTS_VALUE;
+			pesdx->DTS = AV_NOPTS_VALUE;
+			break;
+		    }
+#ifdef USE_AV1
+		    // AV1 temporal delimiter OBU 0x00 0x00 0x01 0x1x starts the PES
+		    if (is_start && z >= 2 && l >= 2 && check[0] == 0x01 && (check[1] & 0xF8) == 0x10
+			&& VideoAv1Detectable(MyVideoStream)) {
+			if (MyVideoStream->CodecID == AV_CODEC_ID_AV1) {
+			    VideoNextPacket(MyVideoStream, AV_CODEC_ID_AV1);
+			} else {
+			    Debug3("video: av1 detected");
+			    MyVideoStream->CodecID = AV_CODEC_ID_AV1;
+			}
+			VideoEnqueue(MyVideoStream, pesdx->PTS, pesdx->DTS, check - 2, l + 2);
+			pesdx->PTS = AV_NOPTS_VALUE;
+			pesdx->DTS = AV_NOPTS_VALUE;
+			break;
+		    }
+#endif
+		    // VP9 frame per PES, starts with a key frame
+		    if (is_start && !z && VideoIsVp9Frame(MyVideoStream, check, l)) {
+			if (MyVideoStream->CodecID == AV_CODEC_ID_VP9) {
+			    VideoNextPacket(MyVideoStream, AV_CODEC_ID_VP9);
+			} else {
+			    Debug3("video: vp9 detected");
+			    MyVideoStream->CodecID = AV_CODEC_ID_VP9;
+			}
+			VideoEnqueue(MyVideoStream, pesdx->PTS, pesdx->DTS, check, l);
 			pesdx->PTS = AV_NOPTS_VALUE;
 			pesdx->DTS = AV_NOPTS_VALUE;
 			break;
 		    }
 		    // PES start code 0x00 0x00 0x01 0x00|0xb3
-		    if (z > 1 && check[0] == 0x01 && (!check[1] || check[1] == 0xb3)) {
+		    if (z > 1 && l >= 2 && check[0] == 0x01 && (!check[1] || check[1] == 0xb3)) {
 			if (MyVideoStream->CodecID == AV_CODEC_ID_MPEG2VIDEO) {
 			    VideoNextPacket(MyVideoStream, AV_CODEC_ID_MPEG2VIDEO);
 			} else {
-			    Debug3("video: mpeg2 detected ID %02x", check[3]);
+			    Debug3("video: mpeg2 detected ID %02x", check[1]);
 			    MyVideoStream->CodecID = AV_CODEC_ID_MPEG2VIDEO;
 			}
 #ifdef noDEBUG				// pip pes packet has no lenght
@@ -1426,7 +1748,6 @@ static void PesParse(PesDemux * pesdx, const uint8_t * data, int size, int is_st
 			}
 #endif
 			VideoMpegEnqueue(MyVideoStream, pesdx->PTS, pesdx->DTS, check - 2, l + 2);
-			pesdx->Skip += n;
 			pesdx->PTS = AV_NOPTS_VALUE;
 			pesdx->DTS = AV_NOPTS_VALUE;
 			break;
@@ -1434,7 +1755,6 @@ static void PesParse(PesDemux * pesdx, const uint8_t * data, int size, int is_st
 
 		    if (MyVideoStream->CodecID == AV_CODEC_ID_NONE) {
 			Debug3("video: not detected");
-			pesdx->Skip += n;
 			pesdx->PTS = AV_NOPTS_VALUE;
 			pesdx->DTS = AV_NOPTS_VALUE;
 			break;
@@ -1444,7 +1764,6 @@ static void PesParse(PesDemux * pesdx, const uint8_t * data, int size, int is_st
 		    } else {
 			VideoEnqueue(MyVideoStream, pesdx->PTS, pesdx->DTS, q, n);
 		    }
-		    pesdx->Skip += n;
 		}
 		break;
 
@@ -1564,6 +1883,20 @@ static void PesParse(PesDemux * pesdx, const uint8_t * data, int size, int is_st
 #define TS_PACKET_SIZE	188
     /// Transport stream packet sync byte
 #define TS_PACKET_SYNC	0x47
+    /// Transport stream number of packet ids
+#define TS_PID_MAX	0x2000
+    /// Transport stream null packet id
+#define TS_PID_NULL	0x1FFF
+
+///
+/// Result of transport stream continuity check.
+///
+enum
+{
+    TS_CC_OK = 0,			///< packet continues stream
+    TS_CC_LOST,				///< packet(s) lost
+    TS_CC_DUPLICATE,			///< duplicate packet, skip it
+};
 
 ///
 /// transport stream demuxer typedef.
@@ -1576,46 +1909,190 @@ typedef struct _ts_demux_ TsDemux;
 struct _ts_demux_
 {
     int Packets;			///< packets between PCR
+    int Resyncs;			///< number of lost syncs
+    int CcErrors;			///< number of continuity errors
+
+    /// last continuity counter of each pid (0x10 flags valid, 0x20 duplicate seen)
+    uint8_t ContinuityCounter[TS_PID_MAX];
+
+    char Resync;			///< sync lost, next sync byte not verified
+    int TailSize;			///< bytes kept for the next call
+    uint8_t Tail[TS_PACKET_SIZE];	///< partial packet or unverified sync
 };
 
 static PesDemux PesDemuxer[2];		///< PES demuxer
+static TsDemux TsDemuxers[2];		///< TS demuxer of PES demuxer
 
 ///
-/// Transport stream demuxer.
+/// Drop broken packetized elementary stream unit.
+///
+/// Skips the rest of the PES packet, video data already placed in the
+/// current video packet is dropped too.
+///
+/// @param pesdx    packetized elementary stream demuxer
+/// @param av	audio/video packet
+///
+static void PesDrop(PesDemux * pesdx, int av)
+{
+    pesdx->State = PES_SKIP;
+    pesdx->Index = 0;
+    pesdx->Skip = 0;
+    pesdx->PTS = AV_NOPTS_VALUE;
+    pesdx->DTS = AV_NOPTS_VALUE;
+    if (av == TS_PES_VIDEO) {
+	VideoResetPacket(MyVideoStream);
+    }
+}
+
+///
+/// Reset transport stream demuxer for a new stream.
 ///
 /// @param tsdx transport stream demuxer
+///
+static void TsReset(TsDemux * tsdx)
+{
+    memset(tsdx->ContinuityCounter, 0, sizeof(tsdx->ContinuityCounter));
+    tsdx->Resync = 0;
+    tsdx->TailSize = 0;
+}
+
+///
+/// Find transport stream sync.
+///
+/// A sync byte is only accepted, if the following packet also starts
+/// with a sync byte.  A sync byte less than a packet before the end of
+/// the buffer can't be verified yet, it is returned for the caller to
+/// keep.
+///
 /// @param data buffer of transport stream packets
 /// @param size size of buffer
-/// @param av	audio/video packet
 ///
-/// @returns number of bytes consumed from buffer.
+/// @returns offset of next sync byte, size if not found.
 ///
-static int TsDemuxer(TsDemux * tsdx, const uint8_t * data, int size, int av)
+static int TsFindSync(const uint8_t * data, int size)
+{
+    int i;
+
+    for (i = 0; i < size; ++i) {
+	if (data[i] == TS_PACKET_SYNC && (i + TS_PACKET_SIZE >= size || data[i + TS_PACKET_SIZE] == TS_PACKET_SYNC)) {
+	    return i;
+	}
+    }
+    return size;
+}
+
+///
+/// Check transport stream continuity counter.
+///
+/// @param tsdx transport stream demuxer
+/// @param p	transport stream packet
+/// @param pid	packet id
+///
+/// @retval TS_CC_OK	    packet continues stream
+/// @retval TS_CC_LOST	    packet(s) lost
+/// @retval TS_CC_DUPLICATE duplicate packet
+///
+static int TsCheckContinuity(TsDemux * tsdx, const uint8_t * p, int pid)
+{
+    int last;
+    int cc;
+
+    if (pid == TS_PID_NULL) {		// stuffing
+	return TS_CC_OK;
+    }
+    cc = p[3] & 0x0F;
+    last = tsdx->ContinuityCounter[pid];
+
+    // unknown or discontinuity indicator set
+    if (!last || ((p[3] & 0x20) && p[4] && (p[5] & 0x80))) {
+	tsdx->ContinuityCounter[pid] = 0x10 | cc;
+	return TS_CC_OK;
+    }
+    if (cc == (last & 0x0F)) {
+	if (!(p[3] & 0x10)) {		// counter only incremented with payload
+	    return TS_CC_OK;
+	}
+	// duplicate packets are allowed once
+	if (!(last & 0x20)) {
+	    tsdx->ContinuityCounter[pid] = last | 0x20;
+	    return TS_CC_DUPLICATE;
+	}
+	return TS_CC_LOST;
+    }
+    tsdx->ContinuityCounter[pid] = 0x10 | cc;
+    if (!(p[3] & 0x10) || cc != ((last + 1) & 0x0F)) {
+	return TS_CC_LOST;
+    }
+    return TS_CC_OK;
+}
+
+///
+/// Demux transport stream packets.
+///
+/// Bytes which don't make a complete packet, or a sync byte which can't
+/// be verified yet, are kept in the tail of the demuxer.
+///
+/// @param tsdx transport stream demuxer
+/// @param data buffer of transport stream packets
+/// @param size size of buffer
+/// @param av	audio/video packet
+///
+static void TsDemuxPackets(TsDemux * tsdx, const uint8_t * data, int size, int av)
 {
     const uint8_t *p;
 
     p = data;
     while (size >= TS_PACKET_SIZE) {
-#ifdef DEBUG
 	int pid;
-#endif
 	int payload;
 
-	if (p[0] != TS_PACKET_SYNC) {
-	    Error("tsdemux: transport stream out of sync");
-	    // FIXME: kill all buffers
-	    return size;
+	if (tsdx->Resync || p[0] != TS_PACKET_SYNC) {
+	    int n;
+
+	    if (!tsdx->Resync) {
+		++tsdx->Resyncs;
+		tsdx->Resync = 1;
+		Error("tsdemux: transport stream out of sync");
+		PesDrop(&PesDemuxer[av], av);
+	    }
+	    n = TsFindSync(p, size);
+	    if (n) {
+		Debug3("tsdemux: skipping %d bytes", n);
+	    }
+	    p += n;
+	    size -= n;
+	    if (size <= TS_PACKET_SIZE) {   // sync verified with the next data
+		break;
+	    }
+	    tsdx->Resync = 0;
 	}
 	++tsdx->Packets;
 	if (p[1] & 0x80) {		// error indicator
 	    Debug3("tsdemux: transport error");
-	    // FIXME: kill all buffers
+	    PesDrop(&PesDemuxer[av], av);
 	    goto next_packet;
 	}
-#ifdef DEBUG
 	pid = (p[1] & 0x1F) << 8 | p[2];
+#ifdef DEBUG
 	Debug3("tsdemux: PID: %#04x%s%s", pid, (p[1] & 0x40) ? " start" : "", (p[3] & 0x10) ? " payload" : "");
 #endif
+
+	switch (TsCheckContinuity(tsdx, p, pid)) {
+	    case TS_CC_DUPLICATE:
+		Debug3("tsdemux: duplicate packet PID: %#04x", pid);
+		goto next_packet;
+	    case TS_CC_LOST:
+		++tsdx->CcErrors;
+		Debug3("tsdemux: continuity error PID: %#04x", pid);
+		// drop broken pes packet, new one can start here
+		PesDrop(&PesDemuxer[av], av);
+		if (!(p[1] & 0x40)) {
+		    goto next_packet;
+		}
+		break;
+	    default:
+		break;
+	}
 	// skip adaptation field
 	switch (p[3] & 0x30) {		// adaption field
 	    case 0x00:		       // reserved
@@ -1642,7 +2119,50 @@ static int TsDemuxer(TsDemux * tsdx, const uint8_t * data, int size, int av)
 	size -= TS_PACKET_SIZE;
     }
 
-    return p - data;
+    if (size > 0) {
+	memcpy(tsdx->Tail, p, size);
+	tsdx->TailSize = size;
+    }
+}
+
+///
+/// Transport stream demuxer.
+///
+/// @param tsdx transport stream demuxer
+/// @param data buffer of transport stream packets
+/// @param size size of buffer
+/// @param av	audio/video packet
+///
+/// @returns number of bytes consumed from buffer.
+///
+static int TsDemuxer(TsDemux * tsdx, const uint8_t * data, int size, int av)
+{
+    int consumed;
+
+    // the kept tail continues with the new data, join them until the
+    // tail is used up
+    consumed = 0;
+    while (tsdx->TailSize && consumed < size) {
+	uint8_t buf[3 * TS_PACKET_SIZE];
+	int tail;
+	int n;
+
+	tail = tsdx->TailSize;
+	n = size - consumed;
+	if (n > (int)sizeof(buf) - tail) {
+	    n = sizeof(buf) - tail;
+	}
+	memcpy(buf, tsdx->Tail, tail);
+	memcpy(buf + tail, data + consumed, n);
+	tsdx->TailSize = 0;
+	TsDemuxPackets(tsdx, buf, tail + n, av);
+	consumed += n;
+    }
+    if (consumed < size) {
+	TsDemuxPackets(tsdx, data + consumed, size - consumed, av);
+    }
+
+    return size;
 }
 
 //////////////////////////////////////////////////////////////////////////////
@@ -1868,8 +2388,6 @@ int PlayAudio(const uint8_t * data, int size, uint8_t id)
 
 int PlayTsAudio(const uint8_t * data, int size)
 {
-    static TsDemux tsdx[1];
-
     if (SkipAudio || !MyAudioDecoder) { // skip audio
 	return size;
     }
@@ -1886,13 +2404,14 @@ int PlayTsAudio(const uint8_t * data, int size)
 	AudioChannelID = -1;
 	NewAudioStream = 0;
 	PesReset(&PesDemuxer[TS_PES_AUDIO]);
+	TsReset(&TsDemuxers[TS_PES_AUDIO]);
     }
     // hard limit buffer full: don't overrun audio buffers on replay
     if (AudioFreeBytes() < AUDIO_MIN_BUFFER_FREE) {
 	return 0;
     }
 
-    return TsDemuxer(tsdx, data, size, TS_PES_AUDIO);
+    return TsDemuxer(&TsDemuxers[TS_PES_AUDIO], data, size, TS_PES_AUDIO);
 }
 
 /**
@@ -2000,7 +2519,8 @@ int PlayVideo3(VideoStream * stream, const uint8_t * data, int size)
 
     // H264 NAL AUD Access Unit Delimiter (0x00) 0x00 0x00 0x01 0x09
     // and next start code
-    if ((data[6] & 0xC0) == 0x80 && z >= 2 && check[0] == 0x01 && check[1] == 0x09 && !check[3] && !check[4]) {
+    if ((data[6] & 0xC0) == 0x80 && z >= 2 && l >= 5 && check[0] == 0x01 && check[1] == 0x09 && !check[3]
+	&& !check[4]) {
 	// old PES HDTV recording z == 2 -> stronger check!
 	if (stream->CodecID == AV_CODEC_ID_H264) {
 #ifdef DUMP_TRICKSPEED
@@ -2023,7 +2543,7 @@ int PlayVideo3(VideoStream * stream, const uint8_t * data, int size)
 	    if (stream->TrickSpeed && pts != (int64_t) AV_NOPTS_VALUE) {
 		// 1-5=SLICE 6=SEI 7=SPS 8=PPS
 		// NAL SPS sequence parameter set
-		if ((check[7] & 0x1F) == 0x07) {
+		if (l >= 8 && (check[7] & 0x1F) == 0x07) {
 		    // H264 NAL End of Sequence
 		    static uint8_t seq_end_h264[] = { 0x00, 0x00, 0x00, 0x01, 0x0A };
 
@@ -2041,7 +2561,7 @@ int PlayVideo3(VideoStream * stream, const uint8_t * data, int size)
 	return size;
     }
     // HEVC Codec
-    if ((data[6] & 0xC0) == 0x80 && z >= 2 && check[0] == 0x01 && check[1] == 0x46) {
+    if ((data[6] & 0xC0) == 0x80 && z >= 2 && l >= 2 && check[0] == 0x01 && check[1] == 0x46) {
 	// old PES HDTV recording z == 2 -> stronger check!
 	if (stream->CodecID == AV_CODEC_ID_HEVC) {
 	    VideoNextPacket(stream, AV_CODEC_ID_HEVC);
@@ -2053,12 +2573,39 @@ int PlayVideo3(VideoStream * stream, const uint8_t * data, int size)
 	VideoEnqueue(stream, pts, dts, check - 2, l + 2);
 	return size;
     }
+#ifdef USE_AV1
+    // AV1 temporal delimiter OBU 0x00 0x00 0x01 0x1x
+    if ((data[6] & 0xC0) == 0x80 && z >= 2 && l >= 2 && check[0] == 0x01 && (check[1] & 0xF8) == 0x10
+	&& VideoAv1Detectable(stream)) {
+	if (stream->CodecID == AV_CODEC_ID_AV1) {
+	    VideoNextPacket(stream, AV_CODEC_ID_AV1);
+	} else {
+	    Debug3("video: AV1 detected");
+	    stream->CodecID = AV_CODEC_ID_AV1;
+	}
+	// SKIP PES header, begin of start code
+	VideoEnqueue(stream, pts, dts, check - 2, l + 2);
+	return size;
+    }
+#endif
+    // VP9 frame
+    if ((data[6] & 0xC0) == 0x80 && !z && VideoIsVp9Frame(stream, check, l)) {
+	if (stream->CodecID == AV_CODEC_ID_VP9) {
+	    VideoNextPacket(stream, AV_CODEC_ID_VP9);
+	} else {
+	    Debug3("video: VP9 detected");
+	    stream->CodecID = AV_CODEC_ID_VP9;
+	}
+	// SKIP PES header
+	VideoEnqueue(stream, pts, dts, check, l);
+	return size;
+    }
     // PES start code 0x00 0x00 0x01 0x00|0xb3
-    if (z > 1 && check[0] == 0x01 && (!check[1] || check[1] == 0xb3)) {
+    if (z > 1 && l >= 2 && check[0] == 0x01 && (!check[1] || check[1] == 0xb3)) {
 	if (stream->CodecID == AV_CODEC_ID_MPEG2VIDEO) {
 	    VideoNextPacket(stream, AV_CODEC_ID_MPEG2VIDEO);
 	} else {
-	    Debug3("video: MPEG2 detected ID %02x", check[3]);
+	    Debug3("video: MPEG2 detected ID %02x", check[1]);
 	    stream->CodecID = AV_CODEC_ID_MPEG2VIDEO;
 	}
 #ifdef noDEBUG				// pip pes packet has no lenght
@@ -2119,8 +2666,6 @@ int PlayVideo(const uint8_t * data, int size)
 */
 int PlayTsVideo(const uint8_t * data, int size)
 {
-    static TsDemux tsdx[1];
-
     if (!MyVideoStream->Decoder) {	// no x11 video started
 	return size;
     }
@@ -2143,12 +2688,13 @@ int PlayTsVideo(const uint8_t * data, int size)
 	MyVideoStream->ClosingStream = 1;
 	MyVideoStream->NewStream = 0;
 	PesReset(&PesDemuxer[TS_PES_VIDEO]);
+	TsReset(&TsDemuxers[TS_PES_VIDEO]);
     }
     // hard limit buffer full: needed for replay
     if (atomic_read(&MyVideoStream->PacketsFilled) >= VIDEO_PACKET_MAX - 10) {
 	return 0;
     }
-    return TsDemuxer(tsdx, data, size, TS_PES_VIDEO);
+    return TsDemuxer(&TsDemuxers[TS_PES_VIDEO], data, size, TS_PES_VIDEO);
 }
 
     /// call VDR support function
@@ -2316,6 +2862,7 @@ void Clear(void)
 
     VideoResetPacket(MyVideoStream);	// terminate work
     MyVideoStream->ClearBuffers = 1;
+    VideoDisplayWakeup();
     if (!SkipAudio) {
 	AudioFlushBuffers();
 	//NewAudioStream = 1;
@@ -2440,7 +2987,7 @@ void StillPicture(const uint8_t * data, int size)
 	    VideoEnqueue(MyVideoStream, AV_NOPTS_VALUE, AV_NOPTS_VALUE, seq_end_h264, sizeof(seq_end_h264));
 	} else if (MyVideoStream->CodecID == AV_CODEC_ID_HEVC) {
 	    VideoEnqueue(MyVideoStream, AV_NOPTS_VALUE, AV_NOPTS_VALUE, seq_end_h265, sizeof(seq_end_h265));
-	} else {
+	} else if (MyVideoStream->CodecID == AV_CODEC_ID_MPEG2VIDEO) {
 	    VideoEnqueue(MyVideoStream, AV_NOPTS_VALUE, AV_NOPTS_VALUE, seq_end_mpeg, sizeof(seq_end_mpeg));
 	}
 	VideoNextPacket(MyVideoStream, MyVideoStream->CodecID); // terminate last packet
@@ -2582,7 +3129,7 @@ const char *CommandLineHelp(void)
 	"  -c channel\taudio mixer channel name (fe. PCM)\n" "	-d display\tdisplay of x11 server (fe. :0.0)\n"
 	"  -f\t\tstart with fullscreen window (only with window manager)\n"
 	"  -g geometry\tx11 window geometry wxh+x+y\n" "  -t tracemode\tset the trace mode for debugging\n"
-	"  -v device\tvideo driver device (vaapi, noop)\n" "  -s\t\tstart in suspended mode\n"
+	"  -v device\tvideo driver device (va-api, noop, null)\n" "  -s\t\tstart in suspended mode\n"
 	"  -x\t\tstart x11 server, with -xx try to connect, if this fails\n"
 	"  -X args\tX11 server arguments (f.e. -nocursor)\n" "	-w workaround\tenable/disable workarounds\n"
 	"\tno-hw-decoder\t\tdisable hw decoder, use software decoder only\n"
@@ -2592,7 +3139,9 @@ const char *CommandLineHelp(void)
 	"\talsa-driver-broken\tdisable broken alsa driver message\n"
 	"\talsa-no-close-open\tdisable close open to fix alsa no sound bug\n"
 	"\talsa-close-open-delay\tenable close open delay to fix no sound bug\n"
-	"\tignore-repeat-pict\tdisable repeat pict message\n" "	 -D\t\tstart in detached mode\n";
+	"\talsa-mmap\t\tenable alsa mmap zero-copy playback\n"
+	"\tignore-repeat-pict\tdisable repeat pict message\n"
+	"\tnull-free-run\t\tnull video output without frame pacing\n" "	 -D\t\tstart in detached mode\n";
 }
 
 /**
@@ -2662,8 +3211,12 @@ int ProcessArgs(int argc, char *const argv[])
 		    AudioAlsaNoCloseOpen = 1;
 		} else if (!strcasecmp("alsa-close-open-delay", optarg)) {
 		    AudioAlsaCloseOpenDelay = 1;
+		} else if (!strcasecmp("alsa-mmap", optarg)) {
+		    AudioAlsaMmap = 1;
 		} else if (!strcasecmp("ignore-repeat-pict", optarg)) {
 		    VideoIgnoreRepeatPict = 1;
+		} else if (!strcasecmp("null-free-run", optarg)) {
+		    VideoNullFreeRun = 1;
 		} else {
 		    fprintf(stderr, "Workaround '%s' unsupported\n", optarg);
 		    return 0;
@@ -2874,6 +3427,7 @@ int Start(void)
     CodecInit();
 
     pthread_mutex_init(&MyVideoStream->DecoderLockMutex, NULL);
+    pthread_mutex_init(&MyVideoStream->PacketPoolMutex, NULL);
     pthread_mutex_init(&SuspendLockMutex, NULL);
 
     if (!ConfigStartSuspended) {
@@ -2892,8 +3446,8 @@ int Start(void)
 	MyVideoStream->SkipStream = 1;
 	SkipAudio = 1;
     }
-    PesInit(&PesDemuxer[TS_PES_VIDEO]);
-    PesInit(&PesDemuxer[TS_PES_AUDIO]);
+    PesInit(&PesDemuxer[TS_PES_VIDEO], 0);
+    PesInit(&PesDemuxer[TS_PES_AUDIO], PES_MAX_PAYLOAD);
     Info("Device ready%s", ConfigStartSuspended ? ConfigStartSuspended == -1 ? " detached" : " suspended" : "");
 
     return ConfigStartSuspended;
@@ -2907,7 +3461,15 @@ int Start(void)
 void Stop(void)
 {
 #ifdef DEBUG
-    Debug1("video: max used PES packet size: %d", VideoMaxPacketSize);
+    int i;
+
+    for (i = 0; i < VIDEO_PACKET_CODECS; ++i) {
+	if (MyVideoStream->PacketHighWater[i].CodecID != AV_CODEC_ID_NONE) {
+	    Debug1("video: max used %s packet size: %d",
+		avcodec_get_name(MyVideoStream->PacketHighWater[i].CodecID),
+		MyVideoStream->PacketHighWater[i].MaxSize);
+	}
+    }
 #endif
 }
 
@@ -3036,7 +3598,44 @@ void Resume(void)
 */
 char *GetVideoStats(void)
 {
-    return MyVideoStream->HwDecoder ? VideoGetStats(MyVideoStream->HwDecoder) : NULL;
+    char buffer[1024];
+    char *stats;
+    size_t n;
+    int i;
+
+    if (!MyVideoStream->HwDecoder) {
+	return NULL;
+    }
+    stats = VideoGetStats(MyVideoStream->HwDecoder);
+    n = snprintf(buffer, sizeof(buffer), "%s Packets:", stats ? stats : "");
+    free(stats);
+
+    for (i = 0; i < VIDEO_PACKET_CODECS && n < sizeof(buffer); ++i) {
+	if (MyVideoStream->PacketHighWater[i].CodecID != AV_CODEC_ID_NONE) {
+	    n += snprintf(buffer + n, sizeof(buffer) - n, " %s(%dKiB)",
+		avcodec_get_name(MyVideoStream->PacketHighWater[i].CodecID),
+		(MyVideoStream->PacketHighWater[i].MaxSize + 1023) / 1024);
+	}
+    }
+    if (n < sizeof(buffer)) {
+	n += snprintf(buffer + n, sizeof(buffer) - n, " TS: resync(%d/%d) cc-error(%d/%d)",
+	    TsDemuxers[TS_PES_VIDEO].Resyncs, TsDemuxers[TS_PES_AUDIO].Resyncs, TsDemuxers[TS_PES_VIDEO].CcErrors,
+	    TsDemuxers[TS_PES_AUDIO].CcErrors);
+    }
+    if (n < sizeof(buffer)) {
+	n += snprintf(buffer + n, sizeof(buffer) - n, " Decode: frames/packet(%.2f max %d)",
+	    MyVideoStream->DecodedPackets ? (double)MyVideoStream->DecodedFrames / MyVideoStream->DecodedPackets : 0.0,
+	    MyVideoStream->MaxFramesPerPacket);
+    }
+    if (n < sizeof(buffer)) {
+	unsigned direct;
+	unsigned ring;
+
+	AudioGetEnqueueStats(&direct, &ring);
+	snprintf(buffer + n, sizeof(buffer) - n, " Audio: direct(%u/%u)", direct, direct + ring);
+    }
+
+    return strdup(buffer);
 }
 
 /*
@@ -70,6 +70,7 @@ static char ConfigOtherDisplayFormat = 1;   ///< config other display format
 static uint32_t ConfigVideoBackground;	///< config video background color
 static char ConfigVideo60HzMode;	///< config use 60Hz display mode
 static char ConfigVideoSoftStartSync;	///< config use softstart sync
+static int ConfigVideoDecoderThreads;	///< config software decoder threads
 
 static int ConfigVideoColorBalance = 1; ///< config video color balance
 static int ConfigVideoBrightness;	///< config video brightness
@@ -106,6 +107,7 @@ static char ConfigAudioDrift;		///< config audio drift
 static char ConfigAudioPassthrough;	///< config audio pass-through mask
 static char AudioPassthroughState;	///< flag audio pass-through on/off
 static char ConfigAudioDownmix;		///< config ffmpeg audio downmix
+static int ConfigAudioOutputFormat;	///< config fixed audio output format
 static char ConfigAudioSoftvol;		///< config use software volume
 static char ConfigAudioNormalize;	///< config use normalize volume
 static int ConfigAudioMaxNormalize;	///< config max normalize factor
@@ -120,6 +122,13 @@ static char *ConfigPassthroughDevice;	///< config audio pass-through device
 
 static volatile int DoMakePrimary;	///< switch primary device to this
 
+    /// fixed audio output formats (sample rate, channels), 0 = stream format
+static const int AudioOutputFormats[][2] = {
+    {0, 0}, {48000, 2}, {48000, 6}, {44100, 2},
+};
+
+#define AUDIO_OUTPUT_FORMATS (int)(sizeof(AudioOutputFormats) / sizeof(*AudioOutputFormats))
+
 #define SUSPEND_EXTERNAL	-1	    ///< play external suspend mode
 #define NOT_SUSPENDED		0	    ///< not suspend mode
 #define SUSPEND_NORMAL		1	    ///< normal suspend mode
@@ -770,6 +779,7 @@ class cMenuSetupSoft:public cMenuSetupPage
     uint32_t BackgroundAlpha;
     int _60HzMode;
     int SoftStartSync;
+    int DecoderThreads;
 
     int ColorBalance;
     int Brightness;
@@ -798,6 +808,7 @@ class cMenuSetupSoft:public cMenuSetupPage
     int AudioPassthroughAC3;
     int AudioPassthroughEAC3;
     int AudioDownmix;
+    int AudioOutputFormat;
     int AudioSoftvol;
     int AudioNormalize;
     int AudioMaxNormalize;
@@ -869,6 +880,9 @@ void cMenuSetupSoft::Create(void)
     static const char *const audiodrift[] = {
 	"None", "PCM", "AC-3", "PCM + AC-3"
     };
+    static const char *const audiooutput[] = {
+	"Stream", "48kHz stereo", "48kHz 5.1", "44.1kHz stereo"
+    };
     int current;
     const char **scaling;
     const char **scaling_short;
@@ -927,6 +941,7 @@ void cMenuSetupSoft::Create(void)
 	Add(new cMenuEditIntItem(tr("Video background color (Alpha)"), (int *)&BackgroundAlpha, 0, 0xFF));
 	Add(new cMenuEditBoolItem(tr("60hz display mode"), &_60HzMode, trVDR("no"), trVDR("yes")));
 	Add(new cMenuEditBoolItem(tr("Soft start a/v sync"), &SoftStartSync, trVDR("no"), trVDR("yes")));
+	Add(new cMenuEditIntItem(tr("Software decoder threads"), &DecoderThreads, 0, 16, tr("auto")));
 
 	Add(new cMenuEditBoolItem(tr("Color balance"), &ColorBalance, trVDR("off"), trVDR("on")));
 	if (ColorBalance) {
@@ -993,6 +1008,8 @@ void cMenuSetupSoft::Create(void)
 	Add(new cMenuEditBoolItem(tr("\040\040E-AC-3 pass-through"), &AudioPassthroughEAC3, trVDR("no"),
 		trVDR("yes")));
 	Add(new cMenuEditBoolItem(tr("Enable (E-)AC-3 (decoder) downmix"), &AudioDownmix, trVDR("no"), trVDR("yes")));
+	Add(new cMenuEditStraItem(tr("Fixed PCM output format"), &AudioOutputFormat, AUDIO_OUTPUT_FORMATS,
+		audiooutput));
 	Add(new cMenuEditBoolItem(tr("Volume control"), &AudioSoftvol, tr("Hardware"), tr("Software")));
 	Add(new cMenuEditBoolItem(tr("Enable normalize volume"), &AudioNormalize, trVDR("no"), trVDR("yes")));
 	if (AudioNormalize)
@@ -1131,6 +1148,7 @@ cMenuSetupSoft::cMenuSetupSoft(void)
     BackgroundAlpha = ConfigVideoBackground & 0xFF;
     _60HzMode = ConfigVideo60HzMode;
     SoftStartSync = ConfigVideoSoftStartSync;
+    DecoderThreads = ConfigVideoDecoderThreads;
 
     ColorBalance = ConfigVideoColorBalance;
     Brightness = ConfigVideoBrightness;
@@ -1167,6 +1185,7 @@ cMenuSetupSoft::cMenuSetupSoft(void)
     AudioPassthroughAC3 = ConfigAudioPassthrough & CodecAC3;
     AudioPassthroughEAC3 = ConfigAudioPassthrough & CodecEAC3;
     AudioDownmix = ConfigAudioDownmix;
+    AudioOutputFormat = ConfigAudioOutputFormat;
     AudioSoftvol = ConfigAudioSoftvol;
     AudioNormalize = ConfigAudioNormalize;
     AudioMaxNormalize = ConfigAudioMaxNormalize;
@@ -1220,6 +1239,8 @@ void cMenuSetupSoft::Store(void)
     VideoSet60HzMode(ConfigVideo60HzMode);
     SetupStore("SoftStartSync", ConfigVideoSoftStartSync = SoftStartSync);
     VideoSetSoftStartSync(ConfigVideoSoftStartSync);
+    SetupStore("DecoderThreads", ConfigVideoDecoderThreads = DecoderThreads);
+    CodecSetVideoThreads(ConfigVideoDecoderThreads);
 
     SetupStore("ColorBalance", ConfigVideoColorBalance = ColorBalance);
     VideoSetColorBalance(ConfigVideoColorBalance);
@@ -1270,8 +1291,8 @@ void cMenuSetupSoft::Store(void)
     CodecSetAudioDrift(ConfigAudioDrift);
 
     // FIXME: can handle more audio state changes here
-    // downmix changed reset audio, to get change direct
-    if (ConfigAudioDownmix != AudioDownmix) {
+    // downmix or output format changed reset audio, to get change direct
+    if (ConfigAudioDownmix != AudioDownmix || ConfigAudioOutputFormat != AudioOutputFormat) {
 	ResetChannelId();
     }
     ConfigAudioPassthrough = (AudioPassthroughPCM ? CodecPCM : 0)
@@ -1287,6 +1308,9 @@ void cMenuSetupSoft::Store(void)
     }
     SetupStore("AudioDownmix", ConfigAudioDownmix = AudioDownmix);
     CodecSetAudioDownmix(ConfigAudioDownmix);
+    SetupStore("AudioOutputFormat", ConfigAudioOutputFormat = AudioOutputFormat);
+    CodecSetAudioOutput(AudioOutputFormats[ConfigAudioOutputFormat][0],
+	AudioOutputFormats[ConfigAudioOutputFormat][1]);
     SetupStore("AudioSoftvol", ConfigAudioSoftvol = AudioSoftvol);
     AudioSetSoftvol(ConfigAudioSoftvol);
     SetupStore("AudioNormalize", ConfigAudioNormalize = AudioNormalize);
@@ -2391,6 +2415,10 @@ bool cPluginVaapiDevice::SetupParse(const char *name, const char *value)
 	VideoSetSoftStartSync(ConfigVideoSoftStartSync = atoi(value));
 	return true;
     }
+    if (!strcasecmp(name, "DecoderThreads")) {
+	CodecSetVideoThreads(ConfigVideoDecoderThreads = atoi(value));
+	return true;
+    }
     if (!strcasecmp(name, "ColorBalance")) {
 	VideoSetColorBalance(ConfigVideoColorBalance = atoi(value));
 	return true;
@@ -2496,6 +2524,15 @@ bool cPluginVaapiDevice::SetupParse(const char *name, const char *value)
 	CodecSetAudioDownmix(ConfigAudioDownmix = atoi(value));
 	return true;
     }
+    if (!strcasecmp(name, "AudioOutputFormat")) {
+	ConfigAudioOutputFormat = atoi(value);
+	if (ConfigAudioOutputFormat < 0 || ConfigAudioOutputFormat >= AUDIO_OUTPUT_FORMATS) {
+	    ConfigAudioOutputFormat = 0;
+	}
+	CodecSetAudioOutput(AudioOutputFormats[ConfigAudioOutputFormat][0],
+	    AudioOutputFormats[ConfigAudioOutputFormat][1]);
+	return true;
+    }
     if (!strcasecmp(name, "AudioSoftvol")) {
 	AudioSetSoftvol(ConfigAudioSoftvol = atoi(value));
 	return true;
@@ -23,7 +23,11 @@
 #include <stdint.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
 #include <math.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #ifndef __USE_GNU
 #define __USE_GNU
@@ -139,6 +143,7 @@ typedef struct _video_module_
     void (*const ReleaseSurface) (VideoHwDecoder *, unsigned);
     enum AVPixelFormat (*const get_format) (VideoHwDecoder *, AVCodecContext *, const enum AVPixelFormat *);
     void (*const RenderFrame) (VideoHwDecoder *, const AVCodecContext *, const AVFrame *);
+    int (*const GetFreeFrames) (const VideoHwDecoder *);
     void (*const SetClock) (VideoHwDecoder *, int64_t);
      int64_t(*const GetClock) (const VideoHwDecoder *);
     void (*const SetClosing) (const VideoHwDecoder *);
@@ -153,6 +158,8 @@ typedef struct _video_module_
 
     /// module display handler thread
     void (*const DisplayHandlerThread) (void);
+    /// module presentation handler thread
+    void (*const PresentHandlerThread) (void);
 
     void (*const OsdClear) (void);	///< clear OSD
     /// draw OSD ARGB area
@@ -178,12 +185,25 @@ typedef struct _video_config_values_
     float drv_scale;			// re-normalizing requires the original scale required for latching data to the driver
 } VideoConfigValues;
 
+///
+/// Video stage latency typedef.
+///
+typedef struct _video_latency_
+{
+    uint32_t Count;			///< number of measured calls
+    uint32_t Last;			///< last duration in us
+    uint32_t Max;			///< maximal duration in us
+    uint64_t Sum;			///< sum of all durations in us
+    uint32_t Late;			///< calls which missed their deadline
+} VideoLatency;
+
 //----------------------------------------------------------------------------
 //  Defines
 //----------------------------------------------------------------------------
 
 #define VIDEO_SURFACES_MAX	4	    ///< video output surfaces for queue
 #define POSTPROC_SURFACES_MAX	8	///< video postprocessing surfaces for queue
+#define VIDEO_VPP_SAMPLE	64	///< measure gpu time of every n-th vpp pass
 
 //----------------------------------------------------------------------------
 //  Variables
@@ -224,10 +244,12 @@ static VideoConfigValues VaapiConfigStde = {.active = 1,.min_value = 0.0,.max_va
 };
 
 char VideoIgnoreRepeatPict;		///< disable repeat pict warning
+char VideoNullFreeRun;			///< null output displays without pacing
 
 static const char *VideoDriverName = "va-api";	///< video output device - default to va-api
 
 static Display *XlibDisplay;		///< Xlib X11 display
+static char VideoHeadless;		///< flag running without x11 display
 static xcb_connection_t *Connection;	///< xcb connection
 static xcb_colormap_t VideoColormap;	///< video colormap
 static xcb_window_t VideoWindow;	///< video window
@@ -304,9 +326,14 @@ extern void AudioVideoReady(int64_t);	///< tell audio video is ready
 extern int IsReplay(void);
 
 static pthread_t VideoThread;		///< video decode thread
+static pthread_t VideoPresentThread;	///< video presentation thread
 static pthread_cond_t VideoWakeupCond;	///< wakeup condition variable
+static pthread_mutex_t VideoWakeupMutex;    ///< wakeup condition mutex
+static int VideoWakeupPending;		///< wakeup signaled, not yet handled
 static pthread_mutex_t VideoMutex;	///< video condition mutex
 static pthread_mutex_t VideoLockMutex;	///< video lock mutex
+static pthread_mutex_t VideoPresentMutex;   ///< video presentation lock mutex
+static volatile pthread_t VideoLockOwner;   ///< thread inside VideoThreadLock()
 extern pthread_mutex_t PTS_mutex;	///< PTS mutex
 extern pthread_mutex_t ReadAdvance_mutex;   ///< PTS mutex
 
@@ -318,6 +345,11 @@ static int OsdDirtyHeight;		///< osd dirty area height
 
 static int64_t VideoDeltaPTS;		///< FIXME: fix pts
 
+static VideoLatency VideoDecodeLatency;	///< decode + postprocess stage latency
+static VideoLatency VideoPresentLatency;    ///< presentation stage latency
+static VideoLatency VideoVppLatency[2];	///< sampled gpu time of main/sharpen vpp pass
+static uint32_t VideoSharpenPasses[2];	///< frames sharpened in one/two vpp passes
+
 static char DPMSDisabled;		///< flag we have disabled dpms
 
 uint32_t mutex_start_time;
@@ -330,12 +362,39 @@ uint32_t max_mutex_delay = 1;
 static void VideoThreadLock(void);	///< lock video thread
 static void VideoThreadUnlock(void);	///< unlock video thread
 static void VideoThreadExit(void);	///< exit/kill video thread
+static void VideoThreadWait(const struct timespec *);	///< wait for wakeup
 
 static void X11SuspendScreenSaver(xcb_connection_t *, int);
 static int X11HaveDPMS(xcb_connection_t *);
 static void X11DPMSReenable(xcb_connection_t *);
 static void X11DPMSDisable(xcb_connection_t *);
 
+///
+/// Account the duration of a video pipeline stage.
+///
+/// @param latency  stage latency counters
+/// @param start    CLOCK_MONOTONIC time the stage started
+/// @param limit    deadline of the stage in us
+///
+static void VideoLatencyUpdate(VideoLatency * latency, const struct timespec *start, uint32_t limit)
+{
+    struct timespec nowtime;
+    uint32_t us;
+
+    clock_gettime(CLOCK_MONOTONIC, &nowtime);
+    us = (nowtime.tv_sec - start->tv_sec) * 1000 * 1000 + (nowtime.tv_nsec - start->tv_nsec) / 1000;
+
+    latency->Count++;
+    latency->Last = us;
+    latency->Sum += us;
+    if (us > latency->Max) {
+	latency->Max = us;
+    }
+    if (us > limit) {
+	latency->Late++;
+    }
+}
+
 ///
 /// Update video pts.
 ///
@@ -639,6 +698,41 @@ static int AutoCropIsBlackLineY(const uint8_t * data, int length, int pitch)
     return !(r & ~((YBLACK - 1) * M64));
 }
 
+///
+/// Check if a 16 bit (P010) luma line is black.
+///
+/// Only the high byte of the little endian samples is checked, it holds
+/// the 8 most significant bits.
+///
+/// @param data	    luma data
+/// @param length   number of 64 bit words to check
+/// @param pitch    distance of the words in bytes
+///
+static int AutoCropIsBlackLineY16(const uint8_t * data, int length, int pitch)
+{
+    int n;
+    int o;
+    uint64_t r;
+    const uint64_t *p;
+
+#ifdef DEBUG
+    if ((size_t) data & 0x7 || pitch & 0x7) {
+	abort();
+    }
+#endif
+    p = (const uint64_t *)data;
+    n = length;
+    o = pitch / 8;
+
+    r = 0UL;
+    while (--n >= 0) {
+	r |= *p;
+	p += o;
+    }
+
+    return !(r & ~((YBLACK - 1) * M64) & UINT64_C(0xFF00FF00FF00FF00));
+}
+
 ///
 /// Auto detect black borders and crop them.
 ///
@@ -647,14 +741,17 @@ static int AutoCropIsBlackLineY(const uint8_t * data, int length, int pitch)
 /// @param height   frame height in pixel
 /// @param data frame planes data (Y, U, V)
 /// @param pitches  frame planes pitches (Y, U, V)
+/// @param bytes    bytes per luma sample, 2 for P010
 ///
 /// @note FIXME: can reduce the checked range, left, right crop isn't
 /// used yet.
 ///
 /// @note FIXME: only Y is checked, for black.
 ///
-static void AutoCropDetect(AutoCropCtx * autocrop, int width, int height, void *data[3], uint32_t pitches[3])
+static void AutoCropDetect(AutoCropCtx * autocrop, int width, int height, void *data[3], uint32_t pitches[3],
+    int bytes)
 {
+    int (*is_black_line) (const uint8_t *, int, int);
     const void *data_y;
     unsigned length_y;
     int x;
@@ -678,12 +775,13 @@ static void AutoCropDetect(AutoCropCtx * autocrop, int width, int height, void *
 
     data_y = data[0];
     length_y = pitches[0];
+    is_black_line = bytes == 2 ? AutoCropIsBlackLineY16 : AutoCropIsBlackLineY;
 
     //
     //	search top
     //
     for (y = SKIP_Y; y < y1; ++y) {
-	if (!AutoCropIsBlackLineY(data_y + logo_skip + y * length_y, (width - 2 * logo_skip) / 8, 8)) {
+	if (!is_black_line(data_y + logo_skip * bytes + y * length_y, (width - 2 * logo_skip) * bytes / 8, 8)) {
 	    if (y == SKIP_Y) {
 		y = 0;
 	    }
@@ -695,7 +793,7 @@ static void AutoCropDetect(AutoCropCtx * autocrop, int width, int height, void *
     //	search bottom
     //
     for (y = height - SKIP_Y - 1; y > y2; --y) {
-	if (!AutoCropIsBlackLineY(data_y + logo_skip + y * length_y, (width - 2 * logo_skip) / 8, 8)) {
+	if (!is_black_line(data_y + logo_skip * bytes + y * length_y, (width - 2 * logo_skip) * bytes / 8, 8)) {
 	    if (y == height - SKIP_Y - 1) {
 		y = height - 1;
 	    }
@@ -704,10 +802,12 @@ static void AutoCropDetect(AutoCropCtx * autocrop, int width, int height, void *
 	}
     }
     //
-    //	search left
+    //	search left, 8 pixel of 16 bit samples are two words
     //
     for (x = SKIP_X; x < x1; x += 8) {
-	if (!AutoCropIsBlackLineY(data_y + x + SKIP_Y * length_y, height - 2 * SKIP_Y, length_y)) {
+	if (!is_black_line(data_y + x * bytes + SKIP_Y * length_y, height - 2 * SKIP_Y, length_y)
+	    || (bytes == 2 && !is_black_line(data_y + x * bytes + 8 + SKIP_Y * length_y, height - 2 * SKIP_Y,
+		    length_y))) {
 	    if (x == SKIP_X) {
 		x = 0;
 	    }
@@ -716,10 +816,12 @@ static void AutoCropDetect(AutoCropCtx * autocrop, int width, int height, void *
 	}
     }
     //
-    //	search right
+    //	search right, 8 pixel of 16 bit samples are two words
     //
     for (x = width - SKIP_X - 8; x > x2; x -= 8) {
-	if (!AutoCropIsBlackLineY(data_y + x + SKIP_Y * length_y, height - 2 * SKIP_Y * 8, length_y)) {
+	if (!is_black_line(data_y + x * bytes + SKIP_Y * length_y, height - 2 * SKIP_Y * 8, length_y)
+	    || (bytes == 2 && !is_black_line(data_y + x * bytes + 8 + SKIP_Y * length_y, height - 2 * SKIP_Y * 8,
+		    length_y))) {
 	    if (x == width - SKIP_X - 8) {
 		x = width - 1;
 	    }
@@ -734,6 +836,246 @@ static void AutoCropDetect(AutoCropCtx * autocrop, int width, int height, void *
     autocrop->Y2 = y2;
 }
 
+//----------------------------------------------------------------------------
+//  software frame upload
+//----------------------------------------------------------------------------
+
+#define VIDEO_UPLOAD_THREADS_MAX 4	///< maximal upload worker threads
+#define VIDEO_UPLOAD_MIN_HEIGHT 720	///< smaller frames are uploaded single threaded
+
+///
+/// Slice parallel upload of a 8 bit 4:2:0 frame into a mapped image.
+///
+typedef struct _video_upload_job_
+{
+    uint8_t *Dst[3];			///< destination planes y, u, v (nv12: y, uv)
+    int DstPitch[3];			///< destination pitches
+    const uint8_t *Src[3];		///< source planes y, u, v
+    int SrcPitch[3];			///< source pitches
+    int Width;				///< luma width
+    int Height;				///< luma height
+    int Nv12;				///< flag interleave u+v into Dst[1]
+    int Slices;				///< number of slices
+} VideoUploadJob;
+
+static pthread_t VideoUploadThreads[VIDEO_UPLOAD_THREADS_MAX];	///< upload workers
+static int VideoUploadThreadN = -1;	///< number of upload workers, -1 not started
+static pthread_mutex_t VideoUploadMutex = PTHREAD_MUTEX_INITIALIZER;	///< upload job lock
+static pthread_cond_t VideoUploadStartCond = PTHREAD_COND_INITIALIZER;	///< new job for workers
+static pthread_cond_t VideoUploadDoneCond = PTHREAD_COND_INITIALIZER;	///< all slices done
+static const VideoUploadJob *VideoUploadCurrent;    ///< job in progress, NULL none
+static int VideoUploadNext;		///< next slice to upload
+static int VideoUploadPending;		///< slices not finished
+static char VideoUploadExiting;		///< flag workers should exit
+static VideoLatency VideoUploadLatency;	///< software frame upload time
+
+///
+/// Copy a row into uncached image memory.
+///
+/// @param dst	destination row
+/// @param src	source row
+/// @param n	number of bytes
+///
+static inline void VideoUploadCopyRow(uint8_t * dst, const uint8_t * src, int n)
+{
+#ifdef __SSE2__
+    if (!((uintptr_t) dst & 15)) {
+	int i;
+
+	// non-temporal stores, don't read the write-combined mapping
+	for (i = 0; i + 16 <= n; i += 16) {
+	    _mm_stream_si128((__m128i *) (dst + i), _mm_loadu_si128((const __m128i *)(src + i)));
+	}
+	memcpy(dst + i, src + i, n - i);
+	return;
+    }
+#endif
+    memcpy(dst, src, n);
+}
+
+///
+/// Interleave u and v rows into an nv12 chroma row.
+///
+/// @param dst	destination uv row
+/// @param u	source u row
+/// @param v	source v row
+/// @param n	number of chroma samples
+///
+static inline void VideoUploadInterleaveRow(uint8_t * dst, const uint8_t * u, const uint8_t * v, int n)
+{
+    int i;
+
+    i = 0;
+#ifdef __SSE2__
+    if (!((uintptr_t) dst & 15)) {
+	for (; i + 16 <= n; i += 16) {
+	    __m128i a = _mm_loadu_si128((const __m128i *)(u + i));
+	    __m128i b = _mm_loadu_si128((const __m128i *)(v + i));
+
+	    _mm_stream_si128((__m128i *) (dst + 2 * i), _mm_unpacklo_epi8(a, b));
+	    _mm_stream_si128((__m128i *) (dst + 2 * i + 16), _mm_unpackhi_epi8(a, b));
+	}
+    }
+#endif
+    for (; i < n; ++i) {
+	dst[2 * i] = u[i];
+	dst[2 * i + 1] = v[i];
+    }
+}
+
+///
+/// Upload one slice of a frame.
+///
+/// @param job	    upload job
+/// @param slice    slice number
+///
+static void VideoUploadSlice(const VideoUploadJob * job, int slice)
+{
+    int rows;
+    int y0;
+    int y1;
+    int y;
+
+    // even number of luma rows per slice, chroma rows don't overlap
+    rows = ((job->Height + job->Slices - 1) / job->Slices + 1) & ~1;
+    y0 = slice * rows;
+    y1 = y0 + rows < job->Height ? y0 + rows : job->Height;
+
+    for (y = y0; y < y1; ++y) {
+	VideoUploadCopyRow(job->Dst[0] + y * job->DstPitch[0], job->Src[0] + y * job->SrcPitch[0], job->Width);
+    }
+    for (y = y0 / 2; y < (y1 + 1) / 2; ++y) {
+	if (job->Nv12) {
+	    VideoUploadInterleaveRow(job->Dst[1] + y * job->DstPitch[1], job->Src[1] + y * job->SrcPitch[1],
+		job->Src[2] + y * job->SrcPitch[2], (job->Width + 1) / 2);
+	} else {
+	    VideoUploadCopyRow(job->Dst[1] + y * job->DstPitch[1], job->Src[1] + y * job->SrcPitch[1],
+		(job->Width + 1) / 2);
+	    VideoUploadCopyRow(job->Dst[2] + y * job->DstPitch[2], job->Src[2] + y * job->SrcPitch[2],
+		(job->Width + 1) / 2);
+	}
+    }
+#ifdef __SSE2__
+    _mm_sfence();			// make streamed stores visible
+#endif
+}
+
+///
+/// Upload worker thread.
+///
+static void *VideoUploadWorker( __attribute__ ((unused))
+    void *dummy)
+{
+    pthread_mutex_lock(&VideoUploadMutex);
+    for (;;) {
+	const VideoUploadJob *job;
+	int slice;
+
+	while (!VideoUploadExiting && !(VideoUploadCurrent && VideoUploadNext < VideoUploadCurrent->Slices)) {
+	    pthread_cond_wait(&VideoUploadStartCond, &VideoUploadMutex);
+	}
+	if (VideoUploadExiting) {
+	    break;
+	}
+	job = VideoUploadCurrent;
+	slice = VideoUploadNext++;
+	pthread_mutex_unlock(&VideoUploadMutex);
+
+	VideoUploadSlice(job, slice);
+
+	pthread_mutex_lock(&VideoUploadMutex);
+	if (!--VideoUploadPending) {
+	    pthread_cond_signal(&VideoUploadDoneCond);
+	}
+    }
+    pthread_mutex_unlock(&VideoUploadMutex);
+
+    return NULL;
+}
+
+///
+/// Start the upload workers.
+///
+static void VideoUploadInit(void)
+{
+    long cpus;
+    int i;
+
+    cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    VideoUploadThreadN = cpus > 1 ? cpus - 1 : 0;
+    if (VideoUploadThreadN > VIDEO_UPLOAD_THREADS_MAX) {
+	VideoUploadThreadN = VIDEO_UPLOAD_THREADS_MAX;
+    }
+    for (i = 0; i < VideoUploadThreadN; ++i) {
+	if (pthread_create(&VideoUploadThreads[i], NULL, VideoUploadWorker, NULL)) {
+	    Error("video: can't create upload thread");
+	    break;
+	}
+	pthread_setname_np(VideoUploadThreads[i], "vaapi upload");
+    }
+    VideoUploadThreadN = i;
+    Debug7("video: %d upload threads", VideoUploadThreadN);
+}
+
+///
+/// Stop the upload workers.
+///
+static void VideoUploadExit(void)
+{
+    int i;
+
+    pthread_mutex_lock(&VideoUploadMutex);
+    VideoUploadExiting = 1;
+    pthread_cond_broadcast(&VideoUploadStartCond);
+    pthread_mutex_unlock(&VideoUploadMutex);
+
+    for (i = 0; i < VideoUploadThreadN; ++i) {
+	pthread_join(VideoUploadThreads[i], NULL);
+    }
+    VideoUploadThreadN = -1;
+    VideoUploadExiting = 0;
+}
+
+///
+/// Upload a frame, split into slices for the workers.
+///
+/// @param job	upload job, slices are filled in
+///
+static void VideoUpload(VideoUploadJob * job)
+{
+    if (job->Height < VIDEO_UPLOAD_MIN_HEIGHT) {
+	job->Slices = 1;
+	VideoUploadSlice(job, 0);
+	return;
+    }
+    if (VideoUploadThreadN < 0) {
+	VideoUploadInit();
+    }
+    job->Slices = VideoUploadThreadN + 1;
+
+    pthread_mutex_lock(&VideoUploadMutex);
+    VideoUploadCurrent = job;
+    VideoUploadNext = 0;
+    VideoUploadPending = job->Slices;
+    pthread_cond_broadcast(&VideoUploadStartCond);
+
+    // the caller uploads slices, too
+    while (VideoUploadNext < job->Slices) {
+	int slice;
+
+	slice = VideoUploadNext++;
+	pthread_mutex_unlock(&VideoUploadMutex);
+	VideoUploadSlice(job, slice);
+	pthread_mutex_lock(&VideoUploadMutex);
+	--VideoUploadPending;
+    }
+    while (VideoUploadPending) {
+	pthread_cond_wait(&VideoUploadDoneCond, &VideoUploadMutex);
+    }
+    VideoUploadCurrent = NULL;
+    pthread_mutex_unlock(&VideoUploadMutex);
+}
+
 //----------------------------------------------------------------------------
 //  VA-API
 //----------------------------------------------------------------------------
@@ -754,6 +1096,43 @@ static char VaapiVideoProcessing;	///< supports video processing
     /// VA-API decoder typedef
 typedef struct _vaapi_decoder_ VaapiDecoder;
 
+///
+/// VA-API postprocessing pipeline descriptor.
+///
+/// Filter list and pipeline caps of the current configuration, rebuilt
+/// only when settings, resolution or interlacing change.
+///
+typedef struct _vaapi_pipeline_
+{
+    int Valid;				///< descriptor is built
+    unsigned Serial;			///< settings serial it was built for
+    VAContextID Context;		///< vpp context it was built for
+    VideoResolutions Resolution;	///< resolution group it was built for
+    int Interlaced;			///< interlaced flag it was built for
+
+    VAStatus CapsStatus;		///< result of pipeline caps query
+    unsigned ForwardRefCount;		///< forward references needed
+    unsigned BackwardRefCount;		///< backward references needed
+
+    VABufferID Filters[VAProcFilterCount];  ///< filters to run
+    unsigned FilterN;			///< number of filters to run
+    int DeintIndex;			///< index of deinterlacer, -1 none
+    int SinglePass;			///< sharpening filters appended to main pass
+    unsigned PassCounter;		///< main passes run, for gpu time sampling
+
+    int DeintFlags;			///< flags in deinterlace buffer, -1 unknown
+    unsigned DeintAlgorithm;		///< algorithm in deinterlace buffer
+} VaapiPipeline;
+
+///
+/// VA-API image derived from a surface for software frame upload.
+///
+typedef struct _vaapi_upload_image_
+{
+    VASurfaceID Surface;		///< surface the image is derived from
+    VAImage Image;			///< derived image, VA_INVALID_ID none
+} VaapiUploadImage;
+
 ///
 /// VA-API decoder
 ///
@@ -778,6 +1157,8 @@ struct _vaapi_decoder_
     unsigned SurfaceDeintTable[VideoResolutionMax];
 
     enum AVPixelFormat PixFmt;		///< ffmpeg frame pixfmt
+    enum AVPixelFormat SurfaceFmt;	///< decoded data format (NV12 or P010)
+    unsigned SurfaceRtFormat;		///< render target format of postproc surfaces
     int WrongInterlacedWarned;		///< warning about interlace flag issued
     int Interlaced;			///< ffmpeg interlaced flag
     int Deinterlaced;			///< vpp deinterlace was run / not run
@@ -786,6 +1167,10 @@ struct _vaapi_decoder_
     int GetPutImage;			///< flag get/put image can be used
     VAImage Image[1];			///< image buffer to update surface
 
+    struct SwsContext *SwsCtx;		///< cached software frame converter
+    /// derived images of the plugin surfaces, for software frame upload
+    VaapiUploadImage UploadImages[POSTPROC_SURFACES_MAX];
+
     VAEntrypoint VppEntrypoint;		///< VA-API postprocessing entrypoint
 
     VAConfigID VppConfig;		///< VPP Config
@@ -805,6 +1190,7 @@ struct _vaapi_decoder_
 
     /// video surface ring buffer
     VASurfaceID SurfacesRb[VIDEO_SURFACES_MAX];
+    char SurfacesUnscaled[VIDEO_SURFACES_MAX];	///< surface has input and not window size
     VASurfaceID PostProcSurfacesRb[POSTPROC_SURFACES_MAX];  ///< Posprocessing result surfaces
 
     VASurfaceID *ForwardRefSurfaces;	///< Forward referencing surfaces for post processing
@@ -836,6 +1222,7 @@ struct _vaapi_decoder_
     int FramesDuped;			///< number of frames duplicated
     int FramesMissed;			///< number of frames missed
     int FramesDropped;			///< number of frames dropped
+    int FramesBypassed;			///< number of frames queued without vpp
     int FrameCounter;			///< number of frames decoded
     int FramesDisplayed;		///< number of frames displayed
     VABufferID filters[VAProcFilterCount];  ///< video postprocessing filters via vpp
@@ -852,6 +1239,9 @@ struct _vaapi_decoder_
     int vpp_contrast_idx;		///< video postprocessing contrast buffer index
     int vpp_hue_idx;			///< video postprocessing hue buffer index
     int vpp_saturation_idx;		///< video postprocessing saturation buffer index
+
+    volatile unsigned PipelineSerial;	///< incremented on changed settings
+    VaapiPipeline Pipeline[1];		///< cached postprocessing pipeline
 };
 
 static VaapiDecoder *VaapiDecoders[1];	///< open decoder streams
@@ -963,6 +1353,23 @@ static void VaapiDeassociate(VaapiDecoder * decoder)
 ///
 static void VaapiCreateSurfaces(VaapiDecoder * decoder, int width, int height)
 {
+    // 10 bit video is kept 10 bit through the postprocessing
+    if (decoder->SurfaceFmt == AV_PIX_FMT_P010LE) {
+	VASurfaceAttrib attrib = {
+	    .type = VASurfaceAttribPixelFormat,
+	    .flags = VA_SURFACE_ATTRIB_SETTABLE,
+	    .value.type = VAGenericValueTypeInteger,
+	    .value.value.i = VA_FOURCC_P010,
+	};
+
+	if (vaCreateSurfaces(decoder->VaDisplay, VA_RT_FORMAT_YUV420_10BPP, width, height,
+		decoder->PostProcSurfacesRb, POSTPROC_SURFACES_MAX, &attrib, 1) == VA_STATUS_SUCCESS) {
+	    decoder->SurfaceRtFormat = VA_RT_FORMAT_YUV420_10BPP;
+	    return;
+	}
+	Info("video/vaapi: can't create 10 bit postproc surfaces, using 8 bit");
+    }
+    decoder->SurfaceRtFormat = VA_RT_FORMAT_YUV420;
     if (vaCreateSurfaces(decoder->VaDisplay, VA_RT_FORMAT_YUV420, width, height, decoder->PostProcSurfacesRb,
 	    POSTPROC_SURFACES_MAX, NULL, 0) != VA_STATUS_SUCCESS) {
 	Fatal("video/vaapi: can't create %d postproc surfaces", POSTPROC_SURFACES_MAX);
@@ -1136,6 +1543,9 @@ static void VaapiInitSurfaceFlags(VaapiDecoder * decoder)
 {
     int i;
 
+    // postprocessing pipeline must be rebuilt
+    decoder->PipelineSerial++;
+
     for (i = 0; i < VideoResolutionMax; ++i) {
 	decoder->SurfaceFlagsTable[i] = VA_CLEAR_DRAWABLE;
 	// color space conversion none, ITU-R BT.601, ITU-R BT.709, ...
@@ -1275,6 +1685,10 @@ static VaapiDecoder *VaapiNewHwDecoder(VideoStream * stream)
     VaapiInitSurfaceFlags(decoder);
 
     decoder->Image->image_id = VA_INVALID_ID;
+    for (i = 0; i < POSTPROC_SURFACES_MAX; ++i) {
+	decoder->UploadImages[i].Surface = VA_INVALID_ID;
+	decoder->UploadImages[i].Image.image_id = VA_INVALID_ID;
+    }
 
     // setup video surface ring buffer
     atomic_set(&decoder->SurfacesFilled, 0);
@@ -1332,6 +1746,8 @@ static VaapiDecoder *VaapiNewHwDecoder(VideoStream * stream)
     decoder->OutputHeight = VideoWindowHeight;
 
     decoder->PixFmt = AV_PIX_FMT_NONE;
+    decoder->SurfaceFmt = AV_PIX_FMT_NV12;
+    decoder->SurfaceRtFormat = VA_RT_FORMAT_YUV420;
 
     decoder->Stream = stream;
     if (!VaapiDecoderN) {		// FIXME: hack sync on audio
@@ -1392,6 +1808,7 @@ static void VaapiCleanup(VaapiDecoder * decoder)
     }
     decoder->filter_n = 0;
     decoder->gpe_filter_n = 0;
+    decoder->Pipeline->Valid = 0;
 
     decoder->WrongInterlacedWarned = 0;
 
@@ -1402,6 +1819,18 @@ static void VaapiCleanup(VaapiDecoder * decoder)
 	}
 	decoder->Image->image_id = VA_INVALID_ID;
     }
+    //	cleanup upload context, before the surfaces are destroyed
+    for (int i = 0; i < POSTPROC_SURFACES_MAX; ++i) {
+	if (decoder->UploadImages[i].Image.image_id != VA_INVALID_ID) {
+	    if (vaDestroyImage(decoder->VaDisplay, decoder->UploadImages[i].Image.image_id) != VA_STATUS_SUCCESS) {
+		Error("video/vaapi: can't destroy upload image!");
+	    }
+	    decoder->UploadImages[i].Image.image_id = VA_INVALID_ID;
+	}
+	decoder->UploadImages[i].Surface = VA_INVALID_ID;
+    }
+    sws_freeContext(decoder->SwsCtx);
+    decoder->SwsCtx = NULL;
     // This check is used to prevent unnecessary error logging when VaapiCleanup() is called before VaapiSetup()
     if (VaapiVideoProcessing) {
 	//  cleanup surfaces
@@ -1446,6 +1875,8 @@ static void VaapiDelHwDecoder(VaapiDecoder * decoder)
 {
     int i;
 
+    // remove decoder from the presentation thread
+    pthread_mutex_lock(&VideoPresentMutex);
     for (i = 0; i < VaapiDecoderN; ++i) {
 	if (VaapiDecoders[i] == decoder) {
 	    VaapiDecoders[i] = NULL;
@@ -1456,6 +1887,7 @@ static void VaapiDelHwDecoder(VaapiDecoder * decoder)
     }
 
     VaapiCleanup(decoder);
+    pthread_mutex_unlock(&VideoPresentMutex);
 
     if (decoder->BlackSurface != VA_INVALID_ID) {
 	//
@@ -1510,6 +1942,8 @@ static void VaapiExit(void)
 	}
     }
     VaapiDecoderN = 0;
+
+    VideoUploadExit();
 }
 
 //----------------------------------------------------------------------------
@@ -1565,8 +1999,10 @@ static int VaapiFindImageFormat(VaapiDecoder * decoder, enum AVPixelFormat pix_f
 	    fourcc = VA_FOURCC_RGBX;
 	    break;
 	case AV_PIX_FMT_YUV420P10LE:
-	    //fourcc = VA_FOURCC_P010;
-	    fourcc = VA_FOURCC_NV12;	// FIXME: Do P010 on supported hardware
+	    fourcc = VA_FOURCC_NV12;	// P010 only for 10 bit postproc surfaces
+	    break;
+	case AV_PIX_FMT_P010LE:
+	    fourcc = VA_FOURCC_P010;
 	    break;
 	default:
 	    Fatal("video/vaapi: unsupported pixel format %d (%s)", pix_fmt, av_get_pix_fmt_name(pix_fmt));
@@ -1590,6 +2026,7 @@ static int VaapiFindImageFormat(VaapiDecoder * decoder, enum AVPixelFormat pix_f
     //
     //	search image format
     //
+  again:
     for (i = 0; i < imgfrmt_n; ++i) {
 	if (imgfrmts[i].fourcc == fourcc) {
 	    *format = imgfrmts[i];
@@ -1598,6 +2035,11 @@ static int VaapiFindImageFormat(VaapiDecoder * decoder, enum AVPixelFormat pix_f
 	    return 1;
 	}
     }
+    // no P010 images, driver converts to 8 bit
+    if (fourcc == VA_FOURCC_P010) {
+	fourcc = VA_FOURCC_NV12;
+	goto again;
+    }
 
     Fatal("video/vaapi: pixel format %d unsupported by VA-API", pix_fmt);
     // FIXME: no fatal error!
@@ -1606,51 +2048,42 @@ static int VaapiFindImageFormat(VaapiDecoder * decoder, enum AVPixelFormat pix_f
 }
 
 ///
-/// Check an array of filters and see how many reference surfaces are required
+/// Check cached pipeline caps and see how many reference surfaces are required
 ///
-/// @param ctx[in]  VA-API postprocessing context
-/// @param filters[in]	    array of filters to check
-/// @param num_filters[in]  number of filters in array to check
+/// @param pipeline[in]	    postprocessing pipeline descriptor
 /// @param num_frefs[in,out]	number of forward reference surface ids supplied/needed
 /// @param num_brefs[in,out]	number of backward reference surface ids supplied/needed
-static VAStatus VaapiCheckPipelineCaps(VAContextID ctx, VABufferID * filters, unsigned int num_filters,
-    unsigned int *num_frefs, unsigned int *num_brefs)
+static VAStatus VaapiCheckPipelineCaps(const VaapiPipeline * pipeline, unsigned int *num_frefs,
+    unsigned int *num_brefs)
 {
-    VAStatus va_status;
-    VAProcPipelineCaps pipeline_caps;
-
-    memset(&pipeline_caps, '\0', sizeof(pipeline_caps));
-
-    va_status = vaQueryVideoProcPipelineCaps(VaDisplay, ctx, filters, num_filters, &pipeline_caps);
-    if (va_status != VA_STATUS_SUCCESS) {
-	Error("vaapi/vpp: query pipeline caps failed (0x%x): %s", va_status, vaErrorStr(va_status));
-	return va_status;
+    if (pipeline->CapsStatus != VA_STATUS_SUCCESS) {
+	return pipeline->CapsStatus;
     }
 
-    if (pipeline_caps.num_forward_references != *num_frefs) {
-	Debug7("vaapi/vpp: Wrong number of forward references. Needed %d, got %d",
-	    pipeline_caps.num_forward_references, *num_frefs);
+    if (pipeline->ForwardRefCount != *num_frefs) {
+	Debug7("vaapi/vpp: Wrong number of forward references. Needed %d, got %d", pipeline->ForwardRefCount,
+	    *num_frefs);
 	/* Fail operation when needing more references than currently have */
-	if (pipeline_caps.num_forward_references > *num_frefs) {
-	    *num_frefs = pipeline_caps.num_forward_references;
-	    *num_brefs = pipeline_caps.num_backward_references;
+	if (pipeline->ForwardRefCount > *num_frefs) {
+	    *num_frefs = pipeline->ForwardRefCount;
+	    *num_brefs = pipeline->BackwardRefCount;
 	    return VA_STATUS_ERROR_INVALID_PARAMETER;
 	}
     }
 
-    if (pipeline_caps.num_backward_references != *num_brefs) {
-	Debug7("vaapi/vpp: Wrong number of backward references. Needed %d, got %d",
-	    pipeline_caps.num_backward_references, *num_brefs);
+    if (pipeline->BackwardRefCount != *num_brefs) {
+	Debug7("vaapi/vpp: Wrong number of backward references. Needed %d, got %d", pipeline->BackwardRefCount,
+	    *num_brefs);
 	/* Fail operation when needing more references than currently have */
-	if (pipeline_caps.num_backward_references > *num_brefs) {
-	    *num_frefs = pipeline_caps.num_forward_references;
-	    *num_brefs = pipeline_caps.num_backward_references;
+	if (pipeline->BackwardRefCount > *num_brefs) {
+	    *num_frefs = pipeline->ForwardRefCount;
+	    *num_brefs = pipeline->BackwardRefCount;
 	    return VA_STATUS_ERROR_INVALID_PARAMETER;
 	}
     }
 
-    *num_frefs = pipeline_caps.num_forward_references;
-    *num_brefs = pipeline_caps.num_backward_references;
+    *num_frefs = pipeline->ForwardRefCount;
+    *num_brefs = pipeline->BackwardRefCount;
 
     return VA_STATUS_SUCCESS;
 }
@@ -1736,59 +2169,26 @@ static inline VAStatus VaapiRunScaling(VAContextID ctx, VASurfaceID src, VASurfa
 }
 
 ///
-/// Construct and apply filters to a surface (should be called after queuing new surface)
+/// Build the postprocessing pipeline descriptor of the current configuration.
 ///
 /// @param decoder  VA-API decoder
-/// @param top_field top field is first
-/// @return Pointer to postprocessed surface or NULL if postprocessing failed
 ///
-/// @note we can't mix software and hardware decoder surfaces
+/// Queries the driver for the references needed by the filters and
+/// selects the filters to run with the current settings.
 ///
-static VASurfaceID *VaapiApplyFilters(VaapiDecoder * decoder, int top_field)
+static void VaapiBuildPipeline(VaapiDecoder * decoder)
 {
-    unsigned int filter_count = 0;
-    unsigned int filter_flags = decoder->SurfaceFlagsTable[decoder->Resolution];
-    unsigned int tmp_forwardRefCount = decoder->ForwardRefCount;
-    unsigned int tmp_backwardRefCount = decoder->BackwardRefCount;
-    VAStatus va_status, caps_status;
-    VABufferID filters_to_run[VAProcFilterCount];
-    VAProcFilterParameterBufferDeinterlacing *deinterlace = NULL;
-    VASurfaceID *surface = NULL;
-    VASurfaceID *gpe_surface = NULL;
-
-    /* Get next postproc surface to write from ring buffer */
-    decoder->PostProcSurfaceWrite = (decoder->PostProcSurfaceWrite + 1) % POSTPROC_SURFACES_MAX;
-    surface = &decoder->PostProcSurfacesRb[decoder->PostProcSurfaceWrite];
-
-    if (decoder->Deinterlaced || !decoder->Interlaced)
-	filter_flags |= VA_FRAME_PICTURE;
-    else if (decoder->Interlaced)
-	filter_flags |= top_field ? VA_TOP_FIELD : VA_BOTTOM_FIELD;
-
-    /* Map deinterlace buffer and handle field ordering */
-    if (decoder->vpp_deinterlace_buf) {
-	va_status = vaMapBuffer(decoder->VaDisplay, *decoder->vpp_deinterlace_buf, (void **)&deinterlace);
-	if (va_status != VA_STATUS_SUCCESS) {
-	    Error("deint map buffer va_status = 0x%X", va_status);
-	    return NULL;
-	}
-	/* Change deint algorithm as set in plugin menu */
-	deinterlace->algorithm = decoder->SurfaceDeintTable[decoder->Resolution];
-
-	if (top_field)
-	    deinterlace->flags = 0;
-	else
-	    deinterlace->flags = VA_DEINTERLACING_BOTTOM_FIELD;
-
-	if (!decoder->TopFieldFirst)
-	    deinterlace->flags |= VA_DEINTERLACING_BOTTOM_FIELD_FIRST;
-	/* If non-interlaced then override flags with one field setup */
-	if (!decoder->Interlaced)
-	    deinterlace->flags = VA_DEINTERLACING_ONE_FIELD;
+    VaapiPipeline *pipeline = decoder->Pipeline;
+    unsigned int filter_count;
+    unsigned deint = decoder->SurfaceDeintTable[decoder->Resolution];
+    int deint_off = deint == VAProcDeinterlacingNone || deint == VAProcDeinterlacingWeave;
+    VABufferID filters_to_check[VAProcFilterCount];
+    VAProcPipelineCaps pipeline_caps;
 
-	vaUnmapBuffer(decoder->VaDisplay, *decoder->vpp_deinterlace_buf);
-	deinterlace = NULL;
-    }
+    pipeline->Serial = decoder->PipelineSerial;
+    pipeline->Context = decoder->vpp_ctx;
+    pipeline->Resolution = decoder->Resolution;
+    pipeline->Interlaced = decoder->Interlaced;
 
     /* This block of code creates a temporary array of filters that are checked for
        whether forward/backward references are needed.
@@ -1797,57 +2197,51 @@ static VASurfaceID *VaapiApplyFilters(VaapiDecoder * decoder, int top_field)
        Otherwise vaQueryVideoProcPipelineCaps returns an error.
      */
     filter_count = 0;
-    memset(filters_to_run, VA_INVALID_ID, sizeof(filters_to_run));
     for (unsigned int i = 0; i < decoder->filter_n; ++i) {
-	if (decoder->filters[i] == *decoder->vpp_deinterlace_buf) {
-	    if (decoder->SurfaceDeintTable[decoder->Resolution] == VAProcDeinterlacingNone)
-		continue;
-	    if (decoder->SurfaceDeintTable[decoder->Resolution] == VAProcDeinterlacingWeave)
-		continue;
-	}
+	if (decoder->vpp_deinterlace_buf && decoder->filters[i] == *decoder->vpp_deinterlace_buf && deint_off)
+	    continue;
 	// No reason to skip so add filter to temporary filter array
-	filters_to_run[filter_count++] = decoder->filters[i];
+	filters_to_check[filter_count++] = decoder->filters[i];
     }
-    caps_status =
-	VaapiCheckPipelineCaps(decoder->vpp_ctx, filters_to_run, filter_count, &tmp_forwardRefCount,
-	&tmp_backwardRefCount);
 
-    /* Make sure the src/dst surfaces are ready */
-    if (vaSyncSurface(decoder->VaDisplay, decoder->PlaybackSurface) != VA_STATUS_SUCCESS)
-	Debug8("video/vaapi: failure in synchronizing Playbacksurface");
-    if (vaSyncSurface(decoder->VaDisplay, *surface) != VA_STATUS_SUCCESS)
-	Debug8("video/vaapi: failure in synchronizing dst surface");
+    memset(&pipeline_caps, '\0', sizeof(pipeline_caps));
+    pipeline->CapsStatus =
+	vaQueryVideoProcPipelineCaps(VaDisplay, decoder->vpp_ctx, filters_to_check, filter_count, &pipeline_caps);
+    if (pipeline->CapsStatus != VA_STATUS_SUCCESS) {
+	Error("vaapi/vpp: query pipeline caps failed (0x%x): %s", pipeline->CapsStatus,
+	    vaErrorStr(pipeline->CapsStatus));
+    }
+    pipeline->ForwardRefCount = pipeline_caps.num_forward_references;
+    pipeline->BackwardRefCount = pipeline_caps.num_backward_references;
+
+    /* Check if the driver can run sharpening in the main pass, it must
+       not change the needed references */
+    pipeline->SinglePass = 0;
+    if (pipeline->CapsStatus == VA_STATUS_SUCCESS && decoder->vpp_sharpen_buf && VideoSharpen[decoder->Resolution]
+	&& filter_count + decoder->gpe_filter_n <= VAProcFilterCount) {
+	for (unsigned int i = 0; i < decoder->gpe_filter_n; ++i) {
+	    filters_to_check[filter_count + i] = decoder->gpe_filters[i];
+	}
+	memset(&pipeline_caps, '\0', sizeof(pipeline_caps));
+	if (vaQueryVideoProcPipelineCaps(VaDisplay, decoder->vpp_ctx, filters_to_check,
+		filter_count + decoder->gpe_filter_n, &pipeline_caps) == VA_STATUS_SUCCESS
+	    && pipeline_caps.num_forward_references == pipeline->ForwardRefCount
+	    && pipeline_caps.num_backward_references == pipeline->BackwardRefCount) {
+	    pipeline->SinglePass = 1;
+	}
+    }
 
-    /* This block of code skips various filters in-flight if source/settings
+    /* This block of code skips various filters if source/settings
        disallow running the filter in question */
-    filter_count = 0;
-    memset(filters_to_run, VA_INVALID_ID, sizeof(filters_to_run));
+    pipeline->FilterN = 0;
+    pipeline->DeintIndex = -1;
     for (unsigned int i = 0; i < decoder->filter_n; ++i) {
 
 	/* Skip deinterlacer if disabled or source is not interlaced */
-	if (decoder->filters[i] == *decoder->vpp_deinterlace_buf) {
-	    if (!decoder->Interlaced)
-		continue;
-	    if (decoder->SurfaceDeintTable[decoder->Resolution] == VAProcDeinterlacingNone)
-		continue;
-	    if (decoder->SurfaceDeintTable[decoder->Resolution] == VAProcDeinterlacingWeave)
-		continue;
-	    /* Skip deinterlacing if forward/backward references are not ready */
-	    if (caps_status != VA_STATUS_SUCCESS)
-		continue;
-	    /* Make sure rendering is finished in reference surfaces */
-	    if (VaapiSyncSurfaces(decoder->VaDisplay, decoder->ForwardRefSurfaces,
-		    tmp_forwardRefCount) != VA_STATUS_SUCCESS)
-		continue;
-	    if (VaapiCheckSurfaces(decoder->VaDisplay, decoder->ForwardRefSurfaces,
-		    tmp_forwardRefCount) != VA_STATUS_SUCCESS)
-		continue;
-	    if (VaapiSyncSurfaces(decoder->VaDisplay, decoder->BackwardRefSurfaces,
-		    tmp_backwardRefCount) != VA_STATUS_SUCCESS)
-		continue;
-	    if (VaapiCheckSurfaces(decoder->VaDisplay, decoder->BackwardRefSurfaces,
-		    tmp_backwardRefCount) != VA_STATUS_SUCCESS)
+	if (decoder->vpp_deinterlace_buf && decoder->filters[i] == *decoder->vpp_deinterlace_buf) {
+	    if (!decoder->Interlaced || deint_off)
 		continue;
+	    pipeline->DeintIndex = pipeline->FilterN;
 	}
 
 	/* Skip color balance filters if value is set to 0 ("off") */
@@ -1868,25 +2262,196 @@ static VASurfaceID *VaapiApplyFilters(VaapiDecoder * decoder, int top_field)
 		continue;
 	}
 
-	filters_to_run[filter_count++] = decoder->filters[i];
+	pipeline->Filters[pipeline->FilterN++] = decoder->filters[i];
+    }
+    /* Sharpening filters are last, so they can be dropped again */
+    if (pipeline->SinglePass) {
+	for (unsigned int i = 0; i < decoder->gpe_filter_n; ++i) {
+	    pipeline->Filters[pipeline->FilterN++] = decoder->gpe_filters[i];
+	}
     }
 
-    va_status =
-	VaapiPostprocessSurface(decoder->vpp_ctx, decoder->PlaybackSurface, *surface, filters_to_run, filter_count,
-	filter_flags, 0, decoder->ForwardRefSurfaces, tmp_forwardRefCount, decoder->BackwardRefSurfaces,
-	tmp_backwardRefCount);
+    // force update of the deinterlace buffer
+    pipeline->DeintFlags = -1;
+    pipeline->Valid = 1;
 
-    if (tmp_forwardRefCount != decoder->ForwardRefCount) {
-	Info("video/vaapi: changing to %d forward reference surfaces for postprocessing", tmp_forwardRefCount);
-	decoder->ForwardRefSurfaces = realloc(decoder->ForwardRefSurfaces, tmp_forwardRefCount * sizeof(VASurfaceID));
-	decoder->ForwardRefCount = tmp_forwardRefCount;
-    }
+    Debug7("video/vaapi: vpp pipeline %u of %u filters, %u/%u references%s", pipeline->FilterN, decoder->filter_n,
+	pipeline->ForwardRefCount, pipeline->BackwardRefCount, pipeline->SinglePass ? ", single pass" : "");
+}
 
-    if (tmp_backwardRefCount != decoder->BackwardRefCount) {
-	Info("video/vaapi: changing to %d backward reference surfaces for postprocessing", tmp_backwardRefCount);
-	decoder->BackwardRefSurfaces =
-	    realloc(decoder->BackwardRefSurfaces, tmp_backwardRefCount * sizeof(VASurfaceID));
-	decoder->BackwardRefCount = tmp_backwardRefCount;
+///
+/// Rebuild the postprocessing pipeline, if the configuration has changed.
+///
+/// @param decoder  VA-API decoder
+///
+static void VaapiUpdatePipeline(VaapiDecoder * decoder)
+{
+    VaapiPipeline *pipeline = decoder->Pipeline;
+
+    if (!pipeline->Valid || pipeline->Serial != decoder->PipelineSerial || pipeline->Context != decoder->vpp_ctx
+	|| pipeline->Resolution != decoder->Resolution || pipeline->Interlaced != decoder->Interlaced) {
+	VaapiBuildPipeline(decoder);
+    }
+}
+
+///
+/// Check if postprocessing can be bypassed.
+///
+/// @param decoder  VA-API decoder
+///
+/// @returns true if no filter is active for the current surface and
+/// the decoder pool has extra surfaces for the queue.
+///
+static int VaapiBypassFilters(VaapiDecoder * decoder)
+{
+    VaapiUpdatePipeline(decoder);
+
+#ifdef USE_EXTRA_HW_FRAMES
+    return !decoder->Interlaced && !decoder->Pipeline->FilterN && decoder->PlaybackSurface != VA_INVALID_ID
+	&& !(decoder->vpp_sharpen_buf && VideoSharpen[decoder->Resolution]);
+#else
+    // the decoder pool has no room for queued decoder surfaces
+    return 0;
+#endif
+}
+
+///
+/// Construct and apply filters to a surface (should be called after queuing new surface)
+///
+/// @param decoder  VA-API decoder
+/// @param top_field top field is first
+/// @param deinterlaced previous field was deinterlaced
+/// @return Pointer to postprocessed surface or NULL if postprocessing failed
+///
+/// @note we can't mix software and hardware decoder surfaces
+///
+static VASurfaceID *VaapiApplyFilters(VaapiDecoder * decoder, int top_field, int deinterlaced)
+{
+    unsigned int filter_count;
+    unsigned int filter_flags = decoder->SurfaceFlagsTable[decoder->Resolution];
+    unsigned int tmp_forwardRefCount = decoder->ForwardRefCount;
+    unsigned int tmp_backwardRefCount = decoder->BackwardRefCount;
+    VAStatus va_status, caps_status;
+    VaapiPipeline *pipeline = decoder->Pipeline;
+    int sample;
+    struct timespec start;
+    VABufferID *filters_to_run;
+    VABufferID filters_no_deint[VAProcFilterCount];
+    VAProcFilterParameterBufferDeinterlacing *deinterlace = NULL;
+    VASurfaceID *surface = NULL;
+    VASurfaceID *gpe_surface = NULL;
+
+    VaapiUpdatePipeline(decoder);
+
+    /* Get next postproc surface to write from ring buffer */
+    decoder->PostProcSurfaceWrite = (decoder->PostProcSurfaceWrite + 1) % POSTPROC_SURFACES_MAX;
+    surface = &decoder->PostProcSurfacesRb[decoder->PostProcSurfaceWrite];
+
+    if (deinterlaced || !decoder->Interlaced)
+	filter_flags |= VA_FRAME_PICTURE;
+    else if (decoder->Interlaced)
+	filter_flags |= top_field ? VA_TOP_FIELD : VA_BOTTOM_FIELD;
+
+    /* Map deinterlace buffer and handle field ordering, if changed */
+    if (decoder->vpp_deinterlace_buf) {
+	int flags;
+
+	if (top_field)
+	    flags = 0;
+	else
+	    flags = VA_DEINTERLACING_BOTTOM_FIELD;
+
+	if (!decoder->TopFieldFirst)
+	    flags |= VA_DEINTERLACING_BOTTOM_FIELD_FIRST;
+	/* If non-interlaced then override flags with one field setup */
+	if (!decoder->Interlaced)
+	    flags = VA_DEINTERLACING_ONE_FIELD;
+
+	if (pipeline->DeintFlags != flags
+	    || pipeline->DeintAlgorithm != decoder->SurfaceDeintTable[decoder->Resolution]) {
+	    va_status = vaMapBuffer(decoder->VaDisplay, *decoder->vpp_deinterlace_buf, (void **)&deinterlace);
+	    if (va_status != VA_STATUS_SUCCESS) {
+		Error("deint map buffer va_status = 0x%X", va_status);
+		return NULL;
+	    }
+	    /* Change deint algorithm as set in plugin menu */
+	    deinterlace->algorithm = decoder->SurfaceDeintTable[decoder->Resolution];
+	    deinterlace->flags = flags;
+
+	    vaUnmapBuffer(decoder->VaDisplay, *decoder->vpp_deinterlace_buf);
+	    deinterlace = NULL;
+
+	    pipeline->DeintFlags = flags;
+	    pipeline->DeintAlgorithm = decoder->SurfaceDeintTable[decoder->Resolution];
+	}
+    }
+
+    caps_status = VaapiCheckPipelineCaps(pipeline, &tmp_forwardRefCount, &tmp_backwardRefCount);
+
+    /* Make sure the src/dst surfaces are ready */
+    if (vaSyncSurface(decoder->VaDisplay, decoder->PlaybackSurface) != VA_STATUS_SUCCESS)
+	Debug8("video/vaapi: failure in synchronizing Playbacksurface");
+    if (vaSyncSurface(decoder->VaDisplay, *surface) != VA_STATUS_SUCCESS)
+	Debug8("video/vaapi: failure in synchronizing dst surface");
+
+    filters_to_run = pipeline->Filters;
+    filter_count = pipeline->FilterN;
+    if (pipeline->DeintIndex >= 0) {
+	/* Skip deinterlacing if forward/backward references are not ready */
+	if (caps_status != VA_STATUS_SUCCESS
+	    /* Make sure rendering is finished in reference surfaces */
+	    || VaapiSyncSurfaces(decoder->VaDisplay, decoder->ForwardRefSurfaces,
+		tmp_forwardRefCount) != VA_STATUS_SUCCESS
+	    || VaapiCheckSurfaces(decoder->VaDisplay, decoder->ForwardRefSurfaces,
+		tmp_forwardRefCount) != VA_STATUS_SUCCESS
+	    || VaapiSyncSurfaces(decoder->VaDisplay, decoder->BackwardRefSurfaces,
+		tmp_backwardRefCount) != VA_STATUS_SUCCESS
+	    || VaapiCheckSurfaces(decoder->VaDisplay, decoder->BackwardRefSurfaces,
+		tmp_backwardRefCount) != VA_STATUS_SUCCESS) {
+	    filter_count = 0;
+	    for (unsigned int i = 0; i < pipeline->FilterN; ++i) {
+		if ((int)i != pipeline->DeintIndex)
+		    filters_no_deint[filter_count++] = pipeline->Filters[i];
+	    }
+	    filters_to_run = filters_no_deint;
+	}
+    }
+
+    sample = !(++pipeline->PassCounter % VIDEO_VPP_SAMPLE);
+    if (sample) {
+	clock_gettime(CLOCK_MONOTONIC, &start);
+    }
+    va_status =
+	VaapiPostprocessSurface(decoder->vpp_ctx, decoder->PlaybackSurface, *surface, filters_to_run, filter_count,
+	filter_flags, 0, decoder->ForwardRefSurfaces, tmp_forwardRefCount, decoder->BackwardRefSurfaces,
+	tmp_backwardRefCount);
+    if (va_status != VA_STATUS_SUCCESS && pipeline->SinglePass) {
+	/* Driver refused the combined pipeline, fall back to two passes */
+	Info("video/vaapi: single pass sharpening failed, using separate pass");
+	pipeline->SinglePass = 0;
+	pipeline->FilterN -= decoder->gpe_filter_n;
+	filter_count -= decoder->gpe_filter_n;
+	va_status =
+	    VaapiPostprocessSurface(decoder->vpp_ctx, decoder->PlaybackSurface, *surface, filters_to_run,
+	    filter_count, filter_flags, 0, decoder->ForwardRefSurfaces, tmp_forwardRefCount,
+	    decoder->BackwardRefSurfaces, tmp_backwardRefCount);
+    }
+    if (sample && va_status == VA_STATUS_SUCCESS) {
+	vaSyncSurface(decoder->VaDisplay, *surface);
+	VideoLatencyUpdate(&VideoVppLatency[0], &start, 20 * 1000);
+    }
+
+    if (tmp_forwardRefCount != decoder->ForwardRefCount) {
+	Info("video/vaapi: changing to %d forward reference surfaces for postprocessing", tmp_forwardRefCount);
+	decoder->ForwardRefSurfaces = realloc(decoder->ForwardRefSurfaces, tmp_forwardRefCount * sizeof(VASurfaceID));
+	decoder->ForwardRefCount = tmp_forwardRefCount;
+    }
+
+    if (tmp_backwardRefCount != decoder->BackwardRefCount) {
+	Info("video/vaapi: changing to %d backward reference surfaces for postprocessing", tmp_backwardRefCount);
+	decoder->BackwardRefSurfaces =
+	    realloc(decoder->BackwardRefSurfaces, tmp_backwardRefCount * sizeof(VASurfaceID));
+	decoder->BackwardRefCount = tmp_backwardRefCount;
     }
 
     if (va_status != VA_STATUS_SUCCESS)
@@ -1896,12 +2461,21 @@ static VASurfaceID *VaapiApplyFilters(VaapiDecoder * decoder, int top_field)
     if (!decoder->vpp_sharpen_buf || !VideoSharpen[decoder->Resolution])
 	return surface;
 
+    /* Sharpening was already done in the main pass */
+    if (pipeline->SinglePass) {
+	VideoSharpenPasses[0]++;
+	return surface;
+    }
+
     vaSyncSurface(decoder->VaDisplay, *surface);
 
     /* Get postproc surface for gpe pipeline */
     decoder->PostProcSurfaceWrite = (decoder->PostProcSurfaceWrite + 1) % POSTPROC_SURFACES_MAX;
     gpe_surface = &decoder->PostProcSurfacesRb[decoder->PostProcSurfaceWrite];
 
+    if (sample) {
+	clock_gettime(CLOCK_MONOTONIC, &start);
+    }
     va_status =
 	VaapiPostprocessSurface(decoder->vpp_ctx, *surface, *gpe_surface, decoder->gpe_filters, decoder->gpe_filter_n,
 	VA_FRAME_PICTURE, 0, NULL, 0, NULL, 0);
@@ -1910,6 +2484,12 @@ static VASurfaceID *VaapiApplyFilters(VaapiDecoder * decoder, int top_field)
     if (va_status != VA_STATUS_SUCCESS)
 	return surface;
 
+    if (sample) {
+	vaSyncSurface(decoder->VaDisplay, *gpe_surface);
+	VideoLatencyUpdate(&VideoVppLatency[1], &start, 20 * 1000);
+    }
+    VideoSharpenPasses[1]++;
+
     return gpe_surface;
 }
 
@@ -1955,7 +2535,8 @@ static uint8_t *VaapiGrabOutputSurfaceYUV(VaapiDecoder * decoder, VASurfaceID sr
 	    return NULL;
 	}
 
-	if (!VaapiFindImageFormat(decoder, AV_PIX_FMT_NV12, format)) {
+	if (!VaapiFindImageFormat(decoder,
+		decoder->SurfaceRtFormat == VA_RT_FORMAT_YUV420_10BPP ? AV_PIX_FMT_P010LE : AV_PIX_FMT_NV12, format)) {
 	    Error("video/vaapi: Image format suitable for grab not supported");
 	    return NULL;
 	}
@@ -1975,7 +2556,8 @@ static uint8_t *VaapiGrabOutputSurfaceYUV(VaapiDecoder * decoder, VASurfaceID sr
     VaapiFindImageFormat(decoder, AV_PIX_FMT_NV12, format);
 
     // Sanity check for image format
-    if (image.format.fourcc != VA_FOURCC_NV12 && image.format.fourcc != VA_FOURCC_I420) {
+    if (image.format.fourcc != VA_FOURCC_NV12 && image.format.fourcc != VA_FOURCC_I420
+	&& image.format.fourcc != VA_FOURCC_P010) {
 	Error("video/vaapi: Image format mismatch! (fourcc: 0x%x, planes: %d)", image.format.fourcc, image.num_planes);
 	goto out_destroy;
     }
@@ -1998,7 +2580,14 @@ static uint8_t *VaapiGrabOutputSurfaceYUV(VaapiDecoder * decoder, VASurfaceID sr
 	    uint8_t u, v;
 	    int b, g, r;
 
-	    if (image.format.fourcc == VA_FOURCC_NV12) {
+	    if (image.format.fourcc == VA_FOURCC_P010) {
+		// little endian 16 bit samples, high byte holds the 8 msb
+		unsigned int uv_index = image.offsets[1] + (image.pitches[1] * (j / 2)) + (i / 2) * 4;
+
+		y = image_buffer[j * image.pitches[0] + i * 2 + 1];
+		u = image_buffer[uv_index + 1];
+		v = image_buffer[uv_index + 3];
+	    } else if (image.format.fourcc == VA_FOURCC_NV12) {
 		unsigned int uv_index = image.offsets[1] + (image.pitches[1] * (j / 2)) + (i / 2) * 2;
 
 		u = image_buffer[uv_index];
@@ -2605,6 +3194,43 @@ static void VaapiSetupVideoProcessing(VaapiDecoder * decoder)
     //TODO: Verify that rest of the capabilities are set properly
 }
 
+///
+/// Get the format of the decoded surface data.
+///
+/// @param video_ctx	ffmpeg video codec context
+///
+/// @returns AV_PIX_FMT_P010LE for 10 bit video, AV_PIX_FMT_NV12 otherwise.
+///
+static enum AVPixelFormat VaapiSurfaceFormat(const AVCodecContext * video_ctx)
+{
+    enum AVPixelFormat pix_fmt;
+
+    pix_fmt = video_ctx->pix_fmt;
+    if (video_ctx->hw_frames_ctx) {
+	pix_fmt = TO_AVHW_FRAMES_CTX(video_ctx->hw_frames_ctx)->sw_format;
+    }
+    if (pix_fmt == AV_PIX_FMT_P010LE || pix_fmt == AV_PIX_FMT_YUV420P10LE) {
+	return AV_PIX_FMT_P010LE;
+    }
+    return AV_PIX_FMT_NV12;
+}
+
+///
+/// Get the pixel format of the image used for auto-crop and software
+/// frame upload.
+///
+/// @param decoder  VA-API decoder
+///
+static enum AVPixelFormat VaapiImagePixFmt(const VaapiDecoder * decoder)
+{
+    // hw decoder: auto-crop downloads the decoded surfaces
+    // sw decoder: frames are uploaded into the postproc surfaces
+    if (decoder->PixFmt == AV_PIX_FMT_VAAPI || decoder->SurfaceRtFormat == VA_RT_FORMAT_YUV420_10BPP) {
+	return decoder->SurfaceFmt;
+    }
+    return decoder->PixFmt;
+}
+
 ///
 /// Configure VA-API for new video format.
 ///
@@ -2635,7 +3261,11 @@ static void VaapiSetup(VaapiDecoder * decoder, const AVCodecContext * video_ctx)
     // create initial black surface and display
     VaapiBlackSurface(decoder);
 
-    VaapiFindImageFormat(decoder, decoder->PixFmt, format);
+    decoder->Resolution = VideoResolutionGroup(video_ctx->width, video_ctx->height, decoder->Interlaced);
+    decoder->SurfaceFmt = VaapiSurfaceFormat(video_ctx);
+    VaapiCreateSurfaces(decoder, VideoWindowWidth, VideoWindowHeight);
+
+    VaapiFindImageFormat(decoder, VaapiImagePixFmt(decoder), format);
 
     // FIXME: this image is only needed for software decoder and auto-crop
     if (decoder->GetPutImage
@@ -2646,9 +3276,6 @@ static void VaapiSetup(VaapiDecoder * decoder, const AVCodecContext * video_ctx)
     Debug7("video/vaapi: created image %dx%d with id 0x%08x and buffer id 0x%08x", video_ctx->width, video_ctx->height,
 	decoder->Image->image_id, decoder->Image->buf);
 
-    decoder->Resolution = VideoResolutionGroup(video_ctx->width, video_ctx->height, decoder->Interlaced);
-    VaapiCreateSurfaces(decoder, VideoWindowWidth, VideoWindowHeight);
-
     status = vaCreateConfig(decoder->VaDisplay, VAProfileNone, decoder->VppEntrypoint, NULL, 0, &decoder->VppConfig);
     if (status != VA_STATUS_SUCCESS) {
 	Fatal("video/vaapi: can't create config '%s'", vaErrorStr(status));
@@ -2727,6 +3354,11 @@ static enum AVPixelFormat Vaapi_get_format(VaapiDecoder * decoder, AVCodecContex
     // Prefer VAAPI if found in list
     for (fmt_idx = fmt; *fmt_idx != -1; fmt_idx++) {
 	if (*fmt_idx == AV_PIX_FMT_VAAPI) {
+#ifdef USE_EXTRA_HW_FRAMES
+	    // VaapiGetSurface() hands out the pool round robin, keep the
+	    // queued and the displayed surface out of reuse
+	    video_ctx->extra_hw_frames = VIDEO_SURFACES_MAX;
+#endif
 	    return *fmt_idx;
 	}
     }
@@ -2746,14 +3378,31 @@ static enum AVPixelFormat Vaapi_get_format(VaapiDecoder * decoder, AVCodecContex
 /// @param deinterlaced flag source was deinterlaced
 /// @param top_field_first  flag top_field_first for interlaced source
 /// @param field    interlaced draw: 0 first field, 1 second field
+/// @param unscaled flag surface has input size, it bypassed vpp
 ///
 static void VaapiPutSurfaceX11(VaapiDecoder * decoder, VASurfaceID surface, int interlaced, int deinterlaced,
-    int top_field_first, int field)
+    int top_field_first, int field, int unscaled)
 {
     unsigned type;
     VAStatus status;
     uint32_t s;
     uint32_t e;
+    int crop_x;
+    int crop_y;
+    int crop_width;
+    int crop_height;
+
+    // crop is in vpp output (window) coordinates
+    crop_x = decoder->CropX;
+    crop_y = decoder->CropY;
+    crop_width = decoder->CropWidth;
+    crop_height = decoder->CropHeight;
+    if (unscaled && VideoWindowWidth && VideoWindowHeight) {
+	crop_x = crop_x * decoder->InputWidth / VideoWindowWidth;
+	crop_y = crop_y * decoder->InputHeight / VideoWindowHeight;
+	crop_width = crop_width * decoder->InputWidth / VideoWindowWidth;
+	crop_height = crop_height * decoder->InputHeight / VideoWindowHeight;
+    }
 
     // deinterlace
     if (interlaced && !deinterlaced && VideoDeinterlace[decoder->Resolution] != VAProcDeinterlacingNone) {
@@ -2783,7 +3432,7 @@ static void VaapiPutSurfaceX11(VaapiDecoder * decoder, VASurfaceID surface, int
     }
     if ((status = vaPutSurface(decoder->VaDisplay, surface, decoder->Window,
 		// decoder src
-		decoder->CropX, decoder->CropY, decoder->CropWidth, decoder->CropHeight,
+		crop_x, crop_y, crop_width, crop_height,
 		// video dst
 		decoder->OutputX, decoder->OutputY, decoder->OutputWidth, decoder->OutputHeight, NULL, 0,
 		type | decoder->SurfaceFlagsTable[decoder->Resolution]))
@@ -2827,10 +3476,7 @@ static void VaapiAutoCrop(VaapiDecoder * decoder)
 
 	Debug7("video/vaapi: download image not available");
 
-	// FIXME: PixFmt not set!
-	//VaapiFindImageFormat(decoder, decoder->PixFmt, format);
-	VaapiFindImageFormat(decoder, AV_PIX_FMT_NV12, format);
-	//VaapiFindImageFormat(decoder, AV_PIX_FMT_YUV420P, format);
+	VaapiFindImageFormat(decoder, VaapiImagePixFmt(decoder), format);
 	if (vaCreateImage(VaDisplay, format, width, height, decoder->Image) != VA_STATUS_SUCCESS) {
 	    Error("video/vaapi: can't create image!");
 	    return;
@@ -2863,7 +3509,8 @@ static void VaapiAutoCrop(VaapiDecoder * decoder)
 	pitches[i] = decoder->Image->pitches[i];
     }
 
-    AutoCropDetect(decoder->AutoCrop, width, height, data, pitches);
+    AutoCropDetect(decoder->AutoCrop, width, height, data, pitches,
+	decoder->Image->format.fourcc == VA_FOURCC_P010 ? 2 : 1);
 
     if (vaUnmapBuffer(VaDisplay, decoder->Image->buf) != VA_STATUS_SUCCESS) {
 	Error("video/vaapi: can't unmap auto-crop image!");
@@ -2917,6 +3564,8 @@ static void VaapiAutoCrop(VaapiDecoder * decoder)
 	    break;
     }
 
+    // output geometry is used by the presentation thread
+    pthread_mutex_lock(&VideoPresentMutex);
     decoder->AutoCrop->State = next_state;
     if (next_state) {
 	decoder->CropX = VideoCutLeftRight[decoder->Resolution];
@@ -2951,6 +3600,7 @@ static void VaapiAutoCrop(VaapiDecoder * decoder)
     //
     VaapiDeassociate(decoder);
     VaapiAssociate(decoder);
+    pthread_mutex_unlock(&VideoPresentMutex);
 }
 
 ///
@@ -3046,10 +3696,14 @@ static void VaapiQueueSurface(VaapiDecoder * decoder, VASurfaceID surface, int s
     VASurfaceID old;
     VASurfaceID *firstfield = NULL;
     VASurfaceID *secondfield = NULL;
+    VASurfaceID fields[2];
+    int deinterlaced[2];
+    int i;
 
     ++decoder->FrameCounter;
 
-    if (atomic_read(&decoder->SurfacesFilled) >= VIDEO_SURFACES_MAX - 1) {
+    // interlaced frames need a surface per field
+    if (atomic_read(&decoder->SurfacesFilled) + decoder->Interlaced >= VIDEO_SURFACES_MAX - 1) {
 	++decoder->FramesDropped;
 	Error("video: output buffer full, dropping frame (%d/%d)", decoder->FramesDropped, decoder->FrameCounter);
 	if (!(decoder->FramesDisplayed % 300)) {
@@ -3076,43 +3730,48 @@ static void VaapiQueueSurface(VaapiDecoder * decoder, VASurfaceID surface, int s
 
     /* Queue new surface and run postprocessing filters */
     VaapiQueueSurfaceNew(decoder, surface);
-    firstfield = VaapiApplyFilters(decoder, decoder->TopFieldFirst ? 1 : 0);
-    if (!firstfield) {
-	/* Use unprocessed surface if postprocessing fails */
-	decoder->Deinterlaced = 0;
+    if (VaapiBypassFilters(decoder)) {
+	/* No filter active, display the decoded surface directly */
+	++decoder->FramesBypassed;
 
-	decoder->SurfacesRb[decoder->SurfaceWrite] = surface;
+	fields[0] = decoder->PlaybackSurface;
+	deinterlaced[0] = 0;
+    } else if (!(firstfield = VaapiApplyFilters(decoder, decoder->TopFieldFirst ? 1 : 0, decoder->Deinterlaced))) {
+	/* Use unprocessed surface if postprocessing fails */
+	fields[0] = surface;
+	deinterlaced[0] = 0;
     } else {
-	decoder->Deinterlaced = 1;
-
-	decoder->SurfacesRb[decoder->SurfaceWrite] = *firstfield;
+	fields[0] = *firstfield;
+	deinterlaced[0] = 1;
     }
 
-    /* Queue the first field */
-    decoder->SurfaceWrite = (decoder->SurfaceWrite + 1) % VIDEO_SURFACES_MAX;
-    decoder->SurfaceField = decoder->TopFieldFirst ? 0 : 1;
-    atomic_inc(&decoder->SurfacesFilled);
-
     /* Run postprocessing twice for top & bottom fields */
     if (decoder->Interlaced) {
-	secondfield = VaapiApplyFilters(decoder, decoder->TopFieldFirst ? 0 : 1);
+	secondfield = VaapiApplyFilters(decoder, decoder->TopFieldFirst ? 0 : 1, deinterlaced[0]);
 	if (!secondfield) {
 	    /* Use unprocessed surface if postprocessing fails */
-	    decoder->Deinterlaced = 0;
-
-	    decoder->SurfacesRb[decoder->SurfaceWrite] = surface;
+	    fields[1] = surface;
+	    deinterlaced[1] = 0;
 	} else {
-	    decoder->Deinterlaced = 1;
-
-	    decoder->SurfacesRb[decoder->SurfaceWrite] = *secondfield;
+	    fields[1] = *secondfield;
+	    deinterlaced[1] = 1;
 	}
-	decoder->SurfaceWrite = (decoder->SurfaceWrite + 1) % VIDEO_SURFACES_MAX;
-	decoder->SurfaceField = decoder->TopFieldFirst ? 1 : 0;
-	atomic_inc(&decoder->SurfacesFilled);
     }
 
     pthread_mutex_unlock(&VideoMutex);
 
+    /* Publish the fields, ring state is shared with the presentation thread */
+    pthread_mutex_lock(&VideoPresentMutex);
+    for (i = 0; i < 1 + decoder->Interlaced; ++i) {
+	decoder->Deinterlaced = deinterlaced[i];
+	decoder->SurfacesRb[decoder->SurfaceWrite] = fields[i];
+	decoder->SurfacesUnscaled[decoder->SurfaceWrite] = !deinterlaced[i];
+	decoder->SurfaceWrite = (decoder->SurfaceWrite + 1) % VIDEO_SURFACES_MAX;
+	decoder->SurfaceField = decoder->TopFieldFirst ? i : !i;
+	atomic_inc(&decoder->SurfacesFilled);
+    }
+    pthread_mutex_unlock(&VideoPresentMutex);
+
     Debug8("video/vaapi: yy video surface %#010x ready", surface);
 }
 
@@ -3240,10 +3899,44 @@ static void VaapiBlackSurface(VaapiDecoder * decoder)
     usleep(1 * 1000);
 }
 
+///
+/// Get the derived upload image of a plugin surface.
+///
+/// The images are kept until the next picture change, VaapiCleanup()
+/// destroys them.
+///
+/// @param decoder  VA-API decoder
+/// @param surface  plugin surface to upload to
+///
+/// @returns derived image of the surface, NULL if vaDeriveImage failed.
+///
+static VAImage *VaapiGetUploadImage(VaapiDecoder * decoder, VASurfaceID surface)
+{
+    VaapiUploadImage *free_slot;
+    int i;
+
+    free_slot = NULL;
+    for (i = 0; i < POSTPROC_SURFACES_MAX; ++i) {
+	if (decoder->UploadImages[i].Surface == surface) {
+	    return &decoder->UploadImages[i].Image;
+	}
+	if (!free_slot && decoder->UploadImages[i].Surface == VA_INVALID_ID) {
+	    free_slot = &decoder->UploadImages[i];
+	}
+    }
+    if (!free_slot || surface == VA_INVALID_ID
+	|| vaDeriveImage(decoder->VaDisplay, surface, &free_slot->Image) != VA_STATUS_SUCCESS) {
+	return NULL;
+    }
+    free_slot->Surface = surface;
+
+    return &free_slot->Image;
+}
+
 static int VaapiIsPictureChanged(VaapiDecoder * decoder, const AVCodecContext * video_ctx, const AVFrame * frame)
 {
     if (video_ctx->width != decoder->InputWidth || video_ctx->height != decoder->InputHeight
-	|| video_ctx->pix_fmt != decoder->PixFmt) {
+	|| video_ctx->pix_fmt != decoder->PixFmt || VaapiSurfaceFormat(video_ctx) != decoder->SurfaceFmt) {
 	Debug7("video/vaapi: Picture change detected");
 	return 1;
     }
@@ -3282,6 +3975,9 @@ static void VaapiRenderFrame(VaapiDecoder * decoder, const AVCodecContext * vide
     //
     if (VaapiIsPictureChanged(decoder, video_ctx, frame)) {
 
+	// surfaces are destroyed, wait until presentation is done with them
+	pthread_mutex_lock(&VideoPresentMutex);
+
 	// Cleanup previous VA-API allocations
 	VaapiCleanup(decoder);
 
@@ -3296,6 +3992,8 @@ static void VaapiRenderFrame(VaapiDecoder * decoder, const AVCodecContext * vide
 
 	// Configure VA-API to process new frame
 	VaapiSetup(decoder, video_ctx);
+
+	pthread_mutex_unlock(&VideoPresentMutex);
     }
     // FIXME: some tv-stations toggle interlace on/off
     // frame->interlaced_frame isn't always correct set
@@ -3306,16 +4004,21 @@ static void VaapiRenderFrame(VaapiDecoder * decoder, const AVCodecContext * vide
 
 	Debug7("video/vaapi: interlaced %d top-field-first %d", interlaced, frame->top_field_first);
 
+	pthread_mutex_lock(&VideoPresentMutex);
 	decoder->Interlaced = interlaced;
 	decoder->TopFieldFirst = frame->top_field_first;
 	decoder->SurfaceField = 0;
+	pthread_mutex_unlock(&VideoPresentMutex);
     }
     // update aspect ratio changes
     if (decoder->InputWidth && decoder->InputHeight && av_cmp_q(decoder->InputAspect, frame->sample_aspect_ratio)) {
 	Debug7("video/vaapi: aspect ratio changed");
 
+	// output geometry is used by the presentation thread
+	pthread_mutex_lock(&VideoPresentMutex);
 	decoder->InputAspect = frame->sample_aspect_ratio;
 	VaapiUpdateOutput(decoder);
+	pthread_mutex_unlock(&VideoPresentMutex);
     }
     //
     // Hardware render
@@ -3333,7 +4036,11 @@ static void VaapiRenderFrame(VaapiDecoder * decoder, const AVCodecContext * vide
     } else {
 	void *va_image_data;
 	VAStatus status;
+	VAImage *image;
 	AVFrame picture[1];
+	VideoUploadJob job[1];
+	struct timespec start;
+	int yuv420p;
 
 	Debug8("video/vaapi: hw render sw surface");
 
@@ -3344,72 +4051,112 @@ static void VaapiRenderFrame(VaapiDecoder * decoder, const AVCodecContext * vide
 	surface = VaapiGetPluginSurface(decoder);
 	Debug8("video/vaapi: video surface %#010x displayed", surface);
 
-	if (!decoder->GetPutImage && vaDeriveImage(decoder->VaDisplay, surface, decoder->Image) != VA_STATUS_SUCCESS) {
+	image = decoder->Image;
+	if (!decoder->GetPutImage && !(image = VaapiGetUploadImage(decoder, surface))) {
 	    VAImageFormat format[1];
 
 	    Error("video/vaapi: vaDeriveImage failed");
 
+	    image = decoder->Image;
 	    decoder->GetPutImage = 1;
-	    VaapiFindImageFormat(decoder, decoder->PixFmt, format);
-	    if (vaCreateImage(VaDisplay, format, video_ctx->width, video_ctx->height,
-		    decoder->Image) != VA_STATUS_SUCCESS) {
+	    VaapiFindImageFormat(decoder, VaapiImagePixFmt(decoder), format);
+	    if (vaCreateImage(VaDisplay, format, video_ctx->width, video_ctx->height, image) != VA_STATUS_SUCCESS) {
 		Error("video/vaapi: can't create image!");
 	    }
 	}
 	//
 	//  Copy data from frame to image
 	//
-	if (vaMapBuffer(VaDisplay, decoder->Image->buf, &va_image_data) != VA_STATUS_SUCCESS) {
+	if (vaMapBuffer(VaDisplay, image->buf, &va_image_data) != VA_STATUS_SUCCESS) {
 	    Error("video/vaapi: can't map the image!");
 	}
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	// 8 bit 4:2:0 is uploaded slice parallel
+	yuv420p = frame->format == AV_PIX_FMT_YUV420P || frame->format == AV_PIX_FMT_YUVJ420P;
+	if (yuv420p) {
+	    memset(job, 0, sizeof(*job));
+	    for (int i = 0; i < 3; ++i) {
+		job->Src[i] = frame->data[i];
+		job->SrcPitch[i] = frame->linesize[i];
+	    }
+	    job->Width = video_ctx->width;
+	    job->Height = video_ctx->height;
+	}
 	// crazy: intel mixes YV12 and NV12 with mpeg
-	if (decoder->Image->format.fourcc == VA_FOURCC_NV12) {
-	    // intel NV12 convert YV12 to NV12
-	    struct SwsContext *img_convert_ctx =
-		sws_getContext(video_ctx->width, video_ctx->height, frame->format, video_ctx->width, video_ctx->height,
-		AV_PIX_FMT_NV12, SWS_FAST_BILINEAR, NULL, NULL, NULL);
-
-	    if (img_convert_ctx) {
-		picture->data[0] = va_image_data + decoder->Image->offsets[0];
-		picture->linesize[0] = decoder->Image->pitches[0];
-		picture->data[1] = va_image_data + decoder->Image->offsets[1];
-		picture->linesize[1] = decoder->Image->pitches[1];
-		picture->data[2] = va_image_data + decoder->Image->offsets[2];
-		picture->linesize[2] = decoder->Image->pitches[2];
-		sws_scale(img_convert_ctx, (const uint8_t * const *)frame->data, frame->linesize, 0, video_ctx->height,
+	if (image->format.fourcc == VA_FOURCC_NV12 && yuv420p) {
+	    job->Dst[0] = va_image_data + image->offsets[0];
+	    job->DstPitch[0] = image->pitches[0];
+	    job->Dst[1] = va_image_data + image->offsets[1];
+	    job->DstPitch[1] = image->pitches[1];
+	    job->Nv12 = 1;
+	    VideoUpload(job);
+	} else if (image->format.fourcc == VA_FOURCC_NV12 || image->format.fourcc == VA_FOURCC_P010) {
+	    // intel NV12 convert YV12 to NV12, context is kept until picture change
+	    // 10 bit frames are converted to P010 for 10 bit postproc surfaces
+	    decoder->SwsCtx =
+		sws_getCachedContext(decoder->SwsCtx, video_ctx->width, video_ctx->height, frame->format,
+		video_ctx->width, video_ctx->height,
+		image->format.fourcc == VA_FOURCC_P010 ? AV_PIX_FMT_P010LE : AV_PIX_FMT_NV12, SWS_FAST_BILINEAR, NULL,
+		NULL, NULL);
+
+	    if (decoder->SwsCtx) {
+		picture->data[0] = va_image_data + image->offsets[0];
+		picture->linesize[0] = image->pitches[0];
+		picture->data[1] = va_image_data + image->offsets[1];
+		picture->linesize[1] = image->pitches[1];
+		picture->data[2] = va_image_data + image->offsets[2];
+		picture->linesize[2] = image->pitches[2];
+		sws_scale(decoder->SwsCtx, (const uint8_t * const *)frame->data, frame->linesize, 0, video_ctx->height,
 		    picture->data, picture->linesize);
-		sws_freeContext(img_convert_ctx);
 	    } else {
 		Error("video/vaapi: can't create context for image conversion!");
 	    }
-	} else if (decoder->Image->format.fourcc == VA_FOURCC_I420) {
-	    picture->data[0] = va_image_data + decoder->Image->offsets[0];
-	    picture->linesize[0] = decoder->Image->pitches[0];
-	    picture->data[1] = va_image_data + decoder->Image->offsets[1];
-	    picture->linesize[1] = decoder->Image->pitches[2];
-	    picture->data[2] = va_image_data + decoder->Image->offsets[2];
-	    picture->linesize[2] = decoder->Image->pitches[1];
+	} else if (image->format.fourcc == VA_FOURCC_I420 && yuv420p) {
+	    for (int i = 0; i < 3; ++i) {
+		job->Dst[i] = va_image_data + image->offsets[i];
+		job->DstPitch[i] = image->pitches[i];
+	    }
+	    VideoUpload(job);
+	} else if (image->num_planes == 3 && image->format.fourcc != VA_FOURCC_I420 && yuv420p) {
+	    // YV12: v before u
+	    job->Dst[0] = va_image_data + image->offsets[0];
+	    job->DstPitch[0] = image->pitches[0];
+	    job->Dst[1] = va_image_data + image->offsets[2];
+	    job->DstPitch[1] = image->pitches[2];
+	    job->Dst[2] = va_image_data + image->offsets[1];
+	    job->DstPitch[2] = image->pitches[1];
+	    VideoUpload(job);
+	} else if (image->format.fourcc == VA_FOURCC_I420) {
+	    picture->data[0] = va_image_data + image->offsets[0];
+	    picture->linesize[0] = image->pitches[0];
+	    picture->data[1] = va_image_data + image->offsets[1];
+	    picture->linesize[1] = image->pitches[2];
+	    picture->data[2] = va_image_data + image->offsets[2];
+	    picture->linesize[2] = image->pitches[1];
 
 	    av_image_copy(picture->data, picture->linesize, (const uint8_t **)frame->data, frame->linesize,
 		video_ctx->pix_fmt, video_ctx->width, video_ctx->height);
-	} else if (decoder->Image->num_planes == 3) {
-	    picture->data[0] = va_image_data + decoder->Image->offsets[0];
-	    picture->linesize[0] = decoder->Image->pitches[0];
-	    picture->data[1] = va_image_data + decoder->Image->offsets[2];
-	    picture->linesize[1] = decoder->Image->pitches[2];
-	    picture->data[2] = va_image_data + decoder->Image->offsets[1];
-	    picture->linesize[2] = decoder->Image->pitches[1];
+	} else if (image->num_planes == 3) {
+	    picture->data[0] = va_image_data + image->offsets[0];
+	    picture->linesize[0] = image->pitches[0];
+	    picture->data[1] = va_image_data + image->offsets[2];
+	    picture->linesize[1] = image->pitches[2];
+	    picture->data[2] = va_image_data + image->offsets[1];
+	    picture->linesize[2] = image->pitches[1];
 
 	    av_image_copy(picture->data, picture->linesize, (const uint8_t **)frame->data, frame->linesize,
 		video_ctx->pix_fmt, video_ctx->width, video_ctx->height);
 	}
 
-	if (vaUnmapBuffer(VaDisplay, decoder->Image->buf) != VA_STATUS_SUCCESS) {
+	// FIXME: 5ms is a guess, about a quarter of a 50Hz frame
+	VideoLatencyUpdate(&VideoUploadLatency, &start, 5 * 1000);
+
+	if (vaUnmapBuffer(VaDisplay, image->buf) != VA_STATUS_SUCCESS) {
 	    Error("video/vaapi: can't unmap the image!");
 	}
 
-	Debug8("video/vaapi: buffer %dx%d <- %dx%d", decoder->Image->width, decoder->Image->height, video_ctx->width,
-	    video_ctx->height);
+	Debug8("video/vaapi: buffer %dx%d <- %dx%d", image->width, image->height, video_ctx->width, video_ctx->height);
 
 	if (decoder->GetPutImage
 	    && (status =
@@ -3418,13 +4165,6 @@ static void VaapiRenderFrame(VaapiDecoder * decoder, const AVCodecContext * vide
 	    Error("video/vaapi: can't put image err:%s!", vaErrorStr(status));
 	}
 
-	if (!decoder->GetPutImage) {
-	    if (vaDestroyImage(VaDisplay, decoder->Image->image_id) != VA_STATUS_SUCCESS) {
-		Error("video/vaapi: can't destroy image!");
-	    }
-	    decoder->Image->image_id = VA_INVALID_ID;
-	}
-
 	VaapiQueueSurface(decoder, surface, 1);
     }
 
@@ -3471,9 +4211,7 @@ static void VaapiAdvanceDecoderFrame(VaapiDecoder * decoder)
 ///
 static void VaapiDisplayFrame(void)
 {
-#ifdef DEBUG
-    uint32_t start;
-#endif
+    struct timespec start;
     struct timespec nowtime;
     VaapiDecoder *decoder;
 
@@ -3506,17 +4244,19 @@ static void VaapiDisplayFrame(void)
 	    Debug8("video/vaapi: invalid surface in ringbuffer");
 	}
 	Debug8("video/vaapi: yy video surface %#010x displayed", surface);
-	start = GetMsTicks();
 #endif
+	clock_gettime(CLOCK_MONOTONIC, &start);
 	VaapiPutSurfaceX11(decoder, surface, decoder->Interlaced, decoder->Deinterlaced, decoder->TopFieldFirst,
-	    decoder->SurfaceField);
-#ifdef DEBUG
-	Debug8("video/vaapi: put %2ums", GetMsTicks() - start);
-#endif
+	    decoder->SurfaceField, decoder->SurfacesUnscaled[decoder->SurfaceRead]);
+	// deadline misses are accounted by frame distance below
+	VideoLatencyUpdate(&VideoPresentLatency, &start, UINT32_MAX);
+	Debug8("video/vaapi: put %2uus", VideoPresentLatency.Last);
+
 	clock_gettime(CLOCK_MONOTONIC, &nowtime);
 	// FIXME: 31 only correct for 50Hz
 	if ((nowtime.tv_sec - decoder->FrameTime.tv_sec)
 	    * 1000 * 1000 * 1000 + (nowtime.tv_nsec - decoder->FrameTime.tv_nsec) > 31 * 1000 * 1000) {
+	    VideoPresentLatency.Late++;
 	    // FIXME: ignore still-frame, trick-speed
 	    Debug7("video/vaapi: time/frame too long %ldms", ((nowtime.tv_sec - decoder->FrameTime.tv_sec)
 		    * 1000 * 1000 * 1000 + (nowtime.tv_nsec - decoder->FrameTime.tv_nsec)) / (1000 * 1000));
@@ -3597,16 +4337,26 @@ static void VaapiSetTrickSpeed(VaapiDecoder * decoder, int speed)
 ///
 char *VaapiGetStats(VaapiDecoder * decoder)
 {
-    char buffer[255];
+    char buffer[512];
     int64_t audio_clock = AudioGetClock();
     int64_t video_clock = VaapiGetClock(decoder);
+    const VideoLatency *dec = &VideoDecodeLatency;
+    const VideoLatency *pre = &VideoPresentLatency;
+    const VideoLatency *vpp = VideoVppLatency;
+    const VideoLatency *up = &VideoUploadLatency;
 
     if (snprintf(&buffer[0], sizeof(buffer),
 	    " Frames: missed(%d) duped(%d) dropped(%d) total(%d) PTS(%s) drift(%" PRId64 ") audio(%" PRId64 ") video(%"
-	    PRId64 ")", decoder->FramesMissed, decoder->FramesDuped, decoder->FramesDropped, decoder->FrameCounter,
+	    PRId64 ") Latency: decode(%" PRIu64 "/%uus late %u) present(%" PRIu64 "/%uus late %u) upload(%" PRIu64
+	    "/%uus late %u) VPP: main(%" PRIu64 "/%uus) sharpen(%" PRIu64 "/%uus) sharpen-passes(%u/%u) bypass(%d)",
+	    decoder->FramesMissed, decoder->FramesDuped, decoder->FramesDropped, decoder->FrameCounter,
 	    Timestamp2String(video_clock),
 	    abs((video_clock - audio_clock) / 90) < 8888 ? ((video_clock - audio_clock) / 90) : 8888,
-	    AudioGetDelay() / 90, VideoDeltaPTS / 90)) {
+	    AudioGetDelay() / 90, VideoDeltaPTS / 90, dec->Count ? dec->Sum / dec->Count : 0, dec->Max, dec->Late,
+	    pre->Count ? pre->Sum / pre->Count : 0, pre->Max, pre->Late, up->Count ? up->Sum / up->Count : 0, up->Max,
+	    up->Late, vpp[0].Count ? vpp[0].Sum / vpp[0].Count : 0, vpp[0].Max,
+	    vpp[1].Count ? vpp[1].Sum / vpp[1].Count : 0, vpp[1].Max, VideoSharpenPasses[0], VideoSharpenPasses[1],
+	    decoder->FramesBypassed)) {
 	return strdup(buffer);
     }
 
@@ -3766,8 +4516,9 @@ static void VaapiSyncDecoder(VaapiDecoder * decoder)
 		decoder->FrameCounter, VideoGetBuffers(decoder->Stream));
 	    // some time no new picture
 	    if (decoder->Closing < -300) {
-		// clear ring buffer to trigger black picture
-		atomic_set(&decoder->SurfacesFilled, 0);
+		// consume last surface to trigger black picture
+		decoder->SurfaceRead = (decoder->SurfaceRead + 1) % VIDEO_SURFACES_MAX;
+		atomic_dec(&decoder->SurfacesFilled);
 	    }
 	}
 	goto out;
@@ -3847,6 +4598,17 @@ static void VaapiSyncRenderFrame(VaapiDecoder * decoder, const AVCodecContext *
     VaapiCheckAutoCrop(decoder);
 }
 
+///
+/// Get number of frames the output ring buffer can still take.
+///
+/// @param decoder  VA-API decoder
+///
+static int VaapiGetFreeFrames(const VaapiDecoder * decoder)
+{
+    // interlaced frames take one surface per field
+    return (VIDEO_SURFACES_MAX - 1 - atomic_read(&decoder->SurfacesFilled)) / (1 + decoder->Interlaced);
+}
+
 ///
 /// Set VA-API background color.
 ///
@@ -3895,18 +4657,20 @@ static void VaapiSetOutputPosition(VaapiDecoder * decoder, int x, int y, int wid
 }
 
 ///
-/// Handle a va-api display.
+/// Handle va-api decoding.
+///
+/// Fills the output ring buffers of all decoders, the surfaces are
+/// consumed by VaapiPresentHandlerThread().
 ///
 static void VaapiDisplayHandlerThread(void)
 {
     int i;
     int err;
-    int allfull;
     int decoded;
-    struct timespec nowtime;
+    struct timespec start;
+    struct timespec deadline;
     VaapiDecoder *decoder;
 
-    allfull = 1;
     decoded = 0;
     pthread_mutex_lock(&VideoLockMutex);
     for (i = 0; i < VaapiDecoderN; ++i) {
@@ -3919,10 +4683,13 @@ static void VaapiDisplayHandlerThread(void)
 	//
 	filled = atomic_read(&decoder->SurfacesFilled);
 	if (filled < VIDEO_SURFACES_MAX - 1) {
-	    // FIXME: hot polling
 	    // fetch+decode or reopen
-	    allfull = 0;
+	    clock_gettime(CLOCK_MONOTONIC, &start);
 	    err = VideoDecodeInput(decoder->Stream);
+	    if (!err) {
+		// FIXME: 20ms only correct for 50Hz
+		VideoLatencyUpdate(&VideoDecodeLatency, &start, 20 * 1000);
+	    }
 	} else {
 	    err = VideoPollInput(decoder->Stream);
 	}
@@ -3943,23 +4710,60 @@ static void VaapiDisplayHandlerThread(void)
     pthread_mutex_unlock(&VideoLockMutex);
 
     if (!decoded) {			// nothing decoded, sleep
-	// FIXME: sleep on wakeup
-	usleep(1 * 1000);
+	// until new packet or a surface is presented
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_nsec += 20 * 1000 * 1000;
+	if (deadline.tv_nsec >= 1000 * 1000 * 1000) {
+	    deadline.tv_sec++;
+	    deadline.tv_nsec -= 1000 * 1000 * 1000;
+	}
+	VideoThreadWait(&deadline);
+    }
+}
+
+///
+/// Handle va-api presentation.
+///
+/// Displays and syncs the surfaces queued by VaapiDisplayHandlerThread().
+///
+static void VaapiPresentHandlerThread(void)
+{
+    int i;
+    int allfull;
+    struct timespec deadline;
+
+    pthread_mutex_lock(&VideoPresentMutex);
+    allfull = VaapiDecoderN > 0;
+    for (i = 0; i < VaapiDecoderN; ++i) {
+	if (atomic_read(&VaapiDecoders[i]->SurfacesFilled) < VIDEO_SURFACES_MAX - 1) {
+	    allfull = 0;
+	}
+    }
+    if (VaapiDecoderN) {
+	deadline = VaapiDecoders[0]->FrameTime;
+	deadline.tv_nsec += 15 * 1000 * 1000;
+    } else {
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_nsec += 20 * 1000 * 1000;
     }
-    // all decoder buffers are full
-    // speed up filling display queue, wait on display queue empty
+    pthread_mutex_unlock(&VideoPresentMutex);
+
+    // all decoder buffers are full, display queue can be emptied now.
+    // otherwise wait for the time of one frame
     if (!allfull) {
-	clock_gettime(CLOCK_MONOTONIC, &nowtime);
-	// time for one frame over?
-	if ((nowtime.tv_sec - VaapiDecoders[0]->FrameTime.tv_sec) * 1000 * 1000 * 1000 + (nowtime.tv_nsec -
-		VaapiDecoders[0]->FrameTime.tv_nsec) < 15 * 1000 * 1000) {
-	    return;
+	if (deadline.tv_nsec >= 1000 * 1000 * 1000) {
+	    deadline.tv_sec++;
+	    deadline.tv_nsec -= 1000 * 1000 * 1000;
 	}
+	clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL);
     }
 
-    pthread_mutex_lock(&VideoLockMutex);
+    pthread_mutex_lock(&VideoPresentMutex);
     VaapiSyncDisplayFrame();
-    pthread_mutex_unlock(&VideoLockMutex);
+    pthread_mutex_unlock(&VideoPresentMutex);
+
+    // surfaces are free again, decoder can continue
+    VideoDisplayWakeup();
 }
 
 //----------------------------------------------------------------------------
@@ -4097,6 +4901,7 @@ static const VideoModule VaapiModule = {
     .get_format =
 	(enum AVPixelFormat(*const) (VideoHwDecoder *, AVCodecContext *, const enum AVPixelFormat *))Vaapi_get_format,
     .RenderFrame = (void (*const) (VideoHwDecoder *, const AVCodecContext *, const AVFrame *))VaapiSyncRenderFrame,
+    .GetFreeFrames = (int (*const) (const VideoHwDecoder *))VaapiGetFreeFrames,
     .SetClock = (void (*const) (VideoHwDecoder *, int64_t))VaapiSetClock,
     .GetClock = (int64_t(*const) (const VideoHwDecoder *))VaapiGetClock,
     .SetClosing = (void (*const) (const VideoHwDecoder *))VaapiSetClosing,
@@ -4109,6 +4914,7 @@ static const VideoModule VaapiModule = {
     .SetVideoMode = VaapiSetVideoMode,
     .ResetAutoCrop = VaapiResetAutoCrop,
     .DisplayHandlerThread = VaapiDisplayHandlerThread,
+    .PresentHandlerThread = VaapiPresentHandlerThread,
     .OsdClear = VaapiOsdClear,
     .OsdDrawARGB = VaapiOsdDrawARGB,
     .OsdInit = VaapiOsdInit,
@@ -4243,45 +5049,616 @@ static const VideoModule NoopModule = {
 };
 
 //----------------------------------------------------------------------------
-//  OSD
+//  NULL
 //----------------------------------------------------------------------------
 
+#define NULL_TIMING_MAX	(16 * 1024)	///< per-frame timing records kept in memory
+
 ///
-/// Clear the OSD.
+/// Null module per-frame timing record.
 ///
-/// @todo I use glTexImage2D to clear the texture, are there faster and
-/// better ways to clear a texture?
+typedef struct _null_frame_timing_
+{
+    int64_t PTS;			///< presentation timestamp of the frame
+    uint64_t Rendered;			///< time frame left the decoder in us
+    uint32_t Queued;			///< time from decoder to display in us, 0 dropped
+    uint32_t Interval;			///< time since last displayed frame in us
+    int AVDiff;				///< video - audio clock at display in ms
+} NullFrameTiming;
+
+    /// Null decoder typedef
+typedef struct _null_decoder_ NullDecoder;
+
 ///
-void VideoOsdClear(void)
+/// Null decoder.
+///
+/// Runs decoding, a/v sync and frame pacing without x11 and gpu, the
+/// displayed frames are only accounted.
+///
+struct _null_decoder_
 {
-    VideoThreadLock();
-    VideoUsedModule->OsdClear();
+    VideoStream *Stream;		///< video stream
+    int Width;				///< video input width
+    int Height;				///< video input height
+    AVRational InputAspect;		///< video input aspect ratio
+    int Interlaced;			///< ffmpeg interlaced flag
 
-    OsdDirtyX = VideoWindowWidth;	// reset dirty area
-    OsdDirtyY = VideoWindowHeight;
-    OsdDirtyWidth = 0;
-    OsdDirtyHeight = 0;
-    OsdShown = 0;
+    /// decoded frame ring buffer
+    NullFrameTiming FramesRb[VIDEO_SURFACES_MAX];
+    int FrameWrite;			///< write pointer
+    int FrameRead;			///< read pointer
+    atomic_t FramesFilled;		///< how many of the buffer is used
 
-    VideoThreadUnlock();
-}
+    int TrickSpeed;			///< current trick speed
+    int TrickCounter;			///< current trick speed counter
+    struct timespec FrameTime;		///< time of last display
+    uint64_t LastDisplayed;		///< time of last displayed frame in us
+    int Closing;			///< flag about closing current stream
+    int64_t PTS;			///< video PTS clock
+
+    int StartCounter;			///< counter for video start
+    int FramesDuped;			///< number of frames duplicated
+    int FramesDropped;			///< number of frames dropped
+    int FrameCounter;			///< number of frames decoded
+    int FramesDisplayed;		///< number of frames displayed
+
+    NullFrameTiming *Timing;		///< per-frame timing records
+    unsigned TimingN;			///< number of recorded frames
+};
+
+static NullDecoder *NullActiveDecoder;	///< the only null decoder
 
 ///
-/// Draw an OSD ARGB image.
-///
-/// @param xi	x-coordinate in argb image
-/// @param yi	y-coordinate in argb image
-/// @paran height   height in pixel in argb image
-/// @paran width    width in pixel in argb image
-/// @param pitch    pitch of argb image
-/// @param argb 32bit ARGB image data
-/// @param x	x-coordinate on screen of argb image
-/// @param y	y-coordinate on screen of argb image
+/// Get current CLOCK_MONOTONIC time in us.
 ///
-void VideoOsdDrawARGB(int xi, int yi, int width, int height, int pitch, const uint8_t * argb, int x, int y)
+static uint64_t NullGetUs(void)
 {
-    VideoThreadLock();
-    // update dirty area
+    struct timespec nowtime;
+
+    clock_gettime(CLOCK_MONOTONIC, &nowtime);
+    return (uint64_t) nowtime.tv_sec * 1000 * 1000 + nowtime.tv_nsec / 1000;
+}
+
+///
+/// Allocate new null decoder.
+///
+/// @param stream   video stream
+///
+/// @returns a new prepared null hardware decoder.
+///
+static NullDecoder *NullNewHwDecoder(VideoStream * stream)
+{
+    NullDecoder *decoder;
+
+    if (NullActiveDecoder) {
+	Error("video/null: out of decoders");
+	return NULL;
+    }
+    if (!(decoder = calloc(1, sizeof(*decoder)))
+	|| !(decoder->Timing = calloc(NULL_TIMING_MAX, sizeof(*decoder->Timing)))) {
+	Error("video/null: out of memory");
+	free(decoder);
+	return NULL;
+    }
+    decoder->Stream = stream;
+    decoder->PTS = AV_NOPTS_VALUE;
+    atomic_set(&decoder->FramesFilled, 0);
+
+    NullActiveDecoder = decoder;
+    return decoder;
+}
+
+///
+/// Calculate summary of the recorded frame timings.
+///
+/// @param decoder  null decoder
+/// @param[out] buffer	summary text
+/// @param size	size of buffer
+///
+static int NullTimingSummary(const NullDecoder * decoder, char *buffer, size_t size)
+{
+    unsigned n;
+    unsigned displayed;
+    uint64_t queued_sum;
+    uint64_t interval_sum;
+    uint64_t diff_sum;
+    uint32_t queued_max;
+    uint32_t interval_max;
+    int diff_max;
+
+    displayed = 0;
+    queued_sum = interval_sum = diff_sum = 0;
+    queued_max = interval_max = 0;
+    diff_max = 0;
+    n = decoder->TimingN < NULL_TIMING_MAX ? decoder->TimingN : NULL_TIMING_MAX;
+    for (unsigned i = 0; i < n; ++i) {
+	const NullFrameTiming *timing = &decoder->Timing[i];
+
+	if (!timing->Queued) {		// dropped
+	    continue;
+	}
+	++displayed;
+	queued_sum += timing->Queued;
+	interval_sum += timing->Interval;
+	diff_sum += abs(timing->AVDiff);
+	if (timing->Queued > queued_max) {
+	    queued_max = timing->Queued;
+	}
+	if (timing->Interval > interval_max) {
+	    interval_max = timing->Interval;
+	}
+	if (abs(timing->AVDiff) > diff_max) {
+	    diff_max = abs(timing->AVDiff);
+	}
+    }
+    if (!displayed) {
+	displayed = 1;
+    }
+
+    return snprintf(buffer, size,
+	" Timing(last %u): queue(%" PRIu64 "/%uus) interval(%" PRIu64 "/%uus) av-diff(%" PRIu64 "/%dms)", n,
+	queued_sum / displayed, queued_max, interval_sum / displayed, interval_max, diff_sum / displayed, diff_max);
+}
+
+///
+/// Destroy a null decoder.
+///
+/// @param decoder  null decoder
+///
+static void NullDelHwDecoder(NullDecoder * decoder)
+{
+    char buffer[255];
+
+    // remove decoder from the presentation thread
+    pthread_mutex_lock(&VideoPresentMutex);
+    if (NullActiveDecoder == decoder) {
+	NullActiveDecoder = NULL;
+    }
+    pthread_mutex_unlock(&VideoPresentMutex);
+
+    NullTimingSummary(decoder, buffer, sizeof(buffer));
+    Info("video/null: %d frames, %d displayed, %d duped, %d dropped%s", decoder->FrameCounter,
+	decoder->FramesDisplayed, decoder->FramesDuped, decoder->FramesDropped, buffer);
+
+    free(decoder->Timing);
+    free(decoder);
+}
+
+///
+/// Callback to negotiate the PixelFormat.
+///
+/// Only software formats are used, there is no hw device context.
+///
+/// @param decoder  null decoder
+/// @param video_ctx	ffmpeg video codec context
+/// @param fmt	is the list of formats which are supported by the codec
+///
+static enum AVPixelFormat Null_get_format( __attribute__ ((unused)) NullDecoder * decoder,
+    AVCodecContext * video_ctx, const enum AVPixelFormat *fmt)
+{
+    return avcodec_default_get_format(video_ctx, fmt);
+}
+
+///
+/// Queue a decoded frame.
+///
+/// @param decoder  null decoder
+/// @param video_ctx	ffmpeg video codec context
+/// @param frame    frame to display
+///
+static void NullRenderFrame(NullDecoder * decoder, const AVCodecContext * video_ctx, const AVFrame * frame)
+{
+    NullFrameTiming *timing;
+
+    ++decoder->FrameCounter;
+    if (atomic_read(&decoder->FramesFilled) >= VIDEO_SURFACES_MAX - 1) {
+	++decoder->FramesDropped;
+	Error("video: output buffer full, dropping frame (%d/%d)", decoder->FramesDropped, decoder->FrameCounter);
+	return;
+    }
+
+    decoder->Width = frame->width;
+    decoder->Height = frame->height;
+    decoder->InputAspect = frame->sample_aspect_ratio;
+    decoder->Interlaced = frame->interlaced_frame;
+    if (!decoder->Closing) {
+	VideoSetPts(&decoder->PTS, decoder->Interlaced, video_ctx, frame);
+    }
+
+    timing = &decoder->FramesRb[decoder->FrameWrite];
+    timing->PTS = decoder->PTS;
+    timing->Rendered = NullGetUs();
+    decoder->FrameWrite = (decoder->FrameWrite + 1) % VIDEO_SURFACES_MAX;
+    atomic_inc(&decoder->FramesFilled);
+}
+
+///
+/// Get number of frames the output ring buffer can still take.
+///
+/// @param decoder  null decoder
+///
+static int NullGetFreeFrames(const NullDecoder * decoder)
+{
+    return VIDEO_SURFACES_MAX - 1 - atomic_read(&decoder->FramesFilled);
+}
+
+///
+/// Remove the oldest frame from the ring buffer and record its timing.
+///
+/// @param decoder  null decoder
+/// @param displayed	flag frame is displayed and not dropped
+/// @param now	current time in us
+/// @param diff video - audio clock difference in ms
+///
+static void NullAdvanceFrame(NullDecoder * decoder, int displayed, uint64_t now, int diff)
+{
+    NullFrameTiming *timing;
+
+    timing = &decoder->Timing[decoder->TimingN++ % NULL_TIMING_MAX];
+    *timing = decoder->FramesRb[decoder->FrameRead];
+    timing->Queued = 0;
+    timing->Interval = 0;
+    timing->AVDiff = diff;
+    if (displayed) {
+	// 0 marks dropped frames
+	timing->Queued = now > timing->Rendered ? now - timing->Rendered : 1;
+	timing->Interval = decoder->LastDisplayed ? now - decoder->LastDisplayed : 0;
+	decoder->LastDisplayed = now;
+    }
+
+    decoder->FrameRead = (decoder->FrameRead + 1) % VIDEO_SURFACES_MAX;
+    atomic_dec(&decoder->FramesFilled);
+}
+
+///
+/// Set null decoder video clock.
+///
+/// @param decoder  null decoder
+/// @param pts	presentation timestamp
+///
+static void NullSetClock(NullDecoder * decoder, int64_t pts)
+{
+    decoder->PTS = pts;
+}
+
+///
+/// Get null decoder video clock.
+///
+/// @param decoder  null decoder
+///
+static int64_t NullGetClock(const NullDecoder * decoder)
+{
+    if (decoder->PTS == (int64_t) AV_NOPTS_VALUE) {
+	return AV_NOPTS_VALUE;
+    }
+    // pts is the timestamp of the latest decoded frame
+    return decoder->PTS - 20 * 90 * atomic_read(&decoder->FramesFilled);
+}
+
+///
+/// Set null decoder closing stream flag.
+///
+/// @param decoder  null decoder
+///
+static void NullSetClosing(NullDecoder * decoder)
+{
+    decoder->Closing = 1;
+}
+
+///
+/// Reset start of frame counter.
+///
+/// @param decoder  null decoder
+///
+static void NullResetStart(NullDecoder * decoder)
+{
+    decoder->StartCounter = 0;
+}
+
+///
+/// Set trick play speed.
+///
+/// @param decoder  null decoder
+/// @param speed    trick speed (0 = normal)
+///
+static void NullSetTrickSpeed(NullDecoder * decoder, int speed)
+{
+    decoder->TrickSpeed = speed;
+    decoder->TrickCounter = speed;
+}
+
+///
+/// Get null decoder statistics.
+///
+/// @param decoder  null decoder
+///
+static char *NullGetStats(NullDecoder * decoder)
+{
+    char buffer[512];
+    const VideoLatency *dec;
+    int n;
+
+    dec = &VideoDecodeLatency;
+    n = snprintf(buffer, sizeof(buffer),
+	" Frames: duped(%d) dropped(%d) total(%d) displayed(%d) Latency: decode(%" PRIu64 "/%uus late %u)",
+	decoder->FramesDuped, decoder->FramesDropped, decoder->FrameCounter, decoder->FramesDisplayed,
+	dec->Count ? dec->Sum / dec->Count : 0, dec->Max, dec->Late);
+    pthread_mutex_lock(&VideoPresentMutex);
+    NullTimingSummary(decoder, buffer + n, sizeof(buffer) - n);
+    pthread_mutex_unlock(&VideoPresentMutex);
+
+    return strdup(buffer);
+}
+
+///
+/// Get null decoder info.
+///
+/// @param decoder  null decoder
+/// @param codec_name Video codec name
+///
+static char *NullGetInfo(NullDecoder * decoder, const char *codec_name)
+{
+    char buffer[255];
+
+    if (snprintf(buffer, sizeof(buffer), " Video: null %s %dx%d%s", codec_name, decoder->Width, decoder->Height,
+	    decoder->Interlaced ? "i" : "p")) {
+	return strdup(buffer);
+    }
+    return NULL;
+}
+
+///
+/// Sync and display a frame.
+///
+/// Same a/v sync limits as VaapiSyncDecoder(), without 60Hz mode and
+/// soft start.
+///
+/// @param decoder  null decoder
+///
+static void NullSyncDisplayFrame(NullDecoder * decoder)
+{
+    int filled;
+    int diff;
+    uint64_t now;
+    int64_t audio_clock;
+    int64_t video_clock;
+
+    now = NullGetUs();
+    clock_gettime(CLOCK_MONOTONIC, &decoder->FrameTime);
+    decoder->FramesDisplayed++;
+    decoder->StartCounter++;
+
+    filled = atomic_read(&decoder->FramesFilled);
+    if (!filled) {			// nothing to display
+	if (decoder->Stream && VideoGetBuffers(decoder->Stream) && !decoder->Closing) {
+	    ++decoder->FramesDuped;
+	}
+	return;
+    }
+    // trick speed shows every frame multiple times
+    if (decoder->TrickSpeed) {
+	if (decoder->TrickCounter--) {
+	    return;
+	}
+	decoder->TrickCounter = decoder->TrickSpeed;
+	NullAdvanceFrame(decoder, 1, now, 0);
+	return;
+    }
+
+    diff = 0;
+    audio_clock = AudioGetClock();
+    video_clock = NullGetClock(decoder);
+    if (audio_clock != (int64_t) AV_NOPTS_VALUE && video_clock != (int64_t) AV_NOPTS_VALUE) {
+	diff = video_clock - audio_clock - VideoAudioDelay;
+	if (abs(diff) > 5000 * 90) {	// more than 5s, ignore
+	    diff = 0;
+	} else if (diff > 55 * 90) {	// slow down video
+	    ++decoder->FramesDuped;
+	    return;
+	} else if (diff < -25 * 90 && filled > 1) {
+	    // speed up video
+	    ++decoder->FramesDropped;
+	    NullAdvanceFrame(decoder, 0, now, diff / 90);
+	}
+    }
+    NullAdvanceFrame(decoder, 1, now, diff / 90);
+}
+
+///
+/// Handle null decoding.
+///
+static void NullDisplayHandlerThread(void)
+{
+    int err;
+    int decoded;
+    struct timespec start;
+    struct timespec deadline;
+    NullDecoder *decoder;
+
+    decoded = 0;
+    pthread_mutex_lock(&VideoLockMutex);
+    if ((decoder = NullActiveDecoder)) {
+	if (atomic_read(&decoder->FramesFilled) < VIDEO_SURFACES_MAX - 1) {
+	    clock_gettime(CLOCK_MONOTONIC, &start);
+	    err = VideoDecodeInput(decoder->Stream);
+	    if (!err) {
+		VideoLatencyUpdate(&VideoDecodeLatency, &start, 20 * 1000);
+	    }
+	} else {
+	    err = VideoPollInput(decoder->Stream);
+	}
+	decoded = !err;
+    }
+    pthread_mutex_unlock(&VideoLockMutex);
+
+    if (!decoded) {			// nothing decoded, sleep
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_nsec += 20 * 1000 * 1000;
+	if (deadline.tv_nsec >= 1000 * 1000 * 1000) {
+	    deadline.tv_sec++;
+	    deadline.tv_nsec -= 1000 * 1000 * 1000;
+	}
+	VideoThreadWait(&deadline);
+    }
+}
+
+///
+/// Handle null presentation.
+///
+/// Paces frames like a 50Hz display.
+///
+static void NullPresentHandlerThread(void)
+{
+    struct timespec deadline;
+
+    if (VideoNullFreeRun) {		// display frames as fast as decoded
+	int displayed;
+
+	displayed = 0;
+	pthread_mutex_lock(&VideoPresentMutex);
+	if (NullActiveDecoder) {
+	    uint64_t now;
+
+	    now = NullGetUs();
+	    while (atomic_read(&NullActiveDecoder->FramesFilled)) {
+		++NullActiveDecoder->FramesDisplayed;
+		NullAdvanceFrame(NullActiveDecoder, 1, now, 0);
+		++displayed;
+	    }
+	}
+	pthread_mutex_unlock(&VideoPresentMutex);
+
+	if (displayed) {
+	    VideoDisplayWakeup();
+	} else {
+	    usleep(1 * 1000);
+	}
+	return;
+    }
+
+    pthread_mutex_lock(&VideoPresentMutex);
+    if (NullActiveDecoder) {
+	deadline = NullActiveDecoder->FrameTime;
+    } else {
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+    }
+    pthread_mutex_unlock(&VideoPresentMutex);
+
+    // FIXME: 20ms only correct for 50Hz
+    deadline.tv_nsec += 20 * 1000 * 1000;
+    if (deadline.tv_nsec >= 1000 * 1000 * 1000) {
+	deadline.tv_sec++;
+	deadline.tv_nsec -= 1000 * 1000 * 1000;
+    }
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL);
+
+    pthread_mutex_lock(&VideoPresentMutex);
+    if (NullActiveDecoder) {
+	NullSyncDisplayFrame(NullActiveDecoder);
+    }
+    pthread_mutex_unlock(&VideoPresentMutex);
+
+    // frame is free again, decoder can continue
+    VideoDisplayWakeup();
+}
+
+///
+/// Null module init.
+///
+/// @param display_name x11/xcb display name, unused
+///
+/// @returns always true.
+///
+static int NullInit( __attribute__ ((unused))
+    const char *display_name)
+{
+    Info("video/null: headless output, no x11 and gpu used");
+    return 1;
+}
+
+///
+/// Null module cleanup.
+///
+static void NullExit(void)
+{
+    if (NullActiveDecoder) {
+	NullDelHwDecoder(NullActiveDecoder);
+    }
+}
+
+///
+/// Null video module.
+///
+static const VideoModule NullModule = {
+    .Name = "null",
+    .Enabled = 0,
+    .NewHwDecoder = (VideoHwDecoder * (*const)(VideoStream *)) NullNewHwDecoder,
+    .DelHwDecoder = (void (*const) (VideoHwDecoder *))NullDelHwDecoder,
+    .ReleaseSurface = NoopReleaseSurface,
+    .get_format = (enum AVPixelFormat(*const) (VideoHwDecoder *, AVCodecContext *,
+	    const enum AVPixelFormat *))Null_get_format,
+    .RenderFrame = (void (*const) (VideoHwDecoder *, const AVCodecContext *, const AVFrame *))NullRenderFrame,
+    .GetFreeFrames = (int (*const) (const VideoHwDecoder *))NullGetFreeFrames,
+    .SetClock = (void (*const) (VideoHwDecoder *, int64_t))NullSetClock,
+    .GetClock = (int64_t(*const) (const VideoHwDecoder *))NullGetClock,
+    .SetClosing = (void (*const) (const VideoHwDecoder *))NullSetClosing,
+    .ResetStart = (void (*const) (const VideoHwDecoder *))NullResetStart,
+    .SetTrickSpeed = (void (*const) (const VideoHwDecoder *, int))NullSetTrickSpeed,
+    .GetStats = (char *(*const)(VideoHwDecoder *))NullGetStats,
+    .GetInfo = (char *(*const)(VideoHwDecoder *, const char *))NullGetInfo,
+    .SetBackground = NoopSetBackground,
+    .SetVideoMode = NoopVoid,
+    .ResetAutoCrop = NoopVoid,
+    .DisplayHandlerThread = NullDisplayHandlerThread,
+    .PresentHandlerThread = NullPresentHandlerThread,
+    .OsdClear = NoopVoid,
+    .OsdDrawARGB = NoopOsdDrawARGB,
+    .OsdInit = NoopOsdInit,
+    .OsdExit = NoopVoid,
+    .Init = NullInit,
+    .Exit = NullExit,
+};
+
+//----------------------------------------------------------------------------
+//  OSD
+//----------------------------------------------------------------------------
+
+///
+/// Clear the OSD.
+///
+/// @todo I use glTexImage2D to clear the texture, are there faster and
+/// better ways to clear a texture?
+///
+void VideoOsdClear(void)
+{
+    VideoThreadLock();
+    VideoUsedModule->OsdClear();
+
+    OsdDirtyX = VideoWindowWidth;	// reset dirty area
+    OsdDirtyY = VideoWindowHeight;
+    OsdDirtyWidth = 0;
+    OsdDirtyHeight = 0;
+    OsdShown = 0;
+
+    VideoThreadUnlock();
+}
+
+///
+/// Draw an OSD ARGB image.
+///
+/// @param xi	x-coordinate in argb image
+/// @param yi	y-coordinate in argb image
+/// @paran height   height in pixel in argb image
+/// @paran width    width in pixel in argb image
+/// @param pitch    pitch of argb image
+/// @param argb 32bit ARGB image data
+/// @param x	x-coordinate on screen of argb image
+/// @param y	y-coordinate on screen of argb image
+///
+void VideoOsdDrawARGB(int xi, int yi, int width, int height, int pitch, const uint8_t * argb, int x, int y)
+{
+    VideoThreadLock();
+    // update dirty area
     if (x < OsdDirtyX) {
 	if (OsdDirtyWidth) {
 	    OsdDirtyWidth += OsdDirtyX - x;
@@ -4369,14 +5746,39 @@ static int VideoIOErrorHandler( __attribute__ ((unused)) Display * display)
 {
 
     Error("video: fatal i/o error");
+    // vaPutSurface() is called from VideoPresentThread
+    if (VideoPresentThread && pthread_equal(VideoPresentThread, pthread_self())) {
+	Debug7("video: called from presentation thread");
+	VideoUsedModule = &NoopModule;
+	XlibDisplay = NULL;
+	VideoWindow = XCB_NONE;
+	// X11 is only used with the presentation lock held, release it
+	// for the decoder and VideoThreadLock()
+	pthread_mutex_unlock(&VideoPresentMutex);
+	// joined by VideoThreadExit() like a canceled thread
+	pthread_exit(PTHREAD_CANCELED);
+    }
     // should be called from VideoThread
     if (VideoThread && VideoThread == pthread_self()) {
 	Debug7("video: called from video thread");
 	VideoUsedModule = &NoopModule;
 	XlibDisplay = NULL;
 	VideoWindow = XCB_NONE;
+	// X11 is used inside VideoThreadLock(), release it for the
+	// presentation thread, if this thread holds it
+	if (pthread_equal(VideoLockOwner, pthread_self())) {
+	    VideoThreadUnlock();
+	}
 	pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
-	pthread_cond_destroy(&VideoWakeupCond);
+	if (VideoPresentThread) {
+	    // can enter Xlib again, don't join.  It leaves with its own i/o
+	    // error or at its next cancellation point.
+	    pthread_cancel(VideoPresentThread);
+	    pthread_detach(VideoPresentThread);
+	    VideoPresentThread = 0;
+	}
+	// wakeup and presentation lock are still used by the presentation
+	// thread, they are not destroyed
 	pthread_mutex_destroy(&VideoLockMutex);
 	pthread_mutex_destroy(&VideoMutex);
 	VideoThread = 0;
@@ -4510,7 +5912,9 @@ void VideoPollEvent(void)
 //----------------------------------------------------------------------------
 
 ///
-/// Lock video thread.
+/// Lock video threads.
+///
+/// Locks the decode and the presentation thread, always in this order.
 ///
 static void VideoThreadLock(void)
 {
@@ -4518,21 +5922,47 @@ static void VideoThreadLock(void)
 	if (pthread_mutex_lock(&VideoLockMutex)) {
 	    Error("video: can't lock thread");
 	}
+	if (pthread_mutex_lock(&VideoPresentMutex)) {
+	    Error("video: can't lock presentation thread");
+	}
+	VideoLockOwner = pthread_self();
     }
 }
 
 ///
-/// Unlock video thread.
+/// Unlock video threads.
 ///
 static void VideoThreadUnlock(void)
 {
     if (VideoThread) {
+	VideoLockOwner = 0;
+	if (pthread_mutex_unlock(&VideoPresentMutex)) {
+	    Error("video: can't unlock presentation thread");
+	}
 	if (pthread_mutex_unlock(&VideoLockMutex)) {
 	    Error("video: can't unlock thread");
 	}
     }
 }
 
+///
+/// Wait for video thread wakeup.
+///
+/// @param abstime  absolute CLOCK_MONOTONIC timeout
+///
+static void VideoThreadWait(const struct timespec *abstime)
+{
+    // called with cancellation disabled, no cleanup handler needed
+    pthread_mutex_lock(&VideoWakeupMutex);
+    while (!VideoWakeupPending) {
+	if (pthread_cond_timedwait(&VideoWakeupCond, &VideoWakeupMutex, abstime) == ETIMEDOUT) {
+	    break;
+	}
+    }
+    VideoWakeupPending = 0;
+    pthread_mutex_unlock(&VideoWakeupMutex);
+}
+
 ///
 /// Video render thread.
 ///
@@ -4554,16 +5984,50 @@ static void *VideoDisplayHandlerThread(void *dummy)
     return dummy;
 }
 
+///
+/// Video presentation thread.
+///
+static void *VideoPresentHandlerThread(void *dummy)
+{
+    Debug7("video: presentation thread started");
+
+    for (;;) {
+	pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+	pthread_testcancel();
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+	if (VideoUsedModule->PresentHandlerThread) {
+	    VideoUsedModule->PresentHandlerThread();
+	} else {			// module without own presentation
+	    usleep(20 * 1000);
+	}
+    }
+
+    return dummy;
+}
+
 ///
 /// Initialize video threads.
 ///
 static void VideoThreadInit(void)
 {
+    pthread_condattr_t condattr;
+
     pthread_mutex_init(&VideoMutex, NULL);
     pthread_mutex_init(&VideoLockMutex, NULL);
-    pthread_cond_init(&VideoWakeupCond, NULL);
+    pthread_mutex_init(&VideoPresentMutex, NULL);
+    pthread_mutex_init(&VideoWakeupMutex, NULL);
+    // display deadlines are CLOCK_MONOTONIC
+    pthread_condattr_init(&condattr);
+    pthread_condattr_setclock(&condattr, CLOCK_MONOTONIC);
+    pthread_cond_init(&VideoWakeupCond, &condattr);
+    pthread_condattr_destroy(&condattr);
     pthread_create(&VideoThread, NULL, VideoDisplayHandlerThread, NULL);
     pthread_setname_np(VideoThread, "vaapi video");
+    if (VideoUsedModule->PresentHandlerThread) {
+	pthread_create(&VideoPresentThread, NULL, VideoPresentHandlerThread, NULL);
+	pthread_setname_np(VideoPresentThread, "vaapi display");
+    }
 }
 
 ///
@@ -4575,6 +6039,15 @@ static void VideoThreadExit(void)
 	void *retval;
 
 	Debug7("video: video thread canceled");
+	if (VideoPresentThread) {
+	    if (pthread_cancel(VideoPresentThread)) {
+		Error("video: can't queue cancel video presentation thread");
+	    }
+	    if (pthread_join(VideoPresentThread, &retval) || retval != PTHREAD_CANCELED) {
+		Error("video: can't cancel video presentation thread");
+	    }
+	    VideoPresentThread = 0;
+	}
 	//VideoThreadLock();
 	// FIXME: can't cancel locked
 	if (pthread_cancel(VideoThread)) {
@@ -4586,6 +6059,8 @@ static void VideoThreadExit(void)
 	}
 	VideoThread = 0;
 	pthread_cond_destroy(&VideoWakeupCond);
+	pthread_mutex_destroy(&VideoWakeupMutex);
+	pthread_mutex_destroy(&VideoPresentMutex);
 	pthread_mutex_destroy(&VideoLockMutex);
 	pthread_mutex_destroy(&VideoMutex);
     }
@@ -4594,17 +6069,23 @@ static void VideoThreadExit(void)
 ///
 /// Video display wakeup.
 ///
-/// New video arrived, wakeup video thread.
+/// New video arrived or surface released, wakeup video thread.
 ///
 void VideoDisplayWakeup(void)
 {
-    if (!XlibDisplay) {			// not yet started
+    if (!XlibDisplay && !VideoHeadless) {   // not yet started
 	return;
     }
 
     if (!VideoThread) {			// start video thread, if needed
 	VideoThreadInit();
+	return;
     }
+
+    pthread_mutex_lock(&VideoWakeupMutex);
+    VideoWakeupPending = 1;
+    pthread_cond_signal(&VideoWakeupCond);
+    pthread_mutex_unlock(&VideoWakeupMutex);
 }
 
 //----------------------------------------------------------------------------
@@ -4618,7 +6099,8 @@ void VideoDisplayWakeup(void)
 ///
 static const VideoModule *VideoModules[] = {
     &VaapiModule,
-    &NoopModule
+    &NoopModule,
+    &NullModule
 };
 
 ///
@@ -4629,6 +6111,7 @@ struct _video_hw_decoder_
     union
     {
 	VaapiDecoder Vaapi;		///< VA-API decoder structure
+	NullDecoder Null;		///< null decoder structure
     };
 };
 
@@ -4737,6 +6220,22 @@ void VideoRenderFrame(VideoHwDecoder * hw_decoder, const AVCodecContext * video_
     VideoUsedModule->RenderFrame(hw_decoder, video_ctx, frame);
 }
 
+///
+/// Get number of frames the video output can still take.
+///
+/// @param hw_decoder	video hardware decoder
+///
+/// @returns free frames of the output ring buffer, modules without a
+/// ring buffer always have room.
+///
+int VideoGetFreeFrames(const VideoHwDecoder * hw_decoder)
+{
+    if (hw_decoder && VideoUsedModule->GetFreeFrames) {
+	return VideoUsedModule->GetFreeFrames(hw_decoder);
+    }
+    return 1;
+}
+
 ///
 /// Set video clock.
 ///
@@ -4950,6 +6449,11 @@ void VideoGetVideoSize(VideoHwDecoder * hw_decoder, int *width, int *height, int
 	*height = hw_decoder->Vaapi.InputHeight;
 	av_reduce(aspect_num, aspect_den, hw_decoder->Vaapi.InputWidth * hw_decoder->Vaapi.InputAspect.num,
 	    hw_decoder->Vaapi.InputHeight * hw_decoder->Vaapi.InputAspect.den, 1024 * 1024);
+    } else if (VideoUsedModule == &NullModule && hw_decoder->Null.Width && hw_decoder->Null.InputAspect.den) {
+	*width = hw_decoder->Null.Width;
+	*height = hw_decoder->Null.Height;
+	av_reduce(aspect_num, aspect_den, hw_decoder->Null.Width * hw_decoder->Null.InputAspect.num,
+	    hw_decoder->Null.Height * hw_decoder->Null.InputAspect.den, 1024 * 1024);
     }
 }
 
@@ -5228,7 +6732,10 @@ static VAStatus VaapiVideoSetColorbalance(VABufferID * buf, int Index, float val
 ///
 void VideoSetColorBalance(int onoff)
 {
+    VideoThreadLock();
     VideoColorBalance = onoff;
+    VideoSurfaceModesChanged = 1;
+    VideoThreadUnlock();
 }
 
 ///
@@ -5351,10 +6858,12 @@ int VideoGetHueConfig(int *minvalue, int *defvalue, int *maxvalue)
 void VideoSetSkinToneEnhancement(int stde)
 {
     // FIXME: test to check if working, than make module function
+    VideoThreadLock();
     if (VideoUsedModule == &VaapiModule) {
 	VideoSkinToneEnhancement = VideoConfigClamp(&VaapiConfigStde, stde);
     }
     VideoSurfaceModesChanged = 1;
+    VideoThreadUnlock();
 }
 
 ///
@@ -5610,6 +7119,7 @@ int VideoGetDeinterlaceModes(const char * **long_table, const char * **short_tab
 ///
 void VideoSetDeinterlace(int mode[VideoResolutionMax])
 {
+    VideoThreadLock();
     if (VideoUsedModule == &VaapiModule) {
 	for (int i = 0; i < VideoResolutionMax; ++i) {
 	    if (!VaapiDecoders[0]->SupportedDeinterlacers[mode[i]])
@@ -5622,6 +7132,7 @@ void VideoSetDeinterlace(int mode[VideoResolutionMax])
     VideoDeinterlace[3] = mode[3];
     VideoDeinterlace[4] = mode[4];
     VideoSurfaceModesChanged = 1;
+    VideoThreadUnlock();
 }
 
 ///
@@ -5629,6 +7140,7 @@ void VideoSetDeinterlace(int mode[VideoResolutionMax])
 ///
 void VideoSetDenoise(int level[VideoResolutionMax])
 {
+    VideoThreadLock();
     if (VideoUsedModule == &VaapiModule) {
 	for (int i = 0; i < VideoResolutionMax; ++i) {
 	    level[i] = VideoConfigClamp(&VaapiConfigDenoise, level[i]);
@@ -5640,6 +7152,7 @@ void VideoSetDenoise(int level[VideoResolutionMax])
     VideoDenoise[3] = level[3];
     VideoDenoise[4] = level[4];
     VideoSurfaceModesChanged = 1;
+    VideoThreadUnlock();
 }
 
 ///
@@ -5661,6 +7174,7 @@ int VideoGetDenoiseConfig(int *minvalue, int *defvalue, int *maxvalue)
 ///
 void VideoSetSharpen(int level[VideoResolutionMax])
 {
+    VideoThreadLock();
     if (VideoUsedModule == &VaapiModule) {
 	for (int i = 0; i < VideoResolutionMax; ++i) {
 	    level[i] = VideoConfigClamp(&VaapiConfigSharpen, level[i]);
@@ -5672,6 +7186,7 @@ void VideoSetSharpen(int level[VideoResolutionMax])
     VideoSharpen[3] = level[3];
     VideoSharpen[4] = level[4];
     VideoSurfaceModesChanged = 1;
+    VideoThreadUnlock();
 }
 
 ///
@@ -5695,12 +7210,14 @@ int VideoGetSharpenConfig(int *minvalue, int *defvalue, int *maxvalue)
 ///
 void VideoSetScaling(int mode[VideoResolutionMax])
 {
+    VideoThreadLock();
     VideoScaling[0] = mode[0];
     VideoScaling[1] = mode[1];
     VideoScaling[2] = mode[2];
     VideoScaling[3] = mode[3];
     VideoScaling[4] = mode[4];
     VideoSurfaceModesChanged = 1;
+    VideoThreadUnlock();
 }
 
 ///
@@ -5781,6 +7298,9 @@ int VideoRaiseWindow(void)
 {
     static const uint32_t values[] = { XCB_STACK_MODE_ABOVE };
 
+    if (!XlibDisplay) {			// headless or not started
+	return 0;
+    }
     xcb_configure_window(Connection, VideoWindow, XCB_CONFIG_WINDOW_STACK_MODE, values);
 
     return 1;
@@ -5798,10 +7318,21 @@ void VideoInit(const char *display_name)
     xcb_screen_iterator_t screen_iter;
     xcb_screen_t const *screen;
 
-    if (XlibDisplay) {			// allow multiple calls
+    if (XlibDisplay || VideoHeadless) {	// allow multiple calls
 	Debug7("video: x11 already setup");
 	return;
     }
+    // null module needs no x11 server
+    if (VideoDriverName && !strcasecmp(VideoDriverName, NullModule.Name)) {
+	if (!VideoWindowWidth || !VideoWindowHeight) {
+	    VideoWindowWidth = 1920;
+	    VideoWindowHeight = 1080;
+	}
+	NullModule.Init(display_name);
+	VideoUsedModule = &NullModule;
+	VideoHeadless = 1;
+	return;
+    }
     // Open the connection to the X server.
     // use the DISPLAY environment variable as the default display name
     if (!display_name && !(display_name = getenv("DISPLAY"))) {
@@ -5900,6 +7431,13 @@ void VideoInit(const char *display_name)
 ///
 void VideoExit(void)
 {
+    if (VideoHeadless) {
+	VideoThreadExit();
+	VideoUsedModule->Exit();
+	VideoUsedModule = &NoopModule;
+	VideoHeadless = 0;
+	return;
+    }
     if (!XlibDisplay) {			// no init or failed
 	return;
     }
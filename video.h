@@ -18,6 +18,7 @@ typedef struct __video_stream__ VideoStream;
 //----------------------------------------------------------------------------
 
 extern char VideoIgnoreRepeatPict;	///< disable repeat pict warning
+extern char VideoNullFreeRun;		///< null output displays without pacing
 extern int VideoAudioDelay;		///< audio/video delay
 extern char ConfigStartX11Server;	///< flag start the x11 server
 
@@ -43,6 +44,9 @@ extern enum AVPixelFormat Video_get_format(VideoHwDecoder *, AVCodecContext *, c
     /// Render a ffmpeg frame.
 extern void VideoRenderFrame(VideoHwDecoder *, const AVCodecContext *, const AVFrame *);
 
+    /// Get number of frames the video output can still take.
+extern int VideoGetFreeFrames(const VideoHwDecoder *);
+
     /// Poll video events.
 extern void VideoPollEvent(void);
 